@@ -75,6 +75,29 @@
         "tempDirectoryFromRperspective": "/tmp", // What R thinks the temp directory is.
         "tempDirectoryFromOurPerspective": "/tmp", // What We know it is. Separate, to allow for jailing of R server instances.
 
+        //
+        // How we get at files R makes (pager output, graphs): "shared"
+        // reads them from the directories above; "socket" fetches them
+        // over the R connection instead, for when R runs on another host
+        // or in a container we share no filesystem with. "socket" needs
+        // per-user sessions or a poolSize of 1.
+        //
+        "fileTransfer": "shared",
+
+        //
+        // Where Rserve listens. Defaults to 127.0.0.1, port 6311.
+        //
+        "host": "127.0.0.1",
+        "port": 6311,
+
+        //
+        // Alternatively, the path of Rserve's unix domain socket (as
+        // set by 'socket' in Rserv.conf). If set, host and port are
+        // ignored. This avoids the TCP stack when R runs on the same
+        // machine.
+        //
+        // "socket": "/var/run/Rserve/socket",
+
         //
         // Username and password to connect to RServe with.
         // Only used if RServe requires a username/password
@@ -87,6 +110,40 @@
         // Valid values are "single", "perUser"
         //
         "sessionManagement": "single",
+
+        //
+        // For "single" session management, the number of connections
+        // to Rserve shared by all users. Commands go to whichever
+        // connection is free, so one slow command doesn't hold up
+        // everyone else. Setup commands and scripts are run on each.
+        //
+        // NOTE: each connection is a separate R workspace. A user's
+        // commands all go to the connection they were first given, so
+        // 'x <- 1' then 'x' works, but users on different connections
+        // don't see each other's objects, and a user whose connection
+        // drops (or times out, see queryTimeout) starts with an empty
+        // workspace on another. Streamed results (?stream=true) need
+        // a poolSize of 1.
+        //
+        "poolSize": 1,
+
+        //
+        // Bytes of results (as sent by R) to keep per R session for
+        // side effect free requests, such as the R version shown in the
+        // blurb or the object browser listing. Any other request clears it.
+        // 0 turns the cache off.
+        //
+        "resultCacheBytes": 0,
+
+        //
+        // Seconds a user's R command may run before it is given up on,
+        // or 0 for no limit. Only R's time counts, not the time taken
+        // sending the result on to the client. The command then fails with a timeout
+        // error, and its R connection is replaced by a fresh one (set up
+        // again, but without the objects of the old session), so a
+        // runaway command holds up no one else for longer than this.
+        //
+        "queryTimeout": 0,
             
         //
         // If you have a per-user type of session management,
@@ -100,6 +157,25 @@
         //
         "idleSessionTimeout": 30,
 
+        //
+        // With per-user sessions, detach idle sessions instead of
+        // closing them: Rserve keeps the R process, and the user's next
+        // login reattaches to it in one round trip rather than setting
+        // up a new session. Detached sessions not reattached within
+        // detachedSessionTimeout minutes are closed.
+        //
+        "detachIdleSessions": false,
+        "detachedSessionTimeout": 480,
+
+        //
+        // With per-user sessions, the number of R connections to keep
+        // connected and set up ahead of logins (setup commands and
+        // global postConnectionScripts already run). Hit rate and refill
+        // times are in /__stats (for a logged in session) under
+        // "sessionPool".
+        //
+        "warmSessions": 0,
+
         //
         // To have R-Node run and manage the R server, set this
         // option to true
@@ -47,7 +47,7 @@ exports.handle = function(req, resp, sid, rNodeApi) {
         });
         resp.write (completedResponse);
         resp.end();
-    });
+    }, {cache: true, session: sid, priority: "background"});
 
     return true;
 }
@@ -67,7 +67,7 @@ function help_2_10_callback (req, resp, sid, rNodeApi) {
                 resp.write("Help doesn't appear to exist for '" + request + "'.");
                 resp.end();
             }
-        });
+        }, {session: sid, priority: "background"});
     } else {
         
         // R 2.9 has the following URL, while we need a different URL,
@@ -113,7 +113,7 @@ function help_2_10 (req, resp, sid, rNodeApi) {
         r.request(setupCmd, function (rResp) {
             ctx.rNodeHelpSetup = true;
             help_2_10_callback (req, resp, sid, rNodeApi);
-        });
+        }, {session: sid, priority: "background"});
     } else {
         help_2_10_callback (req, resp, sid, rNodeApi);
     }
@@ -154,13 +154,13 @@ function help_2_9(req, resp, sid, rNodeApi) {
                 resp.end();
 
                 // Remove our temporary variable
-                r.request ('rm(\'' + helpVar + '\')', function (r) {});
+                r.request ('rm(\'' + helpVar + '\')', function (r) {}, {session: sid, priority: "background"});
 
             } else {
                 resp.writeHeader(404, { "Content-Type": "text/plain" });
                 resp.end();
             }
-        });
+        }, {session: sid, priority: "background"});
     } else { // else we're requesting a specific file. Find the file.
         var path = rNodeApi.config.R.root + '/library/' + url.href.replace('/help', '');
         FS.realpath(path, function (err, resolvedPath) {
@@ -59,7 +59,7 @@ exports.handle = function (req, resp, sid, rNodeApi) {
         });
         resp.write (ret);
         resp.end();
-    });
+    }, {cache: true, session: sid, priority: "background"});
     return true;
 }
 
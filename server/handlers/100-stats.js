@@ -0,0 +1,50 @@
+/*
+    Copyright 2010 Jamie Love
+
+    This file is part of the "R-Node Server".
+
+    R-Node Server is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2.1 of the License, or
+    (at your option) any later version.
+
+    R-Node Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with R-Node Server.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+exports.name = "/__stats";
+
+exports.init = function (rNodeApi) {
+    rNodeApi.addRestrictedUrl (/^\/__stats/);
+}
+
+//
+// Timing histograms (send, compute, receive, decode, total - see
+// Connection::stats() in the binding), traffic and cache figures of the
+// session's R connection, and the perUser session pool's hit rate and
+// refill times, as JSON. Needs a logged in session (?sid=...), as the
+// figures say what the session has been doing.
+//
+exports.handle = function (req, resp, sid, rNodeApi) {
+    var r = rNodeApi.getRConnection(sid, true);
+    var stats = r ? r.stats() : {};
+    stats.sessionPool = rNodeApi.sessionPoolStats();
+    var ret = JSON.stringify (stats);
+    resp.writeHeader(200, { 
+        "Content-Type": "application/json",
+        "Content-Length": ret.length
+    });
+    resp.write (ret);
+    resp.end();
+    return true;
+}
+
+exports.canHandle = function (req, rNodeApi) {
+    return req.url.beginsWith ('/__stats');
+}
@@ -44,6 +44,8 @@ exports.name = "/pager";
  * 	path: path to file, as known by R-Node.
  *  mimeType: the mime type of the file (defaults to 'text/plain')
  *  toDelete: true to delete automatically after delivery to the client.
+ *  connection: if given, the R connection to fetch the file through
+ *      (R.fileTransfer "socket"); path is then the file as R knows it.
  * }
  * 
  * returns the key to use to get the file - URL will be /pager/*key*
@@ -55,11 +57,64 @@ function addFile (file) {
           file: file.path
         , mimeType: file.mimeType || 'text/plain'
         , deleteFile: file.toDelete
+        , connection: file.connection
     };
 	return key;
 }
 
 
+/**
+ * Stream a file from the R server's side through its R connection,
+ * pausing the transfer whenever the response can't keep up. If the
+ * client goes away, the rest of the file is read and dropped, so the
+ * connection isn't left paused.
+ */
+function streamFromR (d, req, resp, headers, callback) {
+    var r = d.connection;
+    var started = false;
+    var aborted = false;
+    var start = function () {
+        started = true;
+        var realHeaders = { "Content-Type": headers.contentType };
+        for (var i in headers) {
+            if (i != 'contentType')
+                realHeaders[i] = headers[i];
+        }
+        resp.writeHeader(200, realHeaders);
+    };
+
+    var onDrain = function () { r.resume(); };
+    var onClose = function () {
+        aborted = true; // let the rest of the file run through
+        r.resume();
+    };
+    resp.addListener ('drain', onDrain);
+    req.connection.addListener ('close', onClose);
+
+    r.readFile (d.file, function (data) {
+        if (aborted)
+            return;
+        if (!started)
+            start();
+        if (resp.write (data) === false)
+            r.pause();
+    }, function (result) {
+        req.connection.removeListener ('close', onClose);
+        resp.removeListener ('drain', onDrain);
+        var err = (typeof result === "number") ? null : result;
+        if (!started) {
+            if (err) {
+                resp.writeHeader(404, { "Content-Type": "text/plain" });
+            } else {
+                start(); // empty file
+            }
+        }
+        resp.end();
+        if (callback)
+            callback (err);
+    });
+}
+
 exports.init = function (rNodeApi) {
     rNodeApi.extend('addPagerFile', addFile)
     //rNodeApi.addRestrictedUrl (/\/pager\//); For now, don't restrict.
@@ -96,6 +151,18 @@ exports.handle = function (req, resp, sid, rNodeApi) {
     if (asAttachment)
         headers["content-disposition"] = 'attachment; filename=' + d.file;
 
+    if (d.connection) {
+        streamFromR (d, req, resp, headers, function (err) {
+            if (err)
+                rNodeApi.log (req, 'Error streaming paged file from R to client: ' + err);
+            if (!keep && d.deleteFile)
+                d.connection.removeFile (d.file);
+            if (!keep)
+                pageFiles[file] = null;
+        });
+        return true;
+    }
+
     UTILS.streamFile (d.file, resp, headers, function (err) {
         if (err)
             rNodeApi.log (req, 'Error streaming paged file to client: ' + err);
@@ -35,6 +35,98 @@ exports.init = function (rNodeApi) {
     }
 }
 
+/*
+ * Recognises, a chunk at a time as the upload arrives, a table of
+ * numbers that read.table() would take the same way - whitespace
+ * separated, no header, NA for missing values. Such a table goes to R
+ * with assign(), so R needn't see our filesystem or parse it; each
+ * chunk costs the event loop no more than its own lines. Once a line
+ * doesn't fit, the rest is only skipped over, and the file is left to
+ * read.table().
+ *
+ * As read.table() does, a column of whole numbers that all fit an R
+ * integer ends up integer: table() lists them, to convert once in R.
+ */
+function NumericTableParser () {
+    this.columns = null;
+    this.counts = [];     // numbers (not NA) per column
+    this.integer = [];    // whether every number so far is an integer
+    this.rest = '';       // the unfinished last line
+    this.failed = false;
+}
+
+NumericTableParser.prototype.number = /^[-+]?(\d+\.?\d*|\.\d+)([eE][-+]?\d+)?$/;
+NumericTableParser.prototype.integerText = /^[-+]?\d+$/;
+
+NumericTableParser.prototype.write = function (chunk) {
+    if (this.failed)
+        return;
+    var lines = (this.rest + chunk).split (/\r?\n/);
+    this.rest = lines.pop();
+    for (var i = 0; i < lines.length && !this.failed; ++i)
+        this.line (lines[i]);
+}
+
+NumericTableParser.prototype.line = function (line) {
+    line = line.replace (/^\s+|\s+$/g, '');
+    if (line.length == 0)
+        return;
+    if (line.indexOf ('#') >= 0) { // a comment for read.table
+        this.failed = true;
+        return;
+    }
+    var fields = line.split (/\s+/);
+    if (!this.columns) {
+        this.columns = [];
+        for (var j = 0; j < fields.length; ++j) {
+            this.columns.push ([]);
+            this.counts.push (0);
+            this.integer.push (true);
+        }
+    }
+    if (fields.length != this.columns.length) {
+        this.failed = true;
+        return;
+    }
+    for (var j = 0; j < fields.length; ++j) {
+        if (fields[j] == 'NA') {
+            this.columns[j].push (null);
+        } else if (this.number.test (fields[j])) {
+            var v = parseFloat (fields[j]);
+            if (this.integer[j] && !(this.integerText.test (fields[j]) && Math.abs (v) <= 2147483647))
+                this.integer[j] = false;
+            this.columns[j].push (v);
+            this.counts[j]++;
+        } else {
+            this.failed = true;
+            return;
+        }
+    }
+}
+
+/**
+ * The table as { values: { V1: [...], ... }, integer: ['V1', ...] }, or
+ * null if the file isn't one.
+ */
+NumericTableParser.prototype.table = function () {
+    if (!this.failed && this.rest.length > 0) {
+        this.line (this.rest);
+        this.rest = '';
+    }
+    if (this.failed || !this.columns)
+        return null;
+    var values = {};
+    var integer = [];
+    for (var j = 0; j < this.columns.length; ++j) {
+        if (this.counts[j] == 0) // all NA: logical for read.table
+            return null;
+        values['V' + (j + 1)] = this.columns[j];
+        if (this.integer[j])
+            integer.push ('V' + (j + 1));
+    }
+    return { values: values, integer: integer };
+}
+
 /**
  * File upload - on error we actually send back a 200 file, with the error
  * as a message. This is required because of how ExtJS deals with file upload
@@ -126,14 +218,35 @@ exports.handle = function (req, resp, sid, rNodeApi) {
         var ret = {
             success: true
         };
+        var reply = function (message) {
+            ret.message = message;
+            resp.writeHeader(200, { "Content-Type": "text/html" });
+            resp.write (JSON.stringify (ret));
+            resp.end();
+        };
+
+        var table = formData.rloading == "rloadingcustom" ? null : tableParser.table ();
 
         if (formData.rloading == "rloadingcustom") {
-            r.request (formData.nameOfRVariable + ' <- \'' + filename + '\'', function () {
-                ret.message = 'File successfully uploaded. You can access the filename from the variable \'' + formData.nameOfRVariable + '\'.';
-                resp.writeHeader(200, { "Content-Type": "text/html" });
-                resp.write (JSON.stringify (ret));
-                resp.end();
-            });
+            r.assign (formData.nameOfRVariable, filename, function () {
+                reply ('File successfully uploaded. You can access the filename from the variable \'' + formData.nameOfRVariable + '\'.');
+            }, {session: sid});
+        } else if (table) {
+            var name = formData.nameOfRVariable;
+            var convert = name + ' <- as.data.frame(' + name + ')';
+            if (table.integer.length > 0) {
+                var columns = JSON.stringify (table.integer).replace (/^\[/, 'c(').replace (/\]$/, ')');
+                convert = name + '[' + columns + '] <- lapply(' + name + '[' + columns + '], as.integer); ' + convert;
+            }
+            r.assign (name, table.values, function (ok) {
+                if (ok !== true) {
+                    reply ('File successfully uploaded, but R was unable to take its data: ' + (ok && ok.message));
+                    return;
+                }
+                r.request (convert, function () {
+                    reply ('File successfully uploaded. Its data is in \'' + formData.nameOfRVariable + '\'.');
+                }, {session: sid});
+            }, {session: sid});
         } else {
             r.request (formData.nameOfRVariable + ' <- read.table(\'' + filename + '\')', function () { 
                 // Now we've attempted the load, check we have the data
@@ -144,7 +257,7 @@ exports.handle = function (req, resp, sid, rNodeApi) {
                             resp.writeHeader(200, { "Content-Type": "text/html" });
                             resp.write (JSON.stringify (ret));
                             resp.end();
-                        });
+                        }, {session: sid});
 
                     } else {
                         ret.message = 'File successfully uploaded. if parsable, its output will be in \'' + formData.nameOfRVariable + '\'.';
@@ -152,17 +265,19 @@ exports.handle = function (req, resp, sid, rNodeApi) {
                         resp.write (JSON.stringify (ret));
                         resp.end();
                     }
-                });
-            });
+                }, {session: sid});
+            }, {session: sid});
         }
     });
 
     var saveFileNow = false;
+    var tableParser = new NumericTableParser();
 
     parser.ondata = function (part) {
-        if (saveFileNow)
+        if (saveFileNow) {
             FS.writeSync (fd, part, null, "utf8");
-        else {
+            tableParser.write (part);
+        } else {
             formData[lastFormField] = formData.lastFormField ? formData.lastFormField : '';
             formData[lastFormField] += part;
         }
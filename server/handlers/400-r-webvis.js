@@ -90,7 +90,7 @@ exports.handle = function (req, resp, sid, rNodeApi) {
 	        resp.write (str);
 	        resp.end();
 		}
-	})
+	}, {session: sid})
 	
     return true;
 }
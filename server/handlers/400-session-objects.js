@@ -27,6 +27,46 @@ exports.init = function (rNodeApi) {
     rNodeApi.addRestrictedUrl (/^\/_R\/objects/);
 }
 
+/*
+ * One eval describing a page of the workspace: the names of objects
+ * 'offset' to 'offset + count' (of 'total', in ls() order) with their
+ * typeof, first class, dim (as "2x3", or "" if none) and object.size.
+ */
+function describeObjects (offset, count) {
+    return "local({ e <- globalenv(); all <- ls(e); total <- length(all); " +
+        "n <- all[seq_len(max(min(" + count + ", total - " + offset + "), 0)) + " + offset + "]; " +
+        "o <- lapply(n, get, envir=e); " +
+        "list(total=total, names=n, " +
+            "type=unlist(lapply(o, typeof)), " +
+            "class=unlist(lapply(o, function (x) class(x)[1])), " +
+            "dims=unlist(lapply(o, function (x) paste(dim(x), collapse='x'))), " +
+            "size=unlist(lapply(o, function (x) as.numeric(object.size(x))))) })";
+}
+
+/*
+ * The ETag of a listing: the workspace's version (see workspaceVersion()
+ * in rserve.js) and the page. A refresh before anything has run that
+ * could change the workspace gets a 304 straight away, without asking R
+ * to list, or size, anything.
+ */
+function version (r, page) {
+    return '"' + r.workspaceVersion() + '.' + page + '"';
+}
+
+function notModified (req, resp, etag) {
+    if (req.headers['if-none-match'] != etag)
+        return false;
+    resp.writeHeader(304, { "ETag": etag });
+    resp.end();
+    return true;
+}
+
+/*
+ * node=root lists the workspace objects for the object browser, all in
+ * one round trip. Each entry is { id, text, leaf, type, class, dims,
+ * size }. Given start and/or limit, the response is one page of them:
+ * { total, start, objects: [...] }.
+ */
 exports.handle = function (req, resp, sid, rNodeApi) {
     var url = URL.parse (req.url, true);
     var node = (url.query && url.query.node) ? url.query.node : null;
@@ -40,34 +80,45 @@ exports.handle = function (req, resp, sid, rNodeApi) {
     var r = rNodeApi.getRConnection(sid, false);
 
     if (node == "root") {
-        r.request ('ls()', function (rResp) {
+        var paged = url.query.start !== undefined || url.query.limit !== undefined;
+        var start = Math.max(parseInt(url.query.start || 0, 10) || 0, 0);
+        var limit = Math.max(parseInt(url.query.limit || 0, 10) || 0, 0) || 1000000;
+        var page = paged ? start + '-' + limit : 'all';
+
+        if (notModified (req, resp, version (r, page)))
+            return true;
+
+        r.request (describeObjects(start, limit), function (rResp) {
+            var d = rResp && rResp.data;
+            if (!d) {
+                resp.writeHeader(500, { "Content-Type": "text/plain" }); 
+                resp.write (JSON.stringify (rResp));
+                resp.end();
+                return;
+            }
+
             var list = [];
-            var counter = 0;
-            rResp.forEach (function (i) {
-                var a = {
-                    id: i
-                    , text: i
+            var names = d.names || [];
+            for (var i = 0; i < names.length; ++i) {
+                list.push ({
+                    id: names[i]
+                    , text: names[i] + ' (' + d.type[i] + ')'
                     , leaf: true
-                };
-                counter ++;
-                r.request ('typeof(' + i + ')', function (resp2) {
-                    counter --;
-                    a.text = i + ' (' + resp2[0] + ')';
-                    if (counter == 0) {
-                        resp.writeHeader(200, { "Content-Type": "text/plain" }); 
-                        resp.write (JSON.stringify (list));
-                        resp.end();
-                    }
+                    , type: d.type[i]
+                    , "class": d['class'][i]
+                    , dims: d.dims[i]
+                    , size: d.size[i]
                 });
-                list.push(a);
-            });
-
-            if (counter == 0) {
-                resp.writeHeader(200, { "Content-Type": "text/plain" }); 
-                resp.write (JSON.stringify (list));
-                resp.end();
             }
-        });
+
+            // the version the listing was made at
+            var etag = version (r, page);
+            if (notModified (req, resp, etag))
+                return;
+            resp.writeHeader(200, { "Content-Type": "text/plain", "ETag": etag });
+            resp.write (JSON.stringify (paged ? { total: d.total[0], start: start, objects: list } : list));
+            resp.end();
+        }, {cache: true, session: sid, priority: "background"});
     } else {
         resp.writeHeader(401, { "Content-Type": "text/plain" }); 
         resp.end();
@@ -27,6 +27,8 @@ exports.name = "/R";
 
 var ourTempDirectory;
 var rTempDirectory;
+var fileTransfer; // "shared" (a filesystem shared with R), or "socket"
+var queryTimeoutMs; // 0 for none
 
 var defaultReturnFormat = "raw";
 
@@ -55,12 +57,35 @@ function isRestricted (cmd) {
     return false;
 }
 
-function pager (rResp, rNodeApi) {
+/*
+ * The R connection to fetch R's files through, when they don't show up
+ * in a filesystem we share with R.
+ */
+function fileConnection (r) {
+    return fileTransfer == "socket" && r.readFile ? r : null;
+}
+
+/*
+ * The options of a user's command: 'extra', with the query timeout and
+ * the session to queue it under on a shared connection.
+ */
+function userOptions (sid, extra) {
+    var o = { session: sid };
+    for (var k in extra || {})
+        o[k] = extra[k];
+    if (queryTimeoutMs > 0)
+        o.timeoutMs = queryTimeoutMs;
+    return o;
+}
+
+function pager (rResp, r, rNodeApi) {
+    var connection = fileConnection (r);
     for (var i = 0; i < rResp.values.length; i++) {
         var key = rNodeApi.addPagerFile({
-            path: rResp.values[i].replace(rTempDirectory, ourTempDirectory)
+            path: connection ? rResp.values[i] : rResp.values[i].replace(rTempDirectory, ourTempDirectory)
             , mimeType: 'text/plain'
             , toDelete: rResp.attributes['delete'] == "TRUE" 
+            , connection: connection
         });
         rResp.values[i] = key;
     }
@@ -93,10 +118,12 @@ function handleGraphicalCommand (r, parsedRequest, httpRequest, resp, sid, rNode
         function (rResp) {
             if (rResp.length && rResp[0] == "ok") {
 
+                var connection = fileConnection (r);
                 var key = rNodeApi.addPagerFile({
-                    path: context.graphing.file.ours
+                    path: connection ? context.graphing.file.r : context.graphing.file.ours
                     , mimeType: 'image/' + type
                     , toDelete: false
+                    , connection: connection
                 });
 
                 resp.writeHeader(200, { "Content-Type": "text/plain" });
@@ -118,10 +145,166 @@ function handleGraphicalCommand (r, parsedRequest, httpRequest, resp, sid, rNode
                 resp.write (str);
                 resp.end();
             }
-    });
+    }, userOptions (sid));
+
+    return true;
+
+}
+
+/*
+ * ?format=binary: the result goes out as the binding's binary frame (see
+ * binaryFrame in src/binding.cc), the SEXP as Rserve sent it behind an
+ * 8 byte header. Numeric vectors stay raw little endian doubles and
+ * int32s, so large results skip JSON encoding here and parsing in the
+ * browser. Pager results are not turned into pager keys in this format.
+ */
+function handleBinaryCommand (r, request, httpRequest, resp, sid, rNodeApi) {
+    r.request(request, function (rResp) {
+        rNodeApi.log (httpRequest, 'Result of R command: \'' + request + '\' received.');
+
+        if (!(rResp instanceof Buffer)) { // an error
+            var str = JSON.stringify(rResp);
+            resp.writeHeader(500, {
+              "Content-Length": str.length,
+              "Content-Type": "text/plain"
+            });
+            resp.write (str);
+            resp.end();
+            return;
+        }
 
+        resp.writeHeader(200, {
+          "Content-Length": rResp.length,
+          "Content-Type": "application/octet-stream"
+        });
+        resp.write (rResp);
+        resp.end();
+    }, userOptions (sid, { binary: true }));
     return true;
+}
+
+/*
+ * ?stream=true: the result is written out, with chunked transfer encoding,
+ * while it is received from R - a vector's values or a list's elements at
+ * a time - rather than decoded, stringified and sent whole. When the
+ * response can't take more, reading from R pauses until it drains, so a
+ * large export only ever has a chunk or so of it in memory. A list's
+ * numeric and character columns are written out a slice at a time too;
+ * other elements (factor columns, nested lists) are held until complete.
+ *
+ * The JSON is always { values: [...], attributes } or, for named lists,
+ * { data: { name: value, ... }, attributes } as for other named results.
+ * Pager results are not turned into pager keys in this format.
+ *
+ * With a pool of R connections (R.poolSize above 1) there is no
+ * streaming: such requests get a 501 rather than the buffered result,
+ * whose JSON is shaped differently.
+ */
+function handleStreamedCommand (r, request, httpRequest, resp, sid, rNodeApi) {
+    var started = false;
+    var named = false;
+    var count = 0;
+    var aborted = false;
+    var element; // the list element being written out a slice at a time
+    var parts = 0;
+
+    function start (isNamed) {
+        started = true;
+        named = isNamed;
+        resp.writeHeader(200, {
+          "Content-Type": "text/plain",
+          "Transfer-Encoding": "chunked"
+        });
+        resp.write (named ? '{"data":{' : '{"values":[');
+    }
+
+    function write (str) {
+        if (!aborted && resp.write (str) === false)
+            r.pause();
+    }
+
+    var onClose = function () {
+        aborted = true; // let the rest of the result run through
+        r.resume();
+    };
+    resp.addListener ('drain', function () { r.resume(); });
+    httpRequest.connection.addListener ('close', onClose);
+
+    function closeElement () {
+        if (element !== undefined)
+            write (']');
+        element = undefined;
+    }
+
+    var onChunk = function (value, index, name, slice, of) {
+        if (!started)
+            start ((!slice || of !== undefined) && typeof name === 'string');
+        if (of !== element)
+            closeElement();
+
+        var str;
+        if (slice) {
+            str = JSON.stringify(value.length === undefined ? [] : Array.prototype.slice.call(value));
+            str = str.substring(1, str.length - 1);
+            if (of !== undefined && element === undefined) { // a list element's first slice
+                element = of;
+                parts = str.length > 0 ? 1 : 0;
+                if (named)
+                    str = JSON.stringify(typeof name === 'string' ? name : String(of)) + ':[' + str;
+                else
+                    str = '[' + str;
+                write ((count++ > 0 ? ',' : '') + str);
+                return;
+            }
+            if (str.length == 0)
+                return;
+            if (of !== undefined) {
+                write ((parts++ > 0 ? ',' : '') + str);
+                return;
+            }
+        } else {
+            str = JSON.stringify(value);
+            if (str === undefined)
+                str = 'null';
+            if (named)
+                str = JSON.stringify(typeof name === 'string' ? name : String(index)) + ':' + str;
+        }
+        write ((count++ > 0 ? ',' : '') + str);
+    };
+
+    r.request(request, function (rResp) {
+        rNodeApi.log (httpRequest, 'Result of R command: \'' + request + '\' streamed.');
+        httpRequest.connection.removeListener ('close', onClose);
+
+        if (!rResp || rResp.stack) { // an error
+            if (!started) {
+                var str = JSON.stringify(rResp);
+                resp.writeHeader(500, {
+                  "Content-Length": str.length,
+                  "Content-Type": "text/plain"
+                });
+                resp.write (str);
+            }
+            resp.end(); // a truncated stream, if it was under way
+            return;
+        }
+
+        if (!started)
+            start (false);
+        closeElement();
 
+        var attributes = rResp.attributes;
+        if (named && attributes) {
+            attributes = {};
+            for (var a in rResp.attributes) {
+                if (a != 'names')
+                    attributes[a] = rResp.attributes[a];
+            }
+        }
+        write ((named ? '}' : ']') + ',"attributes":' + JSON.stringify(attributes || null) + '}');
+        resp.end();
+    }, userOptions (sid, { stream: true, onChunk: onChunk }));
+    return true;
 }
 
 function isGraphical(parsedRequest) {
@@ -171,10 +354,29 @@ exports.handle = function (req, resp, sid, rNodeApi) {
         request = "rNodePrint(" + request + ")";
     }
 
+    if (format == "binary") {
+        return handleBinaryCommand (r, request, req, resp, sid, rNodeApi);
+    }
+
+    if (url.query.stream) {
+        if (!r.pause) { // a pool connection can't stream
+            rNodeApi.log (req, 'R command \'' + request + '\' asked to stream, but the R connection is a pool.');
+            var str = "Streamed results need an R connection of their own; this server shares a pool of them (R.poolSize).";
+            resp.writeHeader(501, {
+              "Content-Length": str.length,
+              "Content-Type": "text/plain"
+            });
+            resp.write (str);
+            resp.end();
+            return true;
+        }
+        return handleStreamedCommand (r, request, req, resp, sid, rNodeApi);
+    }
+
     r.request(request, function (rResp) {
             
         if (rResp && rResp.attributes && rResp.attributes.class && rResp.attributes.class[0] == 'RNodePager') {
-            pager (rResp, rNodeApi);
+            pager (rResp, r, rNodeApi);
         }
 
         var str = JSON.stringify(rResp);
@@ -187,7 +389,7 @@ exports.handle = function (req, resp, sid, rNodeApi) {
         });
         resp.write (str);
         resp.end();
-    });
+    }, userOptions (sid));
     return true;
 }
 
@@ -196,6 +398,8 @@ exports.init = function (rNodeApi) {
 
     ourTempDirectory = rNodeApi.config.R.tempDirectoryFromOurPerspective;
     rTempDirectory = rNodeApi.config.R.tempDirectoryFromRperspective;       
+    fileTransfer = rNodeApi.config.R.fileTransfer || "shared";
+    queryTimeoutMs = (rNodeApi.config.R.queryTimeout || 0) * 1000;
 }
 
 exports.canHandle = function (req, rNodeApi) {
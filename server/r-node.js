@@ -39,6 +39,19 @@ var Config = UTILS.loadJsonFile("configuration", "etc/config.js", "etc/config-ex
 var AUTH = require ('./authenticators/' + Config.authentication.type.replace(/[^a-zA-Z-_]/g, '')).auth;
 var Authenticator = AUTH.instance();
 var sessions = {};
+var detachedSessions = {}; // by username, see detachRSession
+var warmSessions = [];     // set up connections waiting for a perUser login, see refillWarmSessions
+var warmPool = {
+    refilling: 0,
+    hits: 0,
+    misses: 0,
+    refills: 0,
+    refillFailures: 0,
+    refillTotalMs: 0,
+    refillMaxMs: 0,
+    lastRefillMs: 0,
+    retrying: false
+};
 
 var requiredSetupSteps = {
     "auth": false,
@@ -84,6 +97,22 @@ var rNodeApi = {
     }
     , log: nodelog
     , config: Config
+    , sessionPoolStats: function () {
+        var taken = warmPool.hits + warmPool.misses;
+        return {
+            size: Config.R.warmSessions || 0,
+            ready: warmSessions.length,
+            refilling: warmPool.refilling,
+            hits: warmPool.hits,
+            misses: warmPool.misses,
+            hitRate: taken ? warmPool.hits / taken : 0,
+            refills: warmPool.refills,
+            refillFailures: warmPool.refillFailures,
+            refillMeanMs: warmPool.refills ? warmPool.refillTotalMs / warmPool.refills : 0,
+            refillMaxMs: warmPool.refillMaxMs,
+            lastRefillMs: warmPool.lastRefillMs
+        };
+    }
 }
 
 /**
@@ -119,11 +148,152 @@ function cleanOutSessions() {
         // And the global session won't have one as well, so check we have an
         // Rconnection variable.
         if (Config.R.sessionManagement == "perUser") {
-            if (sessions[s].Rconnection)
-                sessions[s].Rconnection.close();
+            if (sessions[s].Rconnection) {
+                if (Config.R.detachIdleSessions && sessions[s].username)
+                    detachRSession (sessions[s]);
+                else
+                    sessions[s].Rconnection.close();
+            }
+        } else if (sessions[s].Rconnection && sessions[s].Rconnection.endSession) {
+            sessions[s].Rconnection.endSession (s); // a pool's connection for the session
         }
         delete sessions[s];
     });
+
+    var maxDetachedTime = (Config.R.detachedSessionTimeout || 480) * 60 * 1000;
+    for (var u in detachedSessions) {
+        if (new Date().getTime() - detachedSessions[u].detachTime.getTime() > maxDetachedTime) {
+            nodelog(null, "Closing detached R session of " + u);
+            closeDetachedSession (detachedSessions[u]);
+            delete detachedSessions[u];
+        }
+    }
+}
+
+/**
+ * Park an idle user's R session with Rserve rather than closing it, so
+ * that their next login can pick it up (resumeRSession) without
+ * running the session setup again.
+ */
+function detachRSession (session) {
+    var r = session.Rconnection;
+    var username = session.username;
+    r.detach (function (detached) {
+        if (!detached || !detached.key) {
+            nodelog(null, "Cannot detach R session of " + username + ", closing it: " + detached);
+            r.close();
+            return;
+        }
+        if (detachedSessions[username]) // from an earlier login
+            closeDetachedSession (detachedSessions[username]);
+        detachedSessions[username] = {
+            session: detached,
+            context: session.context,
+            detachTime: new Date()
+        };
+        nodelog(null, "Detached R session of " + username);
+    });
+}
+
+/**
+ * The R connection to the user's detached session, if they have one and
+ * it can still be attached to; callback (ok, r, context).
+ */
+function resumeRSession (username, callback) {
+    var d = detachedSessions[username];
+    if (!d) {
+        callback (false);
+        return;
+    }
+    delete detachedSessions[username];
+
+    var r = new RSERVE.RservConnection();
+    if (Config.R.resultCacheBytes)
+        r.cache(Config.R.resultCacheBytes);
+    r.attach (d.session, function (ok) {
+        nodelog(null, "Reattached R session of " + username + ": " + ok);
+        callback (ok, r, d.context);
+    });
+}
+
+/**
+ * A detached session only ends when a client attaches and closes it.
+ */
+function closeDetachedSession (d) {
+    var r = new RSERVE.RservConnection();
+    r.attach (d.session, function (ok) {
+        if (ok)
+            r.close();
+    });
+}
+
+/**
+ * Keep Config.R.warmSessions connections for perUser logins connected
+ * and set up (core setup commands and global post connection scripts),
+ * so that a login only has the user's own scripts to run.
+ */
+function refillWarmSessions () {
+    var size = Config.R.warmSessions || 0;
+    var failed = function (why) {
+        warmPool.refilling--;
+        warmPool.refillFailures++;
+        if (warmPool.retrying)
+            return;
+        warmPool.retrying = true;
+        nodelog(null, why + " for the session pool, retrying shortly.");
+        setTimeout (function () {
+            warmPool.retrying = false;
+            refillWarmSessions();
+        }, 5000);
+    };
+    while (!warmPool.retrying && warmSessions.length + warmPool.refilling < size) {
+        warmPool.refilling++;
+        var start = new Date().getTime();
+        getRConnection (function (ok, r) {
+            if (!ok) {
+                failed ("Cannot connect to R");
+                return;
+            }
+            var warm = { r: r, context: { preferences: {} } };
+            setupRSession (r, warm, function (ok) {
+                if (!ok) {
+                    r.close();
+                    failed ("Cannot set up an R session");
+                    return;
+                }
+                var ms = new Date().getTime() - start;
+                warmPool.refilling--;
+                warmPool.refills++;
+                warmPool.refillTotalMs += ms;
+                warmPool.lastRefillMs = ms;
+                if (ms > warmPool.refillMaxMs)
+                    warmPool.refillMaxMs = ms;
+                warmSessions.push (warm);
+            }, { core: true, globalScripts: true });
+        });
+    }
+}
+
+/**
+ * A set up connection from the pool, or null (a miss).
+ */
+function takeWarmSession () {
+    if (!Config.R.warmSessions)
+        return null;
+    var warm = null;
+    while (!warm && warmSessions.length > 0) {
+        warm = warmSessions.shift();
+        if (warm.r.connection.state != "idle") { // lost meanwhile
+            warm.r.close();
+            warm = null;
+        }
+    }
+    if (warm)
+        warmPool.hits++;
+    else
+        warmPool.misses++;
+    refillWarmSessions();
+    return warm;
 }
 
 function createSessionContext (sid) {
@@ -157,21 +327,48 @@ function login (req, resp) {
                         resp.end();
                         break;
                     case "perUser":
+                        var respond = function () {
+                            resp.writeHeader(200, { "Content-Type": "text/plain" });
+                            resp.write(sid);
+                            resp.end();
+                        }
+                        var fresh = function () {
+                            var warm = takeWarmSession();
+                            if (!warm) {
+                                getRConnection (cb);
+                                return;
+                            }
+                            session.context.Rversion = warm.context.Rversion;
+                            setupRSession (warm.r, session, function (ok) {
+                                session.Rconnection = warm.r;
+                                respond();
+                            }, { userScripts: true });
+                        }
                         var cb = function (ok, r) {
                             if (ok) {
                                 setupRSession (r, session, function (ok) {
                                     // Note assume ok.
                                     session.Rconnection = r;
-                                    resp.writeHeader(200, { "Content-Type": "text/plain" });
-                                    resp.write(sid);
-                                    resp.end();
+                                    respond();
                                 });
                             } else {
                                 resp.writeHeader(503, { "Content-Type": "text/plain" });
                                 resp.end();
                             }
                         }
-                        getRConnection (cb); 
+                        if (!Config.R.detachIdleSessions) {
+                            fresh();
+                            break;
+                        }
+                        resumeRSession (username, function (ok, r, context) {
+                            if (!ok) {
+                                fresh();
+                                return;
+                            }
+                            session.Rconnection = r;
+                            session.context = context; // already set up
+                            respond();
+                        });
                         break;
 
                     default:
@@ -276,7 +473,13 @@ function authorizedRequestMgr (req, resp, sid) {
     }
 }
 
-function setupRSession (connection, sessionData, callback) {
+/**
+ * Set up a new R session. 'stages' picks the parts to run - core (our
+ * own setup commands), globalScripts and userScripts (the post connection
+ * scripts) - all of them if left out.
+ */
+function setupRSession (connection, sessionData, callback, stages) {
+    stages = stages || { core: true, globalScripts: true, userScripts: true };
 
     // Each session has a graphing target that is
     // set up to take all graphing commands. It then
@@ -307,8 +510,9 @@ function setupRSession (connection, sessionData, callback) {
         nodelog (null, "WARNING: user post connection script directory '" + userScriptDirectory + "' is not readable: " + e);
     }
 
-    scripts = globalScripts.map(function (s) { return [s, globalScriptDirectory + "/" + s]; });
-    if (sessionData.username) { // Username only set on per user sessions, and user login required.
+    if (stages.globalScripts)
+        scripts = globalScripts.map(function (s) { return [s, globalScriptDirectory + "/" + s]; });
+    if (stages.userScripts && sessionData.username) { // Username only set on per user sessions, and user login required.
         var userMatch = '_' + sessionData.username + '_';
         userScripts.forEach (function (s) { 
             if (s.match (userMatch)) {
@@ -318,53 +522,92 @@ function setupRSession (connection, sessionData, callback) {
     }
     nodelog (null, "Running R setup files: " + scripts.map (function (s) { return s[0] }).join (","));
 
-    var runPostConnectionScripts = function(fi) {
+    // Copy the scripts to R's tmp directory, then source them into the
+    // session along with the core setup commands: all of it goes to R
+    // as one batch, a single round trip.
+    var batch = [];
+    var batchCallbacks = [];
+    if (stages.core) {
+        rnodeSetupCommands.forEach (function (cmd) {
+            var cb = null;
+            if (typeof cmd !== "string") {
+                cb = cmd.callback;
+                cmd = cmd.command;
+            }
+            nodelog (null, "Running R setup command '" + cmd + "'");
+            batch.push ({ command: cmd, keep: cb != null });
+            batchCallbacks.push (cb);
+        });
+    }
+
+    var runBatch = function () {
+        if (batch.length == 0) {
+            callback (true);
+            return;
+        }
+        connection.requestBatch (batch, function (results) {
+            if (!results || results.length === undefined) {
+                nodelog (null, "Error running R setup: " + JSON.stringify (results));
+                callback (false);
+                return;
+            }
+            results.forEach (function (resp, i) {
+                var failed = resp && resp.attributes && resp.attributes['class'] == 'try-error';
+                if (batch[i].script) {
+                    nodelog (null, (failed ? 'Error running R setup file ' : 'Successfull run R setup file: ') +
+                        batch[i].script + (failed ? ': ' + JSON.stringify (resp) : ''));
+                } else {
+                    nodelog (null, 'Setup command response: ' + JSON.stringify (resp));
+                    if (batchCallbacks[i] && !failed)
+                        batchCallbacks[i] (resp);
+                }
+            });
+            callback (true);
+        });
+    }
+
+    var copyPostConnectionScripts = function(fi) {
         if (fi < scripts.length) {
-            // Copy file to R's tmp directory, then source it into the session
             var dest = Config.R.tempDirectoryFromOurPerspective + "/" + scripts[fi][0];
             UTILS.cp (scripts[fi][1], dest, function (err) {
                 if (err) {
                     nodelog (null, "Error running R setup file '" + scripts[fi][0] + "': " + err);
                     callback (false); 
                 } else {
-                    connection.request ("source(\"" + dest + "\")", function (resp) { 
-                        nodelog(null, 'Successfull run R setup file: ' + scripts[fi][0]);
-                        runPostConnectionScripts (++fi);
-                    });
+                    batch.push ({ command: "source(\"" + dest + "\")", script: scripts[fi][0] });
+                    copyPostConnectionScripts (++fi);
                 }
             });
         } else {
-            callback (true);
+            runBatch();
         }
     }
+    copyPostConnectionScripts(0);
+}
 
-    // Run aech core setup command in turn, then once finished,
-    // call the above function to do the post connectino scripts,
-    // if there are any.
-    var runs = function (i) {
-        if (i < rnodeSetupCommands.length) {
-            var cmd = rnodeSetupCommands[i];
-            var cb = null;
-            if (typeof cmd !== "string") {
-                cb = cmd.callback;
-                cmd = cmd.command;
-            }
-            nodelog (null, "Running R setup command '" + cmd + "'");
-            connection.request (cmd, function (resp) { 
-                nodelog(null, 'Setup command response: ' + JSON.stringify (resp));
-                if (cb) cb(resp);
-                runs (++i);
-            });
-        } else {
-            runPostConnectionScripts(0);
-        }
+/**
+ * A new connection to Rserve, logged in if need be. The callback gets
+ * (true, connection), or false - always from the event loop, never
+ * before getRConnection returns.
+ */
+function getRConnection (callback, poolSize) {
+    var r = poolSize > 1 ? new RSERVE.RservPool(poolSize) : new RSERVE.RservConnection();
+    var host = Config.R.socket || Config.R.host;
+    var port = Config.R.socket ? -1 : Config.R.port;
+    if (Config.R.resultCacheBytes)
+        r.cache(Config.R.resultCacheBytes);
+    try {
+        r.connect(host, port, connected);
+    } catch (e) { // e.g. no unix socket at that path
+        nodelog (null, "Cannot connect to R: " + e.message);
+        setTimeout (function () { callback (false); }, 0);
     }
-    runs (0);
-}
 
-function getRConnection (callback) {
-    var r = new RSERVE.RservConnection();
-    r.connect(function (requireLogin) {
+    function connected (ok, requireLogin) {
+        if (!ok) {
+            callback (false);
+            return;
+        }
         if (requireLogin) {
             nodelog (null, "RServe requires login. Using information from config.");
             if (Config.R.username && Config.R.password) {
@@ -380,7 +623,7 @@ function getRConnection (callback) {
         } else {
             callback (true, r);
         }
-    });
+    }
 }
 
 // Run the R server, if we are asked to.
@@ -449,7 +692,10 @@ function testRConnection (callback) {
         callback (ok);
     };
 
-    getRConnection (ourCallback);
+    // In "single" mode everyone shares this connection, so let it be a pool
+    // of connections if configured.
+    var poolSize = Config.R.sessionManagement == "single" ? (Config.R.poolSize || 1) : 1;
+    getRConnection (ourCallback, poolSize);
 }
 
 
@@ -460,6 +706,9 @@ function conditionallyGoLive () {
         }
     }
 
+    if (Config.R.sessionManagement == "perUser")
+        refillWarmSessions();
+
     var ui = HTTP.createServer(requestMgr);
     ui.addListener ('listening', function () {
         nodelog (null, 'R-Node Listening on port: \'' + Config.listen.port + '\', interface: \'' + (Config.listen.interface ? Config.listen.interface : 'all') + '\'');
@@ -20,42 +20,204 @@
 var SYS     = require("sys");
 var BINDING = require("./binding");
 
+/**
+ * Priority classes of requests (options.priority), highest first. Every
+ * waiting "interactive" request (the default: a user's own commands)
+ * goes before any "background" one (object listings, help, ...).
+ */
+var PRIORITIES = ["interactive", "background"];
+
+/**
+ * Workspaces made so far; with the time, a prefix for workspaceVersion()
+ * that a later connection, or server, won't repeat.
+ */
+var workspaces = 0;
+
+/**
+ * True if running request 'r' may change the R workspace: anything but
+ * a file transfer or a query marked side effect free ({ cache: true }).
+ */
+function mayChange (r) {
+    return !r.file && !r.detach && !(r.request && r.options && r.options.cache);
+}
+
+/**
+ * The requests waiting for a connection that sessions share. Within a
+ * priority class each session (options.session) has a queue of its own
+ * and the sessions take turns, one of weight n (options.weight, 1 by
+ * default) sending up to n requests a turn - so a burst of requests from
+ * one session, such as the object browser's, holds up another session's
+ * next request by at most a turn rather than the whole burst.
+ */
+function RequestScheduler () {
+    this.length = 0;
+    this.classes = {};
+    for (var i = 0; i < PRIORITIES.length; ++i) {
+        this.classes[PRIORITIES[i]] = {
+            sessions: {},   // session: its queue
+            turns: [],      // sessions with requests waiting; the first has the turn
+            credit: 0,      // requests left in the turn
+            queued: 0,
+            dispatched: 0,
+            maxDepth: 0,
+            totalWaitMs: 0,
+            maxWaitMs: 0
+        };
+    }
+}
+
+RequestScheduler.prototype.push = function (request) {
+    var options = request.options || {};
+    var c = this.classes[options.priority] || this.classes[PRIORITIES[0]];
+    var session = options.session || "";
+    if (!c.sessions[session]) {
+        c.sessions[session] = [];
+        c.turns.push(session);
+    }
+    request.queuedAt = new Date().getTime();
+    c.sessions[session].push(request);
+    this.length++;
+    c.queued++;
+    if (c.queued - c.dispatched > c.maxDepth)
+        c.maxDepth = c.queued - c.dispatched;
+}
+
+/**
+ * The next request to send, or null. Given 'canRun', only a request it
+ * accepts: a session whose next request can't run yet lets the sessions
+ * after it go first, without losing its turn.
+ */
+RequestScheduler.prototype.shift = function (canRun) {
+    for (var i = 0; i < PRIORITIES.length; ++i) {
+        var c = this.classes[PRIORITIES[i]];
+        var t = 0;
+        while (t < c.turns.length && canRun && !canRun (c.sessions[c.turns[t]][0]))
+            t++;
+        if (t == c.turns.length)
+            continue;
+
+        var session = c.turns[t];
+        var queue = c.sessions[session];
+        var request = queue.shift();
+        if (t > 0) { // out of turn
+            if (queue.length == 0) {
+                delete c.sessions[session];
+                c.turns.splice (t, 1);
+            }
+        } else {
+            if (c.credit <= 0) // the session's turn starts
+                c.credit = Math.max (1, (request.options && request.options.weight) || 1);
+            c.credit--;
+            if (queue.length == 0) {
+                delete c.sessions[session];
+                c.turns.shift();
+                c.credit = 0;
+            } else if (c.credit == 0) {
+                c.turns.push (c.turns.shift());
+            }
+        }
+
+        var wait = new Date().getTime() - request.queuedAt;
+        this.length--;
+        c.dispatched++;
+        c.totalWaitMs += wait;
+        if (wait > c.maxWaitMs)
+            c.maxWaitMs = wait;
+        return request;
+    }
+    return null;
+}
+
+/**
+ * Queue depth and wait figures of each priority class.
+ */
+RequestScheduler.prototype.stats = function () {
+    var s = {};
+    for (var i = 0; i < PRIORITIES.length; ++i) {
+        var c = this.classes[PRIORITIES[i]];
+        s[PRIORITIES[i]] = {
+            queueDepth: c.queued - c.dispatched,
+            maxQueueDepth: c.maxDepth,
+            sessionsWaiting: c.turns.length,
+            dispatched: c.dispatched,
+            meanWaitMs: c.dispatched ? c.totalWaitMs / c.dispatched : 0,
+            maxWaitMs: c.maxWaitMs
+        };
+    }
+    return s;
+}
+
 /**
  * Constructor for the connection object
  */
 RservConnection = function () {
 
     this.connection = new BINDING.Connection;
-    this.requests = [];
+    this.requests = new RequestScheduler();
+    this.active = null; // the request being run
+    this.detaching = null; // a detach() waiting for the queue to empty
+    this.closedWith = null; // once closed, the Error requests fail with
+    this.workspace = new Date().getTime().toString(36) + '-' + (++workspaces);
+    this.changes = 0; // requests run that may have changed the workspace
 
     var me = this;
 
     this.connection.addListener("connect", function (l) { me.connected(l); });
     this.connection.addListener("login", function (r) { me.onLoginResult(r); });
     this.connection.addListener("close", function (e) { me.closed(e); });
-    this.connection.addListener("result", function (r) { me.result(r); });
+    this.connection.addListener("result", function (r, t) { me.result(r, t); });
+    this.connection.addListener("chunk", function (v, i, n, s, e) { me.chunk(v, i, n, s, e); });
+    this.connection.addListener("data", function (d) { me.fileData(d); });
+    this.connection.addListener("replaced", function () { me.changes++; me.dispatch(); });
 
     return this;
 };
 
+/**
+ * Connect to Rserve. 'host' may instead be the path of a unix domain
+ * socket, in which case 'port' is -1 (or left out).
+ */
 RservConnection.prototype.connect = function (host, port, callback) {
     if (typeof host === "function") {
         this.connectCallback = host;
         host = '127.0.0.1';
         port = 6311;
     } else {
+        if (typeof port === "function") {
+            callback = port;
+            port = null;
+        }
         host = host || '127.0.0.1';
-        port = port || 6311;
+        port = port || (host.charAt(0) == '/' ? -1 : 6311);
         this.connectCallback = callback;
     }
+    this.host = host;
+    this.connecting = true;
+    this.closedWith = null;
     this.connection.connect (host, port);
 }
 
+/**
+ * Connect to an R session detached with detach(). 'session' is what
+ * detach() gave; the callback gets true once attached (no login is
+ * needed), or false.
+ */
+RservConnection.prototype.attach = function (session, callback) {
+    this.host = session.host;
+    this.connectCallback = callback;
+    this.attaching = true;
+    this.closedWith = null;
+    this.connection.attach (session.host, session.port, session.key);
+}
+
 RservConnection.prototype.close = function () {
     this.connection.close();
 }
 
 RservConnection.prototype.connected = function (requireLogin) {
+    this.changes++; // a new, or reattached, workspace
+    this.attaching = false;
+    this.connecting = false;
     this.requireLogin = requireLogin;
     if (!requireLogin)
         this.dispatch();
@@ -81,58 +243,506 @@ RservConnection.prototype.onLoginResult = function (result) {
 }
 
 RservConnection.prototype.closed = function (e) {
+    this.closedWith = e || new Error("connection closed");
+    // Rserve isn't there, or the session is gone or the key was wrong
+    if (this.connecting || this.attaching) {
+        this.connecting = false;
+        this.attaching = false;
+        if (this.connectCallback)
+            this.connectCallback(false);
+    }
+    this.failRequests();
+}
+
+/**
+ * Once closed, nothing more will run: fail the request under way and
+ * any still waiting, or made later, with the Error the connection
+ * closed with. A detach() under way still gets its result, as the
+ * connection closes just before that comes in.
+ */
+RservConnection.prototype.failRequests = function () {
+    var e = this.closedWith;
+    var failed = [];
+    if (this.active && !this.active.detach) {
+        failed.push (this.active);
+        this.active = null;
+    }
+    for (var r = this.requests.shift(); r; r = this.requests.shift())
+        failed.push (r);
+    if (this.detaching) {
+        failed.push (this.detaching);
+        this.detaching = null;
+    }
+    failed.forEach (function (r) {
+        if (r.callback)
+            r.callback(e);
+    });
 }
-RservConnection.prototype.result = function (r) {
+/**
+ * Work a raw binding result into something more useful: named vectors
+ * become a 'data' object keyed by name.
+ */
+function reshapeResult (r) {
     var finalResponse = r;
 
-    if (r != null) {
-        // Work the request data into something more useful.
-        if (r.values && r.attributes && r.attributes.names) {
-            finalResponse = {};
-            finalResponse.data = {};
-            for (var counter = 0; counter < r.attributes.names.length; ++counter) {
-                finalResponse.data[r.attributes.names[counter]] = r.values[counter];
-            }
-            for (var v in r) {
-                if (v != 'values' && v != 'attributes') {
-                    finalResponse[v] = r[v];
-                }
-            }
-            finalResponse.attributes = {};
-            for (var v in r.attributes) {
-                if (v != 'names') {
-                    finalResponse.attributes[v] = r.attributes[v];
-                }
+    if (r != null && r.values && r.attributes && r.attributes.names) {
+        finalResponse = {};
+        finalResponse.data = {};
+        for (var counter = 0; counter < r.attributes.names.length; ++counter) {
+            finalResponse.data[r.attributes.names[counter]] = r.values[counter];
+        }
+        for (var v in r) {
+            if (v != 'values' && v != 'attributes') {
+                finalResponse[v] = r[v];
             }
-        } else if (r.stack && r.message) { // It's an error
-            if (r.message.match(/Error 0x7f/i)) {  // R error, need to ask R what the problem was.
-                SYS.log ("Request '" + this.requests[0].request + "' errored. Rerunning to access error.");
-                this.requests[0].request = "try(eval(parse(text='" + this.requests[0].request.replace('\'', '\\\'') + "')),silent=TRUE)";
-                this.dispatch();
-                return;
+        }
+        finalResponse.attributes = {};
+        for (var v in r.attributes) {
+            if (v != 'names') {
+                finalResponse.attributes[v] = r.attributes[v];
             }
         }
-
     }
 
-    var request = this.requests.shift();
+    return finalResponse;
+}
+
+/**
+ * R errors need no special handling here: the binding runs each command
+ * inside try(), so a failure comes back as the "try-error" result, with
+ * its message, in the one response. Setup commands and requests given
+ * { trap: false } are sent bare, and fail with an Error instead.
+ */
+RservConnection.prototype.result = function (r, timing) {
+    var request = this.active;
+    this.active = null;
     if (request.callback) {
-        request.callback(finalResponse);
+        request.callback(reshapeResult(r), timing);
     }
     this.dispatch();
 }
-RservConnection.prototype.request = function (req, callback) {
-    this.requests.push ({request: req, callback: callback});
+
+RservConnection.prototype.chunk = function (value, index, name, slice, element) {
+    var options = this.active ? this.active.options : null;
+    if (options && options.onChunk)
+        options.onChunk (value, index, name, slice, element);
+}
+
+/**
+ * Queue an R command. 'options' is handed to the native query, e.g.
+ * { typedArrays: true } to get numeric vectors back as typed arrays, or
+ * { stream: true, onChunk: function (value, index, name, slice, element) {...} }
+ * to get the result piece by piece while it is received: 'slice' is true
+ * when value is a run of a vector's values rather than one list element.
+ * A large numeric or character list element (a data.frame column) comes
+ * in slices as well, with 'element' its index and 'index' the offset in
+ * it; other list elements arrive whole.
+ * The callback then gets a summary ({ chunks, length, attributes }) at
+ * the end. pause() and resume() hold off the chunks meanwhile. Give
+ * { cache: true } for commands without side effects to allow their
+ * result to come from the cache (see cache()), and { timing: true } to
+ * have the callback's second argument break down where the time went.
+ * { intern: true } makes repeated strings (factor like columns) share one
+ * javascript string, which saves time and memory for categorical data.
+ * { tables: true } returns data.frames as columnar tables,
+ * { names, columns, types, rows, rowNames }, with numeric columns as
+ * typed arrays; these are passed through without reshaping.
+ * Complex vectors come back as [{ re, im }, ...] (interleaved in one
+ * Float64Array with typedArrays), raw vectors as a Buffer, calls as
+ * { language, names } and functions as { formals, body }.
+ * { binary: true } skips decoding altogether: the result is a Buffer
+ * holding the SEXP as Rserve sent it (see binaryFrame in binding.cc).
+ * On a connection sessions share, { session, priority, weight } place
+ * the request in the queue (see RequestScheduler); priority is
+ * "interactive" (the default) or "background".
+ * { timeoutMs: n } gives up on the request if R has not started to
+ * answer after n milliseconds (the time taken receiving the result,
+ * including any pause() of a streamed one, does not count): the
+ * callback gets an Error with 'timeout' set, and the binding replaces
+ * the connection with a new one - logged in, and with the requestAll()
+ * setup commands run again - before the next request goes.
+ * { trap: false } sends the command as it is rather than inside try(),
+ * saving R a parse() of it as text and the wire its escaping, for large
+ * or machine made commands that needn't report R errors in detail.
+ */
+RservConnection.prototype.request = function (req, callback, options) {
+    this.requests.push ({request: req, callback: callback, options: options});
+    this.dispatch();
+}
+
+/**
+ * Queue the assignment of a javascript value to an R object. Typed arrays
+ * (Float64Array, Int32Array) and arrays of numbers, strings or booleans
+ * become R vectors, other arrays lists and objects named lists. The
+ * callback gets true, or an Error. 'options' places it in the queue as
+ * for request() ({ session, priority, weight }).
+ */
+RservConnection.prototype.assign = function (name, value, callback, options) {
+    this.requests.push ({assign: name, value: value, callback: callback, options: options});
+    this.dispatch();
+}
+
+/**
+ * Read the file 'path' on the R server's side over this connection, so
+ * no filesystem need be shared with R. onData gets the content a Buffer
+ * at a time (of up to chunkSize bytes, 64k by default); pause() and
+ * resume() hold the transfer off meanwhile. The callback gets the
+ * number of bytes read, or an Error.
+ */
+RservConnection.prototype.readFile = function (path, onData, callback, chunkSize) {
+    this.requests.push ({file: "read", path: path, onData: onData, callback: callback, chunkSize: chunkSize});
+    this.dispatch();
+}
+
+/**
+ * Write the Buffer 'data' to the file 'path' on the R server's side,
+ * chunkSize bytes per command. The callback gets the number of bytes
+ * written, or an Error.
+ */
+RservConnection.prototype.writeFile = function (path, data, callback, chunkSize) {
+    this.requests.push ({file: "write", path: path, data: data, callback: callback, chunkSize: chunkSize});
+    this.dispatch();
+}
+
+/**
+ * Remove the file 'path' on the R server's side; the callback gets true,
+ * or an Error.
+ */
+RservConnection.prototype.removeFile = function (path, callback) {
+    this.requests.push ({file: "remove", path: path, callback: callback});
+    this.dispatch();
+}
+
+RservConnection.prototype.fileData = function (data) {
+    var request = this.active;
+    if (request && request.onData)
+        request.onData (data);
+}
+
+/**
+ * Detach the R session once the queued requests are done: Rserve keeps
+ * it, objects and all, and the connection closes. The callback gets
+ * { host, port, key } to attach() to later, or an Error. Requests made
+ * after this are not run: their callbacks get an Error.
+ */
+RservConnection.prototype.detach = function (callback) {
+    var me = this;
+    // held back from the scheduler, which may reorder the queue
+    this.detaching = {detach: true, callback: function (r, timing) {
+        if (r && r.key) // sessions listen on TCP, even for a unix socket connection
+            r.host = me.host.charAt(0) == '/' ? '127.0.0.1' : me.host;
+        if (callback)
+            callback(r, timing);
+    }};
     this.dispatch();
 }
 
 RservConnection.prototype.dispatch = function () {
-    if (this.requests.length > 0 && this.connection.state == "idle") {
-        this.connection.query (this.requests[0].request);
+    if (this.closedWith) {
+        this.failRequests();
+        return;
     }
+    if (!this.active && this.connection.state == "idle" && (this.requests.length > 0 || this.detaching)) {
+        var r = this.active = this.requests.length > 0 ? this.requests.shift() : this.detaching;
+        if (mayChange (r))
+            this.changes++;
+        if (r.detach) {
+            this.detaching = null;
+            this.connection.detach();
+        } else if (r.file) {
+            try {
+                if (r.file == "read")
+                    this.connection.readFile (r.path, r.chunkSize || 0);
+                else if (r.file == "write")
+                    this.connection.writeFile (r.path, r.data, r.chunkSize || 0);
+                else
+                    this.connection.removeFile (r.path);
+            } catch (e) { // bad arguments
+                this.active = null;
+                if (r.callback)
+                    r.callback(e);
+                this.dispatch();
+            }
+        } else if (r.assign) {
+            try {
+                this.connection.assign (r.assign, r.value);
+            } catch (e) { // the value cannot be encoded
+                this.active = null;
+                if (r.callback)
+                    r.callback(e);
+                this.dispatch();
+            }
+        } else
+            this.connection.query (r.request, r.options || {});
+    }
+}
+
+/**
+ * Stop, and restart, reading the response of a streamed request, so its
+ * chunks come no faster than they can be passed on.
+ */
+RservConnection.prototype.pause = function () {
+    this.connection.pause();
+}
+
+RservConnection.prototype.resume = function () {
+    this.connection.resume();
+}
+
+/**
+ * Size the result cache, in bytes (0, the default, turns it off). Only
+ * requests made with { cache: true } - side effect free ones - use it;
+ * any other request or assign() empties it. Results that come from the
+ * cache are shared between requests and must not be modified.
+ */
+RservConnection.prototype.cache = function (bytes) {
+    this.connection.cache(bytes);
+}
+
+/**
+ * Query timing histograms, traffic and result cache figures, with the
+ * queue figures of each priority class.
+ */
+/**
+ * A string that changes whenever the R workspace may have: each request
+ * run that is not side effect free ({ cache: true }), a reconnection
+ * and a replaced connection change it. Read in the callback of a side
+ * effect free request, it names the workspace that request saw, so it
+ * serves as the ETag of a listing of the workspace that can be checked
+ * without asking R anything. With a pool it covers all its connections.
+ */
+RservConnection.prototype.workspaceVersion = function () {
+    return this.workspace + '.' + this.changes;
+}
+
+RservConnection.prototype.stats = function () {
+    var s = this.connection.stats();
+    s.scheduler = this.requests.stats();
+    return s;
+}
+
+/**
+ * Session setup commands; with a single connection this is just a
+ * request. They are run again on a connection replacing one that timed
+ * out.
+ */
+RservConnection.prototype.requestAll = function (req, callback, options) {
+    this.request (req, callback, setupOptions (options));
+}
+
+function setupOptions (options) {
+    var o = { setup: true };
+    for (var k in options || {})
+        o[k] = options[k];
+    return o;
+}
+
+/**
+ * A pool of connections to Rserve, with the same interface as
+ * RservConnection. Requests go to whichever connection is free, except
+ * that each connection is an R workspace of its own: the requests of an
+ * options.session all go to the one connection the binding routed that
+ * session to (see ConnectionPool in binding.cc), so its objects are
+ * there. requestAll() runs a command on every connection (for session
+ * setup).
+ */
+RservPool = function (size) {
+
+    this.connection = new BINDING.ConnectionPool;
+    this.size = size;
+    this.requests = new RequestScheduler();
+    this.inFlight = 0; // handed to the binding, at most one per connection
+    this.busy = {};    // connections running a session's request
+    this.closedWith = null;
+    this.workspace = new Date().getTime().toString(36) + '-' + (++workspaces);
+    this.changes = 0;
+
+    var me = this;
+
+    this.connection.addListener("connect", function (l) { me.connected(l); });
+    this.connection.addListener("login", function (r) { me.onLoginResult(r); });
+    this.connection.addListener("close", function (e) { me.closed(e); });
+
+    return this;
+};
+
+RservPool.prototype.connect = function (host, port, callback) {
+    if (typeof host === "function") {
+        this.connectCallback = host;
+        host = '127.0.0.1';
+        port = 6311;
+    } else {
+        if (typeof port === "function") {
+            callback = port;
+            port = null;
+        }
+        host = host || '127.0.0.1';
+        port = port || (host.charAt(0) == '/' ? -1 : 6311);
+        this.connectCallback = callback;
+    }
+    this.connecting = true;
+    this.closedWith = null;
+    this.connection.connect (host, port, this.size);
+}
+
+RservPool.prototype.close = RservConnection.prototype.close;
+RservPool.prototype.cache = RservConnection.prototype.cache;
+RservPool.prototype.login = RservConnection.prototype.login;
+RservPool.prototype.closed = RservConnection.prototype.closed;
+RservPool.prototype.failRequests = RservConnection.prototype.failRequests;
+
+RservPool.prototype.connected = function (requireLogin) {
+    this.changes++;
+    this.connecting = false;
+    this.requireLogin = requireLogin;
+    if (this.connectCallback)
+        this.connectCallback(true, requireLogin);
+}
+
+RservPool.prototype.onLoginResult = function (result) {
+    if (this.loginCallback)
+        this.loginCallback (result);
+}
+
+/**
+ * Requests wait here, in the order RequestScheduler gives them, rather
+ * than in the binding's first come first served queue: only as many as
+ * there are connections are handed over at a time, and a session's
+ * request only once its connection is free.
+ */
+RservPool.prototype.request = function (req, callback, options) {
+    this.requests.push ({request: req, callback: callback, options: options});
+    this.dispatch();
+}
+
+/**
+ * As RservConnection's; the value goes to the connection of
+ * options.session, where that session's requests will find it.
+ */
+RservPool.prototype.assign = function (name, value, callback, options) {
+    this.requests.push ({assign: name, value: value, callback: callback, options: options});
+    this.dispatch();
+}
+
+RservPool.prototype.dispatch = function () {
+    if (this.closedWith) {
+        this.failRequests();
+        return;
+    }
+    var me = this;
+    var member = function (r) {
+        var session = r.options && r.options.session;
+        return session ? me.connection.route (String (session)) : -1;
+    };
+    var canRun = function (r) {
+        return !me.busy[member (r)];
+    };
+    // connections run side by side: a change is counted when it is sent
+    // and again when it is done, so a listing's version read in between
+    // can't claim a change still under way on its connection
+    var sent = function (r, m) {
+        return function (result, timing) {
+            me.inFlight--;
+            delete me.busy[m];
+            if (mayChange (r) || (result && result.timeout)) // a timeout replaces the connection
+                me.changes++;
+            if (r.callback)
+                r.callback(reshapeResult(result), timing);
+            me.dispatch();
+        };
+    };
+    while (this.inFlight < this.size && this.requests.length > 0) {
+        var r = this.requests.shift (canRun);
+        if (!r)
+            break;
+        var m = member (r);
+        if (m >= 0)
+            this.busy[m] = true;
+        if (mayChange (r))
+            this.changes++;
+        this.inFlight++;
+        try {
+            if (r.assign)
+                this.connection.assign (r.assign, r.value, r.options || {}, sent (r, m));
+            else
+                this.connection.query (r.request, r.options || {}, sent (r, m));
+        } catch (e) { // bad arguments
+            sent (r, m) (e);
+        }
+    }
+}
+
+/**
+ * Forget the connection a session was routed to, once the session ends.
+ */
+RservPool.prototype.endSession = function (sid) {
+    this.connection.release (String (sid));
+}
+
+RservPool.prototype.requestAll = function (req, callback, options) {
+    var me = this;
+    this.changes++;
+    this.connection.broadcast (req, setupOptions (options), function (r) {
+        me.changes++;
+        if (callback)
+            callback(reshapeResult(r));
+    });
+}
+
+/**
+ * Pool depth and queue wait statistics, with the timings and cache
+ * figures of all connections and the queue figures of each priority
+ * class.
+ */
+RservPool.prototype.stats = RservConnection.prototype.stats;
+RservPool.prototype.workspaceVersion = RservConnection.prototype.workspaceVersion;
+
+/**
+ * One R command running each of 'commands' in turn in the global
+ * environment, returning the list of their results. Errors are caught
+ * per command (try) so the rest still run; the results of commands not
+ * marked 'keep' are dropped (NULL) unless they failed.
+ */
+function batchCommand (commands) {
+    var calls = commands.map (function (c) {
+        var keep = typeof c !== "string" && c.keep;
+        var cmd = typeof c === "string" ? c : c.command;
+        return ".rnodeRun(" + JSON.stringify(cmd) + ", " + (keep ? "TRUE" : "FALSE") + ")";
+    });
+    return "local({ .rnodeRun <- function (cmd, keep) { " +
+        "r <- try(eval(parse(text=cmd), envir=globalenv()), silent=TRUE); " +
+        "if (keep || inherits(r, 'try-error')) r else NULL }; " +
+        "list(" + calls.join(", ") + ") })";
 }
 
+/**
+ * Run several session setup commands in one round trip rather than one
+ * request each (see batchCommand). 'commands' are strings or
+ * { command, keep: true } for those whose result is wanted. The callback
+ * gets an array of results in the same order - null for the ones not
+ * kept, a try-error for failures - or, if the batch itself failed, the
+ * error. On a pool, every connection runs the batch (as requestAll()).
+ */
+function requestBatch (commands, callback) {
+    this.requestAll (batchCommand(commands), function (r) {
+        if (!callback)
+            return;
+        if (!r || r.length === undefined || r.stack) {
+            callback (r);
+            return;
+        }
+        var results = [];
+        for (var i = 0; i < commands.length; ++i)
+            results.push (reshapeResult (i < r.length ? r[i] : null));
+        callback (results);
+    });
+}
+
+RservConnection.prototype.requestBatch = requestBatch;
+RservPool.prototype.requestBatch = requestBatch;
+
 //
 // Export the RservConnection object.
 //
 exports.RservConnection = RservConnection;
+exports.RservPool = RservPool;
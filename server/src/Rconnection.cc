@@ -52,6 +52,7 @@
 #include "sisocks.h"
 #ifdef unix
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #else
 #define AF_LOCAL -1
@@ -97,7 +98,7 @@ static Rexp *new_parsed_Rexp(unsigned int *d, Rmessage *msg) {
 }
 
 static Rexp *new_parsed_Rexp_from_Msg(Rmessage *msg) {
-    if (msg->head.len == 0) {
+    if (msg->len == 0) {
         return NULL;
     }
     int hl=1;
@@ -110,25 +111,110 @@ static Rexp *new_parsed_Rexp_from_Msg(Rmessage *msg) {
     return new_parsed_Rexp(hp+hl,msg);
 }    
 
-Rmessage::Rmessage() {
+RbufferPool::RbufferPool(int keepPerClass) {
+    keep=keepPerClass;
+    allocs=hits=0;
+    retainedBytes=0;
+    for (int i=0; i<classes; i++) {
+        freeList[i]=(char**) malloc(sizeof(char*)*keep);
+        freeCount[i]=0;
+    }
+}
+
+RbufferPool::~RbufferPool() {
+    for (int i=0; i<classes; i++) {
+        while (freeCount[i]>0) free(freeList[i][--freeCount[i]]);
+        free(freeList[i]);
+    }
+}
+
+int RbufferPool::sizeClass(Rsize_t size) {
+    int c=0;
+    Rsize_t cs=minClassSize;
+    while (cs<size) {
+        cs<<=1; c++;
+        if (c>=classes) return -1; // too big to pool
+    }
+    return c;
+}
+
+char *RbufferPool::acquire(Rsize_t size, Rsize_t *capacity) {
+    int c=sizeClass(size);
+    if (c<0) {
+        *capacity=size;
+        allocs++;
+        return (char*) malloc(size);
+    }
+    *capacity=((Rsize_t)minClassSize)<<c;
+    if (freeCount[c]>0) {
+        hits++;
+        retainedBytes-=*capacity;
+        return freeList[c][--freeCount[c]];
+    }
+    allocs++;
+    return (char*) malloc(*capacity);
+}
+
+void RbufferPool::release(char *buf, Rsize_t capacity) {
+    if (!buf) return;
+    int c=sizeClass(capacity);
+    if (c<0 || (((Rsize_t)minClassSize)<<c)!=capacity || freeCount[c]>=keep) {
+        free(buf);
+        return;
+    }
+    freeList[c][freeCount[c]++]=buf;
+    retainedBytes+=capacity;
+}
+
+void Rmessage::init() {
     complete=0;
     data=0;
     len=0;
     sending = 0;
+    bytesSent = 0;
     receiving = 0;
+    pool=0;
+    capacity=0;
+    sink=0;
+    sinkChunkSize=65536;
+}
+
+char *Rmessage::allocData(Rsize_t size) {
+    if (pool) return pool->acquire(size, &capacity);
+    capacity=size;
+    return (char*) malloc(size);
+}
+
+void Rmessage::freeData() {
+    if (data) {
+        if (pool)
+            pool->release(data, capacity);
+        else
+            free(data);
+    }
+    data=0;
+    capacity=0;
+}
+
+Rmessage::Rmessage() {
+    init();
+}
+
+Rmessage::Rmessage(RbufferPool *pool) {
+    init();
+    this->pool=pool;
 }
 
 Rmessage::Rmessage(int cmd) {
+    init();
     memset(&head,0,sizeof(head));
     head.cmd = cmd;
-    data=0;
-    len=0;
     complete=1;
-    sending = 0;
-    receiving = 0;
 }
 
-Rmessage::Rmessage(int cmd, const char *txt) {
+Rmessage::Rmessage(int cmd, const char *txt, RbufferPool *pool) {
+    init();
+    this->pool=pool;
     memset(&head,0,sizeof(head));
     int tl=strlen(txt)+1;
     if ((tl&3)>0)
@@ -136,30 +222,29 @@ Rmessage::Rmessage(int cmd, const char *txt) {
     len=tl+4; // message length is tl + 4 (short format only)
     head.cmd=cmd;
     head.len=len;
-    data=(char*)malloc(tl+16);
+    data=allocData(tl+16);
     memset(data,0,tl+16);
     *((int*)data)=itop(SET_PAR(DT_STRING,tl));
     strcpy(data+4,txt);
     complete=1;
-    sending = 0;
-    receiving = 0;
 }
 
-Rmessage::Rmessage(int cmd, const void *buf, int dlen, int raw_data) {
+Rmessage::Rmessage(int cmd, const void *buf, int dlen, int raw_data, RbufferPool *pool) {
+    init();
+    this->pool=pool;
     memset(&head,0,sizeof(head));
     len=(raw_data)?dlen:(dlen+4);
     head.cmd=cmd;
     head.len=len;
-    data=(char*)malloc(len);
-    memcpy(data, (raw_data)?buf:((char*)buf+4), dlen);
+    data=allocData(len);
+    memcpy((raw_data)?data:(data+4), buf, dlen);
     if (!raw_data)
         *((int*)data)=itop(SET_PAR(DT_BYTESTREAM,dlen));  
     complete=1;
-    sending = 0;
-    receiving = 0;
 }  
 
 Rmessage::Rmessage(int cmd, int i) {
+    init();
     memset(&head,0,sizeof(head));
     len=8; // DT_INT+len (4) + payload-1xINT (4)
     head.cmd=cmd;
@@ -168,15 +253,26 @@ Rmessage::Rmessage(int cmd, int i) {
     *((int*)data)=itop(SET_PAR(DT_INT,4));
     ((int*)data)[1]=itop(i);
     complete=1;
-    sending = 0;
-    receiving = 0;
 }
     
 Rmessage::~Rmessage() {
-    if(data) free(data);
+    freeData();
+    complete=0;
+}
+
+void Rmessage::reset() {
+    freeData();
+    len=0;
+    pars=0;
     complete=0;
+    sending=0;
+    receiving=0;
 }
     
+/* the most one recv/send is asked for, so its count fits the int it
+   comes back in */
+static const Rsize_t maxTransfer=0x40000000;
+
 int Rmessage::read(int s) {
     int n;
     if (receiving == 0) {
@@ -191,10 +287,15 @@ int Rmessage::read(int s) {
             return (n==0)?-7:-8;
         }
         receiving = 1;
-        len=head.len=ptoi(head.len);
+        head.len=ptoi(head.len);
         head.cmd=ptoi(head.cmd);
         head.dof=ptoi(head.dof);
         head.res=ptoi(head.res);
+        len=((Rsize_t)(unsigned int)head.len)|(((Rsize_t)(unsigned int)head.res)<<32);
+        if (len!=(Rsize_t)(size_t)len) { // over 4GB on a 32-bit platform
+            closesocket(s); s=-1;
+            return -10;
+        }
     }
     if (receiving == 1) {
         if (head.dof>0) { // skip past DOF if present
@@ -216,8 +317,9 @@ int Rmessage::read(int s) {
     }
 
     if (receiving == 2) {
-        if (head.len>0) {
-            data=(char*) malloc(head.len);
+        if (len>0) {
+            // a sink takes the content piece by piece, so one chunk is enough
+            data=allocData((sink && len>sinkChunkSize)?sinkChunkSize:len);
             if (!data) {
                 closesocket(s); s=-1;
                 return -10; // out of memory
@@ -228,15 +330,31 @@ int Rmessage::read(int s) {
     }
 
     if (receiving == 3) {
-        if (head.len>0) {
+        if (len>0 && sink) {
+            // one chunk per call, so a large message can't hog the caller
+            n=recv(s,data,(len-bytesReceived>capacity)?capacity:len-bytesReceived,0);
+            if (n == -1 && errno == EAGAIN) {
+                return 0;
+            } else if (n <= 0) {
+                closesocket(s); s=-1;
+                return -8;
+            }
+            bytesReceived += n;
+            if (sink->consume(data, n)) {
+                closesocket(s); s=-1;
+                return -8;
+            }
+            if (bytesReceived < len)
+                return 0;
+        } else if (len>0) {
             char *dp = data + bytesReceived;
-            while(bytesReceived < head.len && (n=recv(s,(char*)dp,head.len - bytesReceived,0))>0) {
+            while(bytesReceived < len && (n=recv(s,(char*)dp,(len-bytesReceived>maxTransfer)?maxTransfer:len-bytesReceived,0))>0) {
                 bytesReceived += n;
                 dp+=n;
             }
             if (n == -1 && errno == EAGAIN) {
                 return 0;
-            } else if (n == -1 || bytesReceived != head.len) {
+            } else if (n == -1 || bytesReceived != len) {
                 closesocket(s); s=-1;
                 return -8;
             }
@@ -245,7 +363,10 @@ int Rmessage::read(int s) {
     }
 
     if (receiving == 4) {
-        parse();
+        if (sink)
+            pars=0; // content went to the sink, nothing to parse
+        else
+            parse();
         complete=1;
     }
     return 0;
@@ -271,7 +392,7 @@ void Rmessage::parse() {
             len|=((Rsize_t)p2)<<24;
         }
 #ifdef DEBUG_CXX
-        printf("  par %d: %d length %d\n", pars, p1&0x3f, len);
+        printf("  par %d: %d length %llu\n", pars, p1&0x3f, len);
 #endif
         par[pars++]=(unsigned int*)c;
         c+=hs;
@@ -280,38 +401,68 @@ void Rmessage::parse() {
     }
 }
 
+char *Rmessage::parData(int i, Rsize_t *length) {
+    unsigned int p1=ptoi(par[i][0]);
+    Rsize_t plen=p1>>8;
+    int hs=4;
+    if ((p1&DT_LARGE)>0) {
+        hs+=4;
+        plen|=((Rsize_t)ptoi(par[i][1]))<<24;
+    }
+    if (length) *length=plen;
+    return ((char*)par[i])+hs;
+}
+
 int Rmessage::send(int s) {
     if (sending == 0) {
-        head.cmd=itop(head.cmd);
-        head.len=itop(head.len);
-        head.dof=itop(head.dof);
-        head.res=itop(head.res);
-        int ret = ::send(s,(char*)&head,sizeof(head),0)!=sizeof(head);
-        head.cmd=ptoi(head.cmd);
-        head.len=ptoi(head.len);
-        head.dof=ptoi(head.dof);
-        head.res=ptoi(head.res);
-
-        if (ret == -1 && errno == EAGAIN) {
-            return 0;
-        } else if (ret == -1) {
-            return ret;
-        }
-
+        // the header goes out in network order; head itself stays in ours
+        wireHead.cmd=itop(head.cmd);
+        // the length comes from len, so messages over 4GB carry its
+        // high half in res
+        wireHead.len=itop((int)(len&0xffffffff));
+        wireHead.dof=itop(head.dof);
+        wireHead.res=itop((int)(len>>32));
+        bytesSent=0;
         sending = 1;
     }
 
     if (sending == 1) {
-        if (len > 0) {
-            int ret = ::send(s,data,len,0); // Assume we can send all data.
-            if (ret == -1 && errno == EAGAIN) {
-                return 0;
-            } else if (ret == -1) {
-                return ret;
+        // header and content in one go where we can, picking up where the
+        // last call left off if the socket couldn't take it all
+        Rsize_t total=sizeof(wireHead)+len;
+        while (bytesSent<total) {
+            int n;
+            Rsize_t dataSent=(bytesSent>sizeof(wireHead))?bytesSent-sizeof(wireHead):0;
+#ifdef unix
+            struct iovec iov[2];
+            int iovs=0;
+            if (bytesSent<sizeof(wireHead)) {
+                iov[iovs].iov_base=((char*)&wireHead)+bytesSent;
+                iov[iovs].iov_len=sizeof(wireHead)-bytesSent;
+                iovs++;
+            }
+            if (len>0) {
+                iov[iovs].iov_base=data+dataSent;
+                iov[iovs].iov_len=(len-dataSent>maxTransfer)?maxTransfer:len-dataSent;
+                iovs++;
             }
+            n=writev(s,iov,iovs);
+#else
+            if (bytesSent<sizeof(wireHead))
+                n=::send(s,((char*)&wireHead)+bytesSent,sizeof(wireHead)-bytesSent,0);
+            else
+                n=::send(s,data+dataSent,(len-dataSent>maxTransfer)?maxTransfer:len-dataSent,0);
+#endif
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0; // call again when the socket is writable
+            if (n == -1)
+                return -1;
+            bytesSent+=n;
         }
+        sending = 2;
     }
-    sending = 2;
 
     return 0;
 }
@@ -404,7 +555,7 @@ char *Rexp::parse(unsigned int *pos) { // plen is not used
     }
     type=p1&0x3f;
 #ifdef DEBUG_CXX
-    printf("Rexp(type=%d, len=%d, attr=%p)\n", type, len, attr);
+    printf("Rexp(type=%d, len=%llu, attr=%p)\n", type, len, attr);
 #endif
     return data+len;
 }
@@ -416,7 +567,7 @@ void Rexp::store(char *buf) {
     i[0]=itop(i[0]);
     if (len>0x7fffff) {
         buf[0]|=XT_LARGE;
-        i[1]=itop(len>>24);
+        i[1]=itop((unsigned int)(len>>24));
         hl+=4;
     }
     memcpy(buf+hl, data, len);
@@ -449,7 +600,7 @@ const char **Rexp::attributeNames() {
 }
 
 void Rinteger::fix_content() {
-    if (len<0 || !data) return;
+    if (!data) return;
 #ifdef SWAPEND
     int *i = (int*) data;
     int *j = (int*) (data+len);
@@ -458,7 +609,7 @@ void Rinteger::fix_content() {
 }
 
 void Rdouble::fix_content() {
-    if (len<0 || !data) return;
+    if (!data) return;
 #ifdef SWAPEND
     double *i = (double*) data;
     double *j = (double*) (data+len);
@@ -510,7 +661,7 @@ void Rlist::fix_content() {
 	Rexp *h = new_parsed_Rexp((unsigned int*) ptr, 0);
 	if (!h) break;
 	if (n)
-	  lt = lt->tail = new Rlist(type, h, 0, h->next, msg);
+	  lt = lt->tail = new Rlist(type, h, 0, h->next, 0); // only the first node owns msg
 	else
 	  lt->head = h;
 	n++;
@@ -532,7 +683,7 @@ void Rlist::fix_content() {
 #endif
 	if (!t) break;
 	if (n)
-	  lt = lt->tail = new Rlist(type, h, t, t->next, msg);
+	  lt = lt->tail = new Rlist(type, h, t, t->next, 0); // only the first node owns msg
 	else {
 	  lt->head = h;
 	  lt->tag = t;
@@ -650,10 +801,13 @@ Rconnection::Rconnection(const char *host, int port) {
     s=-1;
     auth=0;
     salt[0]='.'; salt[1]='.';
+    attaching=0;
+    sessionKeySent=0;
 }
     
 Rconnection::~Rconnection() {
-    if (host) free(host); host=0;
+    if (host) free(host);
+    host=0;
     if (s!=-1) closesocket(s);
     s=-1;
 }
@@ -671,7 +825,9 @@ int Rconnection::connect() {
 #ifdef unix
         memset(&sau,0,sizeof(sau));
         sau.sun_family=AF_LOCAL;
-        strcpy(sau.sun_path,host); // FIXME: possible overflow!
+        if (strlen(host)>=sizeof(sau.sun_path))
+            return -1; // path too long
+        strcpy(sau.sun_path,host);
 #else
 	return -11;  // unsupported
 #endif
@@ -706,8 +862,45 @@ int Rconnection::connect() {
     return pollConnection();
 }
 
+int Rconnection::attach(const char *key) {
+    memcpy(sessionKey, key, 32);
+    attaching=1;
+    sessionKeySent=0;
+    return connect();
+}
+
 int Rconnection::pollConnection() {
 
+    if (attaching) {
+        // A resumed session sends no ID string: it waits for the key
+        // (raw, no QAP1 header) and answers with a bare RESP_OK.
+        if (sessionKeySent < 32) {
+            int n = send(s, sessionKey + sessionKeySent, 32 - sessionKeySent, 0);
+            if (n == -1 && (errno == EAGAIN || errno == ENOTCONN))
+                return 0; // still connecting
+            if (n == -1)
+                return -1;
+            sessionKeySent += n;
+            if (sessionKeySent < 32)
+                return 0;
+        }
+
+        int n = recv(s, IDstring + receivedCharsFromIDstring, sizeof(struct phdr) - receivedCharsFromIDstring, 0);
+        if (n == -1 && errno == EAGAIN)
+            return 0;
+        if (n <= 0)
+            return -1;
+        receivedCharsFromIDstring += n;
+        if (receivedCharsFromIDstring < (int)sizeof(struct phdr))
+            return 0;
+
+        struct phdr *ph = (struct phdr*) IDstring;
+        if (ptoi(ph->cmd) != RESP_OK)
+            return -3; // wrong key, or not a session
+        _connected = true;
+        return 0;
+    }
+
     int n = recv(s, IDstring + receivedCharsFromIDstring, 32 - receivedCharsFromIDstring, 0);
 
     if (n == -1 && errno == EAGAIN) {
@@ -800,25 +993,42 @@ int Rconnection::shutdown(const char *key) {
     return res;
 }
 
-int Rconnection::assign(const char *symbol, Rexp *exp) {
-    Rmessage *msg=new Rmessage();
+Rmessage *Rmessage::assignment(const char *symbol, Rsize_t xl, char **sexp, RbufferPool *pool) {
     Rmessage *cm=new Rmessage(CMD_setSEXP);
-    
+    cm->pool=pool;
+
     int tl=strlen(symbol)+1;
-    if (tl&3) tl=(tl+4)&0xfffc;
-    Rsize_t xl=exp->storageSize();
+    tl=(tl+3)&~3; // align the symbol name
     Rsize_t hl=4+tl+4;
     if (xl>0x7fffff) hl+=4;
-    cm->data=(char*) malloc(hl+xl);
-    cm->head.len=cm->len=hl+xl;
+    cm->data=cm->allocData(hl+xl);
+    if (!cm->data) {
+        delete cm;
+        return 0;
+    }
+    cm->len=hl+xl;
+    cm->head.len=(int)(cm->len&0xffffffff);
     ((unsigned int*)cm->data)[0]=SET_PAR(DT_STRING, tl);
     ((unsigned int*)cm->data)[0]=itop(((unsigned int*)cm->data)[0]);
+    memset(cm->data+4, 0, tl);
     strcpy(cm->data+4, symbol);
     ((unsigned int*)(cm->data+4+tl))[0]=SET_PAR((Rsize_t) ((xl>0x7fffff)?(DT_SEXP|DT_LARGE):DT_SEXP), (Rsize_t) xl);
     ((unsigned int*)(cm->data+4+tl))[0]=itop(((unsigned int*)(cm->data+4+tl))[0]);
     if (xl>0x7fffff)
-        ((unsigned int*)(cm->data+4+tl))[1]=itop(xl>>24);
-    exp->store(cm->data+hl);
+        ((unsigned int*)(cm->data+4+tl))[1]=itop((unsigned int)(xl>>24));
+    *sexp=cm->data+hl;
+    return cm;
+}
+
+int Rconnection::assign(const char *symbol, Rexp *exp) {
+    Rmessage *msg=new Rmessage();
+    char *sexp;
+    Rmessage *cm=Rmessage::assignment(symbol, exp->storageSize(), &sexp);
+    if (!cm) {
+        delete(msg);
+        return -10; // out of memory
+    }
+    exp->store(sexp);
     
     int res=request(msg,cm);
     delete (cm);
@@ -45,7 +45,10 @@
 #include "sisocks.h"
 #include "Rsrv.h"
 
-typedef unsigned int Rsize_t;
+/* lengths of messages and SEXPs: 64-bit, as Rserve sends results over
+   4GB with the high half of the message length in phdr.res and large
+   parameters/SEXPs with 56-bit lengths (DT_LARGE/XT_LARGE) */
+typedef unsigned long long Rsize_t;
 
 //=== Rconnection error codes
 
@@ -70,6 +73,52 @@ typedef unsigned int Rsize_t;
 #define A_crypt    0x002
 #define A_plain    0x004
 
+//===================================== RbufferPool ---- recycled message buffers
+
+/** Keeps released message buffers in power-of-two size classes so that
+    a connection running query after query reuses the same few buffers
+    instead of going to malloc for each message. Buffers larger than the
+    biggest class are allocated and freed directly. */
+class RbufferPool {
+public:
+    RbufferPool(int keepPerClass=4);
+    ~RbufferPool();
+
+    /** returns a buffer of at least 'size' bytes; its real size is
+        stored in 'capacity' and must be given back to release() */
+    char *acquire(Rsize_t size, Rsize_t *capacity);
+    void release(char *buf, Rsize_t capacity);
+
+    unsigned long allocations() { return allocs; } // buffers taken from malloc
+    unsigned long reuses() { return hits; }        // buffers served from a free list
+    Rsize_t retained() { return retainedBytes; }   // bytes held in free lists
+
+private:
+    static const int minClassSize = 64;
+    static const int classes = 20; // 64 bytes .. 32MB
+
+    char **freeList[classes];
+    int freeCount[classes];
+    int keep;
+
+    unsigned long allocs, hits;
+    Rsize_t retainedBytes;
+
+    int sizeClass(Rsize_t size);
+};
+
+//===================================== RmessageSink ---- streamed content
+
+/** Receives the content of a message as it comes off the socket, when
+    set as the sink of a message being read. The content is then not kept
+    in the message - only one chunk of it is buffered at any time. */
+class RmessageSink {
+public:
+    virtual ~RmessageSink() {}
+    /** returns nonzero to abort the read (e.g. on malformed content) */
+    virtual int consume(const char *buf, int len) = 0;
+};
+
 //===================================== Rmessage ---- QAP1 storage
 class Rexp;
 
@@ -80,24 +129,44 @@ class Rmessage {
     Rsize_t len;
     int complete;
 
+    // if set, data comes from and goes back to this pool
+    RbufferPool *pool;
+    Rsize_t capacity;
+
+    // if set, read() hands the content to the sink in chunks of up to
+    // sinkChunkSize bytes instead of buffering all of it
+    RmessageSink *sink;
+    Rsize_t sinkChunkSize;
+
     int sending;
+    struct phdr wireHead; // head in network order, while sending
+    Rsize_t bytesSent;    // of header and content together
     int receiving;
 
-    int bytesReceived;
+    Rsize_t bytesReceived;
     
     // the following is avaliable only for parsed messages (max 16 pars)
     int pars;
     unsigned int *par[16];
 
     Rmessage();
+    explicit Rmessage(RbufferPool *pool); // for receiving into a pooled buffer
     Rmessage(int cmd); // 0 data
-    Rmessage(int cmd, const char *txt); // DT_STRING data
+    Rmessage(int cmd, const char *txt, RbufferPool *pool=0); // DT_STRING data
     Rmessage(int cmd, int i); // DT_INT data (1 entry)
-    Rmessage(int cmd, const void *buf, int len, int raw_data=0); // raw data or DT_BYTESTREAM
+    Rmessage(int cmd, const void *buf, int len, int raw_data=0, RbufferPool *pool=0); // raw data or DT_BYTESTREAM
     virtual ~Rmessage();
+
+    /** drop the content (returning the buffer) so the message can be read into again */
+    void reset();
+
+    /** a CMD_setSEXP message assigning to 'symbol' a SEXP of 'length'
+        bytes (header included), which the caller writes at *sexp; 0 if
+        there is no memory for it */
+    static Rmessage *assignment(const char *symbol, Rsize_t length, char **sexp, RbufferPool *pool=0);
         
     int command() { return complete?head.cmd:-1; }
-    Rsize_t length() { return complete?head.len:-1; }
+    Rsize_t length() { return complete?len:-1; }
     int is_complete() { return complete; }
 
     bool sendComplete() { return sending == 2; }
@@ -105,9 +174,19 @@ class Rmessage {
     
     int read(int s);
     void parse();
+    /** the content of parameter i past its header (4 bytes, 8 with
+        DT_LARGE), and its length in *length if given */
+    char *parData(int i, Rsize_t *length=0);
+    /** sends as much as the socket takes; call again (e.g. when it is
+        writable) until sendComplete(). nonzero on error */
     int send(int s);    
 
     Rexp *toRexp();
+
+private:
+    void init();
+    char *allocData(Rsize_t size);
+    void freeData();
 };
 
 //===================================== Rexp --- basis for all SEXPs
@@ -242,9 +321,13 @@ public:
    Rstrings(Rmessage *msg) : Rexp(msg) { decode(); }
    Rstrings(unsigned int *ipos, Rmessage *imsg) : Rexp(ipos, imsg) { decode(); }
     /*Rstring(const char *str) : Rexp(XT_STR, str, strlen(str)+1) {}*/
+    virtual ~Rstrings() {
+      for (unsigned int i = 0; i < nel; i++) free(cont[i]);
+      free(cont);
+    }
     
     char **strings() { return cont; }
-    char *stringAt(unsigned int i) { return (i<0||i>=nel)?0:cont[i]; }
+    char *stringAt(unsigned int i) { return (i>=nel)?0:cont[i]; }
     char *string() { return stringAt(0); }
     unsigned int count() { return nel; }
     int indexOfString(const char *str);
@@ -388,6 +471,12 @@ protected:
     int receivedCharsFromIDstring;
     int _connected;
 
+    // set by attach(): instead of reading the ID string, send the key of
+    // a detached session and read Rserve's response to it
+    int attaching;
+    char sessionKey[32];
+    int sessionKeySent;
+
 public:
     /** host - either host name or unix socket path
         port - either TCP port or -1 if unix sockets should be used */
@@ -398,6 +487,10 @@ public:
     int connect();
     int disconnect();
 
+    /** connect to a session detached with CMD_detachSession, whose port
+        this connection was made with; 'key' is the session's 32 byte key */
+    int attach(const char *key);
+
     int pollConnection();
 
     int connected() {
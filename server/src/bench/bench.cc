@@ -0,0 +1,155 @@
+/*
+    Copyright 2010 Jamie Love
+
+    This file is part of the "R-Node Server".
+
+    R-Node Server is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2.1 of the License, or
+    (at your option) any later version.
+
+    R-Node Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with R-Node Server.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Decoder microbenchmarks: runs the payloads of qap1_payloads.h through
+ * the Rconnection.cc decoders - Rmessage::parse, new_parsed_Rexp (via
+ * Rmessage::toRexp) and Rexp::store - and reports the time per message
+ * and per element, and the heap allocations per message. Needs neither
+ * R nor Rserve.
+ *
+ *   make bench               (or: src/bench/bench [seconds per case])
+ *
+ * parseRexp, which needs V8, is covered by 'make bench-node'.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#define MAIN // we are the main program, we need to define this for Rserve
+#define SOCK_ERRORS
+
+#include "sisocks.h"
+#include "Rconnection.h"
+#include "qap1_payloads.h"
+
+using namespace qap1bench;
+
+#ifdef __GLIBC__
+// Count heap allocations; operator new comes through here too.
+extern "C" void *__libc_malloc(size_t size);
+static unsigned long mallocs = 0;
+extern "C" void *malloc(size_t size) {
+    mallocs++;
+    return __libc_malloc(size);
+}
+#define COUNTS_ALLOCATIONS 1
+#else
+static unsigned long mallocs = 0;
+#define COUNTS_ALLOCATIONS 0
+#endif
+
+static double now () {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/** a complete, received message holding a copy of the payload */
+static Rmessage *received (const Payload &p) {
+    Rmessage *m = new Rmessage();
+    memcpy(&m->head, &p.message[0], sizeof(struct phdr));
+    m->head.cmd = ptoi(m->head.cmd);
+    m->head.len = ptoi(m->head.len);
+    m->head.dof = ptoi(m->head.dof);
+    m->head.res = ptoi(m->head.res);
+    m->len = p.message.size() - sizeof(struct phdr);
+    m->data = (char *) malloc(m->len);
+    memcpy(m->data, &p.message[sizeof(struct phdr)], m->len);
+    m->complete = 1;
+    return m;
+}
+
+struct Result {
+    unsigned long runs;
+    double seconds;
+    unsigned long allocations;
+};
+
+static void report (const Payload &p, const char *stage, const Result &r) {
+    double ns = r.seconds * 1e9 / r.runs;
+    printf("%-16s %-18s %9lu %12.0f %10.2f", p.name.c_str(), stage, r.runs, ns, ns / p.elements);
+    if (COUNTS_ALLOCATIONS)
+        printf(" %12.1f\n", (double) r.allocations / r.runs);
+    else
+        printf(" %12s\n", "n/a");
+}
+
+static Result benchParse (const Payload &p, double budget) {
+    Result r = { 0, 0, 0 };
+    Rmessage *m = received(p);
+    unsigned long a = mallocs;
+    double start = now();
+    do {
+        m->parse();
+        r.runs++;
+    } while ((r.seconds = now() - start) < budget);
+    r.allocations = mallocs - a;
+    delete m;
+    return r;
+}
+
+static Result benchToRexp (const Payload &p, double budget) {
+    Result r = { 0, 0, 0 };
+    while (r.seconds < budget) {
+        Rmessage *m = received(p); // set up outside the measurement
+        m->parse();
+        unsigned long a = mallocs;
+        double start = now();
+        Rexp *x = m->toRexp();
+        delete x; // takes the message with it
+        r.seconds += now() - start;
+        r.allocations += mallocs - a;
+        r.runs++;
+    }
+    return r;
+}
+
+static Result benchStore (const Payload &p, double budget) {
+    Result r = { 0, 0, 0 };
+    Rmessage *m = received(p);
+    m->parse();
+    Rexp *x = m->toRexp();
+    char *buf = (char *) malloc(x->storageSize());
+    unsigned long a = mallocs;
+    double start = now();
+    do {
+        x->store(buf);
+        r.runs++;
+    } while ((r.seconds = now() - start) < budget);
+    r.allocations = mallocs - a;
+    free(buf);
+    delete x;
+    return r;
+}
+
+int main (int argc, char **argv) {
+    double budget = argc > 1 ? atof(argv[1]) : 0.5;
+    std::vector<Payload> payloads = standardPayloads();
+
+    printf("%-16s %-18s %9s %12s %10s %12s\n", "payload", "decoder", "runs", "ns/message", "ns/element", "allocs/msg");
+    for (size_t i = 0; i < payloads.size(); ++i) {
+        const Payload &p = payloads[i];
+        report(p, "Rmessage::parse", benchParse(p, budget));
+        report(p, "new_parsed_Rexp", benchToRexp(p, budget));
+        report(p, "Rexp::store", benchStore(p, budget));
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+    Copyright 2010 Jamie Love
+
+    This file is part of the "R-Node Server".
+
+    R-Node Server is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2.1 of the License, or
+    (at your option) any later version.
+
+    R-Node Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with R-Node Server.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A canned Rserve for the checks in src/bench: a thread on one end of a
+ * socketpair that reads each message sent to it and answers with the
+ * next of a list of canned responses. Speaks QAP1 past the ID string
+ * only - no login, no R.
+ */
+
+#ifndef __FAKE_RSERVE_H__
+#define __FAKE_RSERVE_H__
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Rsrv.h"
+
+namespace qap1bench {
+
+/**
+ * A response: 'prefix' (the message header and whatever content is
+ * spelled out) followed by 'zeros' more bytes of zeros, so synthetic
+ * messages of several GB need no buffer of that size.
+ */
+struct Response {
+    std::vector<char> prefix;
+    unsigned long long zeros;
+};
+
+class FakeRserve {
+    public:
+        std::vector<Response> responses; // answered in turn, round robin
+        std::vector<unsigned long long> received; // content length of each message read
+
+        FakeRserve () : served_(0) {
+            fds_[0] = fds_[1] = -1;
+        }
+
+        ~FakeRserve () {
+            stop();
+        }
+
+        /** the client's socket, or -1 */
+        int start () {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds_))
+                return -1;
+            if (pthread_create(&thread_, NULL, run, this)) {
+                close(fds_[0]);
+                close(fds_[1]);
+                fds_[0] = fds_[1] = -1;
+                return -1;
+            }
+            return fds_[0];
+        }
+
+        /** close the client's end and wait for the server to see it */
+        void stop () {
+            if (fds_[0] < 0)
+                return;
+            close(fds_[0]);
+            pthread_join(thread_, NULL);
+            close(fds_[1]);
+            fds_[0] = fds_[1] = -1;
+        }
+
+    private:
+        int fds_[2];
+        pthread_t thread_;
+        unsigned long served_;
+
+        static void *run (void *me) {
+            ((FakeRserve *) me)->serve();
+            return NULL;
+        }
+
+        bool readAll (char *buf, size_t n) {
+            while (n > 0) {
+                ssize_t r = ::read(fds_[1], buf, n);
+                if (r <= 0)
+                    return false;
+                buf += r;
+                n -= r;
+            }
+            return true;
+        }
+
+        bool writeAll (const char *buf, size_t n) {
+            while (n > 0) {
+                ssize_t w = ::write(fds_[1], buf, n);
+                if (w <= 0)
+                    return false;
+                buf += w;
+                n -= w;
+            }
+            return true;
+        }
+
+        void serve () {
+            static char scratch[1 << 20];
+            struct phdr head;
+            while (readAll((char *) &head, sizeof(head))) {
+                unsigned long long len = (unsigned int) ptoi(head.len) |
+                    ((unsigned long long) (unsigned int) ptoi(head.res)) << 32;
+                received.push_back(len);
+                for (unsigned long long left = len; left > 0; ) {
+                    size_t n = left > sizeof(scratch) ? sizeof(scratch) : left;
+                    if (!readAll(scratch, n))
+                        return;
+                    left -= n;
+                }
+
+                if (responses.empty())
+                    continue;
+                const Response &r = responses[served_++ % responses.size()];
+                if (!writeAll(&r.prefix[0], r.prefix.size()))
+                    return;
+                memset(scratch, 0, sizeof(scratch));
+                for (unsigned long long left = r.zeros; left > 0; ) {
+                    size_t n = left > sizeof(scratch) ? sizeof(scratch) : left;
+                    if (!writeAll(scratch, n))
+                        return;
+                    left -= n;
+                }
+            }
+        }
+};
+
+}
+
+#endif
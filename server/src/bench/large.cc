@@ -0,0 +1,256 @@
+/*
+    Copyright 2010 Jamie Love
+
+    This file is part of the "R-Node Server".
+
+    R-Node Server is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2.1 of the License, or
+    (at your option) any later version.
+
+    R-Node Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with R-Node Server.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Messages past 4GB against a canned Rserve (fake_rserve.h): a response
+ * of a little over 4GB - its length's high half in phdr.res, a DT_LARGE
+ * parameter holding an XT_LARGE double vector - is read through a sink,
+ * and its headers parsed as Rmessage::parse() and toRexp() would find
+ * them; then an assignment of that size goes the other way, and the fake
+ * server must count every byte of it. Exits nonzero if any length comes
+ * out wrong, or after a minute without an answer (a misread length
+ * leaves both ends waiting). Needs neither R nor Rserve, nor 4GB of
+ * memory: the bulk of each message is pages of zeros never written.
+ *
+ * 64-bit only; it takes a few seconds, most of them copying zeros.
+ *
+ *   make large                (or: src/bench/large)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MAIN // we are the main program, we need to define this for Rserve
+#define SOCK_ERRORS
+
+#include "sisocks.h"
+#include "Rconnection.h"
+#include "fake_rserve.h"
+
+using namespace qap1bench;
+
+/** the vector's payload: just past 4GB, a whole number of doubles */
+static const Rsize_t body = (1ULL << 32) + (1ULL << 16);
+
+/** counts what it is given, keeping the first bytes (the headers) */
+class CountingSink : public RmessageSink {
+    public:
+        Rsize_t bytes;
+        char start[16];
+
+        CountingSink () : bytes(0) {
+            memset(start, 0, sizeof(start));
+        }
+
+        int consume (const char *buf, int len) {
+            for (int i = 0; i < len && bytes + i < sizeof(start); ++i)
+                start[bytes + i] = buf[i];
+            bytes += len;
+            return 0;
+        }
+};
+
+static int failed = 0;
+
+static void timedOut (int) {
+    const char m[] = "FAILED: no progress for a minute; a length was misread\n";
+    if (write(1, m, sizeof(m) - 1)) {}
+    _exit(1);
+}
+
+static void check (bool ok, const char *what) {
+    printf("%-56s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed = 1;
+}
+
+/** a parameter or SEXP header with the large (8 byte) form */
+static void largeHeader (char *p, int type, Rsize_t len) {
+    unsigned int h[2];
+    h[0] = itop((unsigned int) SET_PAR(type, len));
+    h[1] = itop((unsigned int) (len >> 24));
+    memcpy(p, h, 8);
+}
+
+/** RESP_OK with one DT_SEXP parameter: an XT_ARRAY_DOUBLE of 'body' bytes of zeros */
+static Response largeResponse () {
+    Rsize_t sexp = 8 + body;
+    Rsize_t len = 8 + sexp;
+
+    struct phdr head;
+    head.cmd = itop(RESP_OK);
+    head.len = itop((unsigned int) (len & 0xffffffff));
+    head.dof = 0;
+    head.res = itop((unsigned int) (len >> 32));
+
+    Response r;
+    r.prefix.resize(sizeof(head) + 16);
+    memcpy(&r.prefix[0], &head, sizeof(head));
+    largeHeader(&r.prefix[sizeof(head)], DT_SEXP | DT_LARGE, sexp);
+    largeHeader(&r.prefix[sizeof(head) + 8], XT_ARRAY_DOUBLE | XT_LARGE, body);
+    r.zeros = body;
+    return r;
+}
+
+static Response okResponse () {
+    struct phdr head;
+    head.cmd = itop(RESP_OK);
+    head.len = 0;
+    head.dof = 0;
+    head.res = 0;
+
+    Response r;
+    r.prefix.resize(sizeof(head));
+    memcpy(&r.prefix[0], &head, sizeof(head));
+    r.zeros = 0;
+    return r;
+}
+
+static int sendAll (int s, Rmessage *m) {
+    while (!m->sendComplete()) {
+        if (m->send(s))
+            return -1;
+    }
+    return 0;
+}
+
+static int readAll (int s, Rmessage *m) {
+    while (!m->is_complete()) {
+        if (m->read(s))
+            return -1;
+    }
+    return 0;
+}
+
+/** read the large response through a sink, then parse its headers */
+static void receiveLarge (int s) {
+    Rsize_t expected = 16 + body;
+
+    Rmessage *command = new Rmessage(CMD_eval, "numeric(536879104)");
+    if (sendAll(s, command)) {
+        check(false, "send a command");
+        delete command;
+        return;
+    }
+    delete command;
+
+    CountingSink sink;
+    Rmessage *response = new Rmessage();
+    response->sink = &sink;
+    if (readAll(s, response)) {
+        check(false, "read a response over 4GB");
+        delete response;
+        return;
+    }
+    check(response->head.res == 1, "phdr.res holds the high half of the length");
+    check(response->len == expected, "message length over 4GB");
+    check(sink.bytes == expected, "the sink got all of the content");
+    delete response;
+
+    // the content as a buffered read would have it; only the headers
+    // are written, the rest stays unbacked zero pages
+    char *data = (char *) mmap(NULL, expected, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        check(false, "map the content");
+        return;
+    }
+    memcpy(data, sink.start, sizeof(sink.start));
+
+    Rmessage *m = new Rmessage();
+    m->data = data;
+    m->len = expected;
+    m->complete = 1;
+    m->parse();
+    Rsize_t plen = 0;
+    char *p = m->pars == 1 ? m->parData(0, &plen) : NULL;
+    check(m->pars == 1 && p == data + 8, "DT_LARGE parameter header is 8 bytes");
+    check(plen == 8 + body, "DT_LARGE parameter length over 4GB");
+
+    Rexp *x = m->toRexp();
+    check(x && x->type == XT_ARRAY_DOUBLE, "XT_LARGE SEXP type");
+    check(x && x->len == body && x->data == data + 16, "XT_LARGE SEXP length over 4GB");
+    check(x && x->length() == body / 8, "vector length past 2^29 doubles");
+    m->data = NULL; // not malloc'ed; toRexp() handed the message to x
+    delete x;
+    munmap(data, expected);
+}
+
+/** send an assignment over 4GB; the fake server counts what arrives */
+static void sendLarge (int s, FakeRserve &server) {
+    char *sexp;
+    Rmessage *m = Rmessage::assignment("x", 8 + body, &sexp);
+    if (!m) {
+        check(false, "allocate an assignment over 4GB");
+        return;
+    }
+    largeHeader(sexp, XT_ARRAY_DOUBLE | XT_LARGE, body);
+
+    // the parameters as the assignment laid them out
+    m->parse();
+    Rsize_t plen = 0;
+    char *p = m->pars == 2 ? m->parData(1, &plen) : NULL;
+    check(p == sexp && plen == 8 + body, "assignment's DT_LARGE parameter");
+
+    Rsize_t sent = m->len;
+    if (sendAll(s, m)) {
+        check(false, "send an assignment over 4GB");
+        delete m;
+        return;
+    }
+    delete m;
+
+    Rmessage *response = new Rmessage();
+    check(readAll(s, response) == 0 && response->head.cmd == RESP_OK, "reply to the assignment");
+    delete response;
+
+    check(server.received.size() == 2 && server.received[1] == sent && sent > 0xffffffffULL,
+          "server read the whole assignment (len and res)");
+}
+
+int main () {
+    if (sizeof(size_t) < 8) {
+        printf("messages over 4GB need a 64-bit build; skipped\n");
+        return 0;
+    }
+
+    signal(SIGALRM, timedOut);
+    alarm(60);
+
+    FakeRserve server;
+    server.responses.push_back(largeResponse());
+    server.responses.push_back(okResponse());
+    int s = server.start();
+    if (s < 0) {
+        perror("large: socketpair");
+        return 2;
+    }
+
+    receiveLarge(s);
+    sendLarge(s, server);
+    server.stop();
+
+    if (!failed)
+        printf("OK\n");
+    return failed;
+}
@@ -0,0 +1,234 @@
+/*
+    Copyright 2010 Jamie Love
+
+    This file is part of the "R-Node Server".
+
+    R-Node Server is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2.1 of the License, or
+    (at your option) any later version.
+
+    R-Node Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with R-Node Server.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * QAP1 responses to CMD_eval, laid out byte for byte as Rserve sends
+ * them, for the decoder benchmarks. Shared by src/bench/bench.cc
+ * (Rconnection.cc decoders) and binding.cc built with RNODE_BENCH
+ * (parseRexp), so both decode exactly the same messages.
+ */
+
+#ifndef __QAP1_PAYLOADS_H__
+#define __QAP1_PAYLOADS_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+#include "Rsrv.h"
+
+namespace qap1bench {
+
+/**
+ * Appends SEXPs to a buffer. begin()/end() bracket an object so its
+ * length can be filled in once the content is known; objects here stay
+ * under 8MB, so the short (4 byte) header is always enough.
+ */
+class Writer {
+    public:
+        std::vector<char> buf;
+
+        size_t begin (int type) {
+            size_t at = buf.size();
+            buf.resize(at + 4);
+            buf[at] = (char) type;
+            return at;
+        }
+
+        void end (size_t at) {
+            unsigned int len = buf.size() - at - 4;
+            unsigned int h = itop(SET_PAR(buf[at] & 255, len));
+            memcpy(&buf[at], &h, 4);
+        }
+
+        void bytes (const void *p, size_t n) {
+            buf.insert(buf.end(), (const char *) p, (const char *) p + n);
+        }
+
+        void pad (char with) {
+            while (buf.size() & 3)
+                buf.push_back(with);
+        }
+
+        void doubles (int n, double seed) {
+            size_t h = begin(XT_ARRAY_DOUBLE);
+            for (int i = 0; i < n; ++i) {
+                double d = seed + i * 0.25;
+                bytes(&d, 8);
+            }
+            end(h);
+        }
+
+        void ints (int n, int seed) {
+            size_t h = begin(XT_ARRAY_INT);
+            for (int i = 0; i < n; ++i) {
+                int v = itop(seed + i);
+                bytes(&v, 4);
+            }
+            end(h);
+        }
+
+        void strings (const std::vector<std::string> &s) {
+            size_t h = begin(XT_ARRAY_STR);
+            for (size_t i = 0; i < s.size(); ++i)
+                bytes(s[i].c_str(), s[i].size() + 1);
+            pad(1);
+            end(h);
+        }
+
+        void symbol (const char *name) {
+            size_t h = begin(XT_SYMNAME);
+            bytes(name, strlen(name) + 1);
+            pad(0);
+            end(h);
+        }
+};
+
+struct Payload {
+    std::string name;
+    int elements;          // vector elements, for per element figures
+    std::vector<char> message; // phdr, DT_SEXP parameter, SEXP
+};
+
+inline std::vector<std::string> labels (const char *prefix, int n) {
+    std::vector<std::string> s;
+    char b[64];
+    for (int i = 0; i < n; ++i) {
+        snprintf(b, sizeof(b), "%s%d", prefix, i);
+        s.push_back(b);
+    }
+    return s;
+}
+
+/** wrap a SEXP into a RESP_OK message with one DT_SEXP parameter */
+inline Payload message (const char *name, int elements, const Writer &sexp) {
+    Payload p;
+    p.name = name;
+    p.elements = elements;
+
+    struct phdr head;
+    head.cmd = itop(RESP_OK);
+    head.len = itop(sexp.buf.size() + 4);
+    head.dof = 0;
+    head.res = 0;
+    unsigned int par = itop(SET_PAR(DT_SEXP, sexp.buf.size()));
+
+    p.message.resize(sizeof(head) + 4);
+    memcpy(&p.message[0], &head, sizeof(head));
+    memcpy(&p.message[sizeof(head)], &par, 4);
+    p.message.insert(p.message.end(), sexp.buf.begin(), sexp.buf.end());
+    return p;
+}
+
+/** rnorm(n)-like numeric vector */
+inline Payload numericVector (int n) {
+    Writer w;
+    w.doubles(n, 1.5);
+    return message("numeric vector", n, w);
+}
+
+/** 1:n */
+inline Payload integerVector (int n) {
+    Writer w;
+    w.ints(n, 1);
+    return message("integer vector", n, w);
+}
+
+/** paste("id", 1:n) style character vector */
+inline Payload stringVector (int n) {
+    Writer w;
+    w.strings(labels("observation_", n));
+    return message("string vector", n, w);
+}
+
+/** as.character(<factor>): n values drawn from a dozen labels */
+inline Payload categoricalVector (int n) {
+    static const char *levels[] = {
+        "Auckland", "Wellington", "Christchurch", "Hamilton", "Tauranga", "Dunedin",
+        "Palmerston North", "Napier", "Nelson", "Rotorua", "New Plymouth", "Whangarei"
+    };
+    std::vector<std::string> s;
+    for (int i = 0; i < n; ++i)
+        s.push_back(levels[(i * 7) % 12]);
+    Writer w;
+    w.strings(s);
+    return message("categorical", n, w);
+}
+
+/** list(a1=..., a2=..., ...) of short numeric vectors, as a tagged pairlist */
+inline Payload taggedList (int n) {
+    std::vector<std::string> tags = labels("a", n);
+    Writer w;
+    size_t h = w.begin(XT_LIST_TAG);
+    for (int i = 0; i < n; ++i) {
+        w.doubles(4, i);
+        w.symbol(tags[i].c_str());
+    }
+    w.end(h);
+    return message("tagged list", n * 4, w);
+}
+
+/**
+ * data.frame(x=<double>, n=<int>, label=<character>) of 'rows' rows,
+ * with names, class and compact row.names attributes.
+ */
+inline Payload dataFrame (int rows) {
+    Writer w;
+    size_t h = w.begin(XT_VECTOR | XT_HAS_ATTR);
+
+    size_t a = w.begin(XT_LIST_TAG);
+    std::vector<std::string> names;
+    names.push_back("x");
+    names.push_back("n");
+    names.push_back("label");
+    w.strings(names);
+    w.symbol("names");
+    unsigned int rn[2] = { itop(0x80000000u), itop((unsigned int) -rows) }; // c(NA, -rows)
+    size_t r = w.begin(XT_ARRAY_INT);
+    w.bytes(rn, 8);
+    w.end(r);
+    w.symbol("row.names");
+    std::vector<std::string> cls(1, "data.frame");
+    w.strings(cls);
+    w.symbol("class");
+    w.end(a);
+
+    w.doubles(rows, 0.5);
+    w.ints(rows, 100);
+    w.strings(labels("row", rows));
+    w.end(h);
+    return message("data frame", rows * 3, w);
+}
+
+/** the set every benchmark runs through */
+inline std::vector<Payload> standardPayloads () {
+    std::vector<Payload> p;
+    p.push_back(numericVector(100000));
+    p.push_back(integerVector(100000));
+    p.push_back(stringVector(20000));
+    p.push_back(categoricalVector(100000));
+    p.push_back(taggedList(2000));
+    p.push_back(dataFrame(10000));
+    return p;
+}
+
+}
+
+#endif
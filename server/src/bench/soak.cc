@@ -0,0 +1,195 @@
+/*
+    Copyright 2010 Jamie Love
+
+    This file is part of the "R-Node Server".
+
+    R-Node Server is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2.1 of the License, or
+    (at your option) any later version.
+
+    R-Node Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with R-Node Server.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Buffer pool soak test: runs query after query against a canned Rserve
+ * (fake_rserve.h) the way a Connection does - command and response in
+ * buffers of one RbufferPool, the response decoded and dropped - cycling
+ * through the payloads of qap1_payloads.h. Once warmed up, the pool must
+ * not go back to malloc, sending the command and reading the response
+ * (Rmessage::send() and read(), over the pool) must not allocate at all,
+ * the allocations of decoding - the Rexp tree toRexp() builds, one
+ * object or more per element - must not creep up per query and the
+ * resident set must stay put. Exits nonzero if any of that fails. Needs
+ * neither R nor Rserve.
+ *
+ *   make soak                (or: src/bench/soak [queries])
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define MAIN // we are the main program, we need to define this for Rserve
+#define SOCK_ERRORS
+
+#include "sisocks.h"
+#include "Rconnection.h"
+#include "qap1_payloads.h"
+#include "fake_rserve.h"
+
+using namespace qap1bench;
+
+/** the main thread's allocations, by what it was doing */
+static unsigned long transportMallocs = 0; // in Rmessage::send() and read()
+static unsigned long rexpMallocs = 0;      // in toRexp() and deleting its Rexp
+
+#ifdef __GLIBC__
+// only set on the main thread: the fake server's allocations don't count
+static __thread unsigned long *counting = NULL;
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *malloc(size_t size) {
+    if (counting)
+        (*counting)++;
+    return __libc_malloc(size);
+}
+#define COUNTS_ALLOCATIONS 1
+
+/** count the allocations that follow in 'counter' (none if NULL) */
+static void count (unsigned long *counter) {
+    counting = counter;
+}
+#else
+#define COUNTS_ALLOCATIONS 0
+static void count (unsigned long *) {}
+#endif
+
+/** resident set size in bytes */
+static long rss () {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/** one query: send a command, read and decode the response; 0 on success */
+static int query (int s, RbufferPool *pool) {
+    Rmessage *command = new Rmessage(CMD_eval, "try(rnorm(100000))", pool);
+    count(&transportMallocs);
+    while (!command->sendComplete()) {
+        if (command->send(s)) {
+            count(NULL);
+            delete command;
+            return -1;
+        }
+    }
+    count(NULL);
+    delete command;
+
+    Rmessage *response = new Rmessage(pool);
+    count(&transportMallocs);
+    while (!response->is_complete()) {
+        if (response->read(s)) {
+            count(NULL);
+            delete response;
+            return -1;
+        }
+    }
+    count(&rexpMallocs);
+    Rexp *x = response->toRexp();
+    if (!x) {
+        count(NULL);
+        delete response;
+        return -1;
+    }
+    delete x; // takes the message with it
+    count(NULL);
+    return 0;
+}
+
+int main (int argc, char **argv) {
+    int queries = argc > 1 ? atoi(argv[1]) : 10000;
+    if (queries < 20)
+        queries = 20;
+    int warmup = queries / 10;
+    int half = warmup + (queries - warmup) / 2;
+    const long rssSlack = 1 << 20;
+
+    std::vector<Payload> payloads = standardPayloads();
+    FakeRserve server;
+    for (size_t i = 0; i < payloads.size(); ++i) {
+        Response r;
+        r.prefix = payloads[i].message;
+        r.zeros = 0;
+        server.responses.push_back(r);
+    }
+    int s = server.start();
+    if (s < 0) {
+        perror("soak: socketpair");
+        return 2;
+    }
+
+    RbufferPool pool;
+    long rssWarm = 0;
+    unsigned long poolWarm = 0, transportWarm = 0, rexpWarm = 0, rexpHalf = 0;
+    for (int i = 0; i < queries; ++i) {
+        if (i == warmup) {
+            rssWarm = rss();
+            poolWarm = pool.allocations();
+            transportWarm = transportMallocs;
+            rexpWarm = rexpMallocs;
+        } else if (i == half) {
+            rexpHalf = rexpMallocs;
+        }
+        if (query(s, &pool)) {
+            fprintf(stderr, "soak: query %d failed\n", i);
+            return 2;
+        }
+    }
+    long rssEnd = rss();
+    unsigned long poolEnd = pool.allocations();
+    server.stop();
+
+    double transportPerQuery = (double) (transportMallocs - transportWarm) / (queries - warmup);
+    double perQueryFirst = (double) (rexpHalf - rexpWarm) / (half - warmup);
+    double perQuerySecond = (double) (rexpMallocs - rexpHalf) / (queries - half);
+
+    printf("%d queries, %d to warm up\n", queries, warmup);
+    printf("resident set      %10ld KB after warm up %10ld KB at the end\n", rssWarm / 1024, rssEnd / 1024);
+    printf("pool mallocs      %10lu after warm up %10lu at the end (%lu reuses)\n", poolWarm, poolEnd, pool.reuses());
+    if (COUNTS_ALLOCATIONS) {
+        printf("send/read allocs  %10.1f per query after warm up\n", transportPerQuery);
+        printf("Rexp allocs/query %10.1f first half   %10.1f second half\n", perQueryFirst, perQuerySecond);
+    }
+
+    int failed = 0;
+    if (poolEnd != poolWarm) {
+        printf("FAILED: the buffer pool kept allocating after warm up\n");
+        failed = 1;
+    }
+    if (COUNTS_ALLOCATIONS && transportMallocs != transportWarm) {
+        printf("FAILED: sending and reading allocated after warm up\n");
+        failed = 1;
+    }
+    if (COUNTS_ALLOCATIONS && perQuerySecond > perQueryFirst * 1.01 + 1) {
+        printf("FAILED: Rexp allocations per query grew\n");
+        failed = 1;
+    }
+    if (rssEnd - rssWarm > rssSlack) {
+        printf("FAILED: resident set grew by %ld KB\n", (rssEnd - rssWarm) / 1024);
+        failed = 1;
+    }
+    if (!failed)
+        printf("OK\n");
+    return failed;
+}
@@ -17,11 +17,16 @@
     along with R-Node Server.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
 #include <unistd.h>
 
 // Node stuff
 #include <node.h>
 #include <node_events.h>
+#include <node_buffer.h>
 #include <assert.h>
 
 // Rserve stuff
@@ -38,6 +43,21 @@ static Persistent<String> close_symbol;
 static Persistent<String> connect_symbol;
 static Persistent<String> login_symbol;
 static Persistent<String> command_sent_symbol;
+static Persistent<String> length_symbol;
+static Persistent<String> typed_arrays_symbol;
+static Persistent<String> stream_symbol;
+static Persistent<String> cache_symbol;
+static Persistent<String> timing_symbol;
+static Persistent<String> intern_symbol;
+static Persistent<String> tables_symbol;
+static Persistent<String> binary_symbol;
+static Persistent<String> chunk_symbol;
+static Persistent<String> data_symbol;
+static Persistent<String> timeout_ms_symbol;
+static Persistent<String> setup_symbol;
+static Persistent<String> trap_symbol;
+static Persistent<String> replaced_symbol;
+static Persistent<String> session_symbol;
 #define STATE_SYMBOL String::NewSymbol("state")
 
 char *getErrorMsg (char code) {
@@ -74,15 +94,411 @@ void dumpChars (char *d, int len) {
 }
 
 // Taken from java code.
-int getRexpLen (char *buf, int o) {
-    int len = ((buf[o]&64)>0) ? // "long" format; still - we support 32-bit only
-        ((buf[o+1]&255)|((buf[o+2]&255)<<8)|((buf[o+3]&255)<<16)|((buf[o+4]&255)<<24))
-        :
-        ((buf[o+1]&255)|((buf[o+2]&255)<<8)|((buf[o+3]&255)<<16));
+Rsize_t getRexpLen (const char *buf, Rsize_t o) {
+    Rsize_t len = (buf[o+1]&255)|((buf[o+2]&255)<<8)|((buf[o+3]&255)<<16);
+    if ((buf[o]&XT_LARGE)>0) // "long" format: 56 bits, the rest in the next word
+        for (int i = 0; i < 4; ++i)
+            len |= ((Rsize_t)(buf[o+4+i]&255)) << (24 + 8 * i);
     return len;
 }
 
-Local<Value> parseRexp (char *data, int &startAt) {
+/**
+ * Javascript arrays and strings are indexed by int; a SEXP with more
+ * elements than that is decoded as this error instead.
+ */
+static const Rsize_t MAX_ELEMENTS = 0x7fffffff;
+
+static Local<Value> tooLong () {
+    HandleScope scope;
+    return scope.Close(Exception::Error(String::New("Vector too long for javascript")));
+}
+
+/**
+ * Session keys go to javascript as hex strings; 'hex' takes 2 * n + 1.
+ */
+void bytesToHex (const char *bytes, int n, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < n; ++i) {
+        hex[2 * i] = digits[(bytes[i] >> 4) & 15];
+        hex[2 * i + 1] = digits[bytes[i] & 15];
+    }
+    hex[2 * n] = 0;
+}
+
+static int hexDigit (char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * false unless 'hex' is exactly n bytes' worth of hex digits.
+ */
+bool hexToBytes (const char *hex, char *bytes, int n) {
+    if ((int)strlen(hex) != 2 * n)
+        return false;
+    for (int i = 0; i < n; ++i) {
+        int hi = hexDigit(hex[2 * i]), lo = hexDigit(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        bytes[i] = (char)(hi * 16 + lo);
+    }
+    return true;
+}
+
+/**
+ * Intern table for the strings of one response, so that repeated values
+ * (factor levels, categories) decode to one shared javascript string.
+ * Keys are copied in; the table does not depend on the buffer they were
+ * read from. Past MAX_ENTRIES distinct values new ones are no longer
+ * added, so high cardinality columns cost little more than without it.
+ */
+class StringTable {
+    public:
+        static const unsigned int MAX_ENTRIES = 65536;
+
+        unsigned int hits;
+
+        StringTable () : hits(0), used_(0) {}
+
+        ~StringTable () {
+            Clear();
+        }
+
+        Local<String> Get (const char *p, int len) {
+            HandleScope scope;
+
+            unsigned int h = 2166136261u;
+            for (int i = 0; i < len; ++i) {
+                h ^= (unsigned char) p[i];
+                h *= 16777619u;
+            }
+
+            if (slots_.empty())
+                slots_.resize(64);
+
+            unsigned int mask = slots_.size() - 1;
+            unsigned int i = h & mask;
+            while (!slots_[i].value.IsEmpty()) {
+                Slot &slot = slots_[i];
+                if (slot.hash == h && slot.key.size() == (size_t) len && !memcmp(slot.key.data(), p, len)) {
+                    hits++;
+                    return scope.Close(Local<String>::New(slot.value));
+                }
+                i = (i + 1) & mask;
+            }
+
+            Local<String> str = String::New(p, len);
+            if (used_ < MAX_ENTRIES) {
+                slots_[i].hash = h;
+                slots_[i].key.assign(p, len);
+                slots_[i].value = Persistent<String>::New(str);
+                if (++used_ * 2 > slots_.size())
+                    Grow();
+            }
+            return scope.Close(str);
+        }
+
+        void Clear () {
+            for (unsigned int i = 0; i < slots_.size(); ++i) {
+                if (!slots_[i].value.IsEmpty())
+                    slots_[i].value.Dispose();
+            }
+            std::vector<Slot>().swap(slots_);
+            used_ = 0;
+            hits = 0;
+        }
+
+    private:
+        struct Slot {
+            unsigned int hash;
+            std::string key;
+            Persistent<String> value;
+        };
+
+        std::vector<Slot> slots_; // open addressing, size a power of two
+        unsigned int used_;
+
+        void Grow () {
+            std::vector<Slot> old(slots_.size() * 2);
+            old.swap(slots_);
+            unsigned int mask = slots_.size() - 1;
+            for (unsigned int j = 0; j < old.size(); ++j) {
+                if (old[j].value.IsEmpty())
+                    continue;
+                unsigned int i = old[j].hash & mask;
+                while (!slots_[i].value.IsEmpty())
+                    i = (i + 1) & mask;
+                slots_[i].hash = old[j].hash;
+                slots_[i].key.swap(old[j].key);
+                slots_[i].value = old[j].value;
+            }
+        }
+};
+
+/**
+ * Options controlling how parseRexp turns a QAP1 payload into javascript
+ * values. Filled from the optional options object given to query().
+ */
+struct DecodeOptions {
+    bool typedArrays; // XT_ARRAY_DOUBLE/XT_ARRAY_INT as external arrays, not Array
+    bool stream;      // decode while receiving, emitting 'chunk' events
+    bool cache;       // the command has no side effects; its result may be cached
+    bool timing;      // hand back the query's timings along with the result
+    bool intern;      // share one string between repeated values of XT_ARRAY_STR
+    bool tables;      // data.frames as columnar tables (see decodeTable)
+    bool binary;      // no decoding; the result is the SEXP in a frame (see binaryFrame)
+    bool setup;       // a session setup command, run again on a replacement connection
+    bool trap;        // send the command inside try() (see wrapInTry)
+    double timeoutMs; // give up on the query after this long (0: never), see TimedOut
+    StringTable *strings; // the intern table of the response, when interning
+
+    DecodeOptions () : typedArrays(false), stream(false), cache(false), timing(false),
+        intern(false), tables(false), binary(false), setup(false), trap(true), timeoutMs(0), strings(NULL) {}
+
+    void read (Handle<Value> options) {
+        if (options.IsEmpty() || !options->IsObject())
+            return;
+        Local<Object> o = options->ToObject();
+        if (o->Has(typed_arrays_symbol))
+            typedArrays = o->Get(typed_arrays_symbol)->BooleanValue();
+        if (o->Has(stream_symbol))
+            stream = o->Get(stream_symbol)->BooleanValue();
+        if (o->Has(cache_symbol))
+            cache = o->Get(cache_symbol)->BooleanValue();
+        if (o->Has(timing_symbol))
+            timing = o->Get(timing_symbol)->BooleanValue();
+        if (o->Has(intern_symbol))
+            intern = o->Get(intern_symbol)->BooleanValue();
+        if (o->Has(tables_symbol))
+            tables = o->Get(tables_symbol)->BooleanValue();
+        if (o->Has(binary_symbol))
+            binary = o->Get(binary_symbol)->BooleanValue();
+        if (o->Has(setup_symbol))
+            setup = o->Get(setup_symbol)->BooleanValue();
+        if (o->Has(trap_symbol))
+            trap = o->Get(trap_symbol)->BooleanValue();
+        if (o->Has(timeout_ms_symbol))
+            timeoutMs = o->Get(timeout_ms_symbol)->NumberValue();
+    }
+};
+
+/**
+ * Backing store of an external array handed to javascript. Released by
+ * the garbage collector via a weak handle.
+ */
+struct ExternalArrayData {
+    char *data;
+    size_t bytes;
+    int reported; // told to V8, which counts in int
+};
+
+/**
+ * V8's limit on the length of an external array (ExternalArray::kMaxLength);
+ * past it SetIndexedPropertiesToExternalArrayData aborts.
+ */
+static const Rsize_t MAX_EXTERNAL_ELEMENTS = 0x3fffffff;
+
+static void releaseExternalArray (Persistent<Value> object, void *parameter) {
+    ExternalArrayData *store = static_cast<ExternalArrayData *>(parameter);
+    V8::AdjustAmountOfExternalAllocatedMemory(-store->reported);
+    free(store->data);
+    delete store;
+    object.Dispose();
+    object.Clear();
+}
+
+/**
+ * Create a Float64Array/Int32Array style object over 'count' elements
+ * starting at 'src'. The values are taken with a single memcpy - the
+ * source sits inside the received message, which is neither aligned
+ * for doubles nor kept alive as long as the javascript object.
+ *
+ * A count too long for an external array, or for memory, gives an Error
+ * instead.
+ */
+Local<Value> newExternalArray (const char *src, Rsize_t count, int elementSize, ExternalArrayType type) {
+    HandleScope scope;
+
+    Rsize_t bytes = count * elementSize;
+    if (count > MAX_EXTERNAL_ELEMENTS || bytes != (Rsize_t) (size_t) bytes)
+        return scope.Close(tooLong());
+
+    char *data = (char *) malloc(bytes > 0 ? bytes : 1);
+    if (!data)
+        return scope.Close(Exception::Error(String::New("Out of memory for a typed array")));
+    memcpy(data, src, bytes);
+
+    ExternalArrayData *store = new ExternalArrayData;
+    store->data = data;
+    store->bytes = bytes;
+    store->reported = bytes > 0x7fffffff ? 0x7fffffff : (int) bytes;
+
+    Local<Object> a = Object::New();
+    a->SetIndexedPropertiesToExternalArrayData(store->data, type, (int) count);
+    a->Set(length_symbol, Integer::New((int) count), (PropertyAttribute) (ReadOnly | DontEnum));
+
+    Persistent<Object> handle = Persistent<Object>::New(a);
+    handle.MakeWeak(store, releaseExternalArray);
+    V8::AdjustAmountOfExternalAllocatedMemory(store->reported);
+
+    return scope.Close(a);
+}
+
+/**
+ * 'count' doubles starting at 'p', as an Array or, if asked for, a typed array.
+ */
+Local<Value> decodeDoubles (const char *p, int count, const DecodeOptions &options) {
+    HandleScope scope;
+
+    if (options.typedArrays)
+        return scope.Close(newExternalArray (p, count, 8, kExternalDoubleArray));
+
+    Local<Array> a = Array::New(count);
+    for (int i = 0; i < count; ++i) {
+        a->Set(Integer::New(i), Number::New (*((double *) (p + i * 8))));
+    }
+    return scope.Close(a);
+}
+
+/**
+ * 'count' ints starting at 'p', as an Array or, if asked for, a typed array.
+ */
+Local<Value> decodeInts (const char *p, int count, const DecodeOptions &options) {
+    HandleScope scope;
+
+    if (options.typedArrays)
+        return scope.Close(newExternalArray (p, count, 4, kExternalIntArray));
+
+    Local<Array> a = Array::New(count);
+    for (int i = 0; i < count; ++i) {
+        a->Set(Integer::New(i), Integer::New (*((int32_t *) (p + i * 4))));
+    }
+    return scope.Close(a);
+}
+
+/**
+ * 'count' bytes of an XT_RAW as a node Buffer. The bytes are copied
+ * once, straight into the Buffer's storage: the message buffer they
+ * arrive in goes back to the pool for the next response.
+ */
+Local<Object> decodeRaw (const char *p, int count) {
+    HandleScope scope;
+    Buffer *buffer = Buffer::New(count);
+    memcpy(buffer->data(), p, count);
+    return scope.Close(Local<Object>::New(buffer->handle_));
+}
+
+/**
+ * The SEXP at 'sexp', undecoded, in a Buffer for sending on as it is
+ * (the /R handler's ?format=binary):
+ *
+ *   0  "RNB1"
+ *   4  uint32, little endian: length of the SEXP
+ *   8  the SEXP, as Rserve sent it (QAP1: 4 byte header, or 8 with
+ *      XT_LARGE, then the body; numeric vectors are raw little endian
+ *      doubles and int32s, strings NUL terminated and padded with \01)
+ *
+ * This is one memcpy of the message, instead of a decode into
+ * javascript objects and a JSON.stringify of those. A SEXP of 4GB or
+ * more does not fit the frame and gives an Error.
+ */
+Local<Value> binaryFrame (const char *sexp) {
+    HandleScope scope;
+    Rsize_t length = getRexpLen (sexp, 0) + ((sexp[0] & XT_LARGE) ? 8 : 4);
+    if (length > 0xffffffff - 8)
+        return scope.Close(Exception::Error(String::New("SEXP too large for a binary frame")));
+    Buffer *buffer = Buffer::New(length + 8);
+    char *p = buffer->data();
+    memcpy(p, "RNB1", 4);
+    for (int i = 0; i < 4; ++i)
+        p[4 + i] = (char)((length >> (8 * i)) & 0xff);
+    memcpy(p + 8, sexp, length);
+    return scope.Close(Local<Object>::New(buffer->handle_));
+}
+
+/**
+ * 'count' complex numbers (re, im pairs of doubles) at 'p', as an Array
+ * of { re, im } or, with typedArrays, one Float64Array of 2 * count
+ * interleaved values.
+ */
+Local<Value> decodeComplex (const char *p, int count, const DecodeOptions &options) {
+    HandleScope scope;
+
+    if (options.typedArrays)
+        return scope.Close(newExternalArray (p, (Rsize_t) count * 2, 8, kExternalDoubleArray));
+
+    Local<String> re = String::NewSymbol("re");
+    Local<String> im = String::NewSymbol("im");
+    Local<Array> a = Array::New(count);
+    for (int i = 0; i < count; ++i) {
+        double v[2];
+        memcpy(v, p + i * 16, 16);
+        Local<Object> c = Object::New();
+        c->Set(re, Number::New(v[0]));
+        c->Set(im, Number::New(v[1]));
+        a->Set(Integer::New(i), c);
+    }
+    return scope.Close(a);
+}
+
+/**
+ * The strings of an XT_ARRAY_STR body that lie wholly within 'avail'
+ * bytes at 'p', in one pass: each string is created with its length as
+ * found by memchr, and through 'table' if interning. NA ("\xff") becomes
+ * null. 'consumed' is set to the bytes used, which includes the '\01'
+ * padding once the end of the strings has been reached.
+ */
+Local<Array> decodeStrings (const char *p, Rsize_t avail, Rsize_t &consumed, StringTable *table) {
+    HandleScope scope;
+
+    Local<Array> a = Array::New();
+    int count = 0;
+    Rsize_t at = 0;
+    while (at < avail && p[at] != 1) {
+        const char *end = (const char *) memchr (p + at, 0, avail - at);
+        if (!end)
+            break; // incomplete string
+        int len = end - (p + at);
+        Local<Value> v;
+        if (len == 1 && p[at] == (char) 0xff)
+            v = Local<Value>::New(Null()); // NA_STRING
+        else if (table)
+            v = table->Get(p + at, len);
+        else
+            v = String::New(p + at, len);
+        a->Set(Integer::New(count++), v);
+        at = end - p + 1;
+    }
+    while (at < avail && p[at] == 1)
+        at++;
+    consumed = at;
+
+    return scope.Close(a);
+}
+
+Local<Value> decodeTable (char *data, Rsize_t startAt, Rsize_t eox, Handle<Value> attributes, const DecodeOptions &options);
+
+/**
+ * True if the decoded attributes of a SEXP give it class "data.frame".
+ */
+static bool isDataFrame (Handle<Value> attributes) {
+    if (!attributes->IsObject())
+        return false;
+    Local<Value> cls = attributes->ToObject()->Get(String::NewSymbol("class"));
+    if (!cls->IsArray())
+        return false;
+    Handle<Array> a = Handle<Array>::Cast(cls);
+    for (unsigned int i = 0; i < a->Length(); ++i) {
+        String::Utf8Value c(a->Get(Integer::New(i)));
+        if (*c && !strcmp(*c, "data.frame"))
+            return true;
+    }
+    return false;
+}
+
+Local<Value> parseRexp (char *data, Rsize_t &startAt, const DecodeOptions &options) {
     HandleScope scope;
 
     Local<Value> retval = Local<Value>::New(Null());
@@ -91,7 +507,7 @@ Local<Value> parseRexp (char *data, int &startAt) {
     if (!data)
         return scope.Close(err);
 
-    int len = getRexpLen (data, startAt);
+    Rsize_t len = getRexpLen (data, startAt);
     bool hasAttribute = ((data[startAt]&128)!=0);
     bool isLong = ((data[startAt]&64)!=0);
     int type = (int)(data[startAt]&63); 
@@ -100,22 +516,20 @@ Local<Value> parseRexp (char *data, int &startAt) {
     if (isLong) 
         startAt += 4;
     startAt += 4;
-    int eox=startAt + len;
+    Rsize_t eox=startAt + len;
 
     bool isTags = false;
 
     Local<Value> attributes = Local<Value>::New(Null());
     if (hasAttribute)  {
         isTags = type == XT_LIST_TAG;
-        attributes = parseRexp (data, startAt); 
+        attributes = parseRexp (data, startAt, options); 
     }
 
 #ifdef DEBUG_CXX
-    fprintf(stderr, "parseRexp: type=%d, len=%d, hasAtt=%d, isLong=%d\n", type, len, hasAttribute, isLong);
+    fprintf(stderr, "parseRexp: type=%d, len=%llu, hasAtt=%d, isLong=%d\n", type, len, hasAttribute, isLong);
 #endif
 
-    // TODO - types: 16
-
     if (type == XT_NULL) {
         startAt = eox;
         retval = Local<Value>::New(Null());
@@ -131,18 +545,12 @@ Local<Value> parseRexp (char *data, int &startAt) {
         startAt = eox;
     }
     else if (type == XT_ARRAY_DOUBLE) {
-        int totalValues = (eox-startAt)/8;
-        int i = 0;
-        Local<Array> a = Array::New(totalValues);
-        while (startAt<eox) {
-            a->Set(Integer::New(i), Number::New (*((double *) (&data[startAt]))));
-            startAt += 8;
-            i++;
-        };
-        if (startAt!=eox) {
+        if ((eox-startAt) % 8) {
             printf("Warning: double array SEXP size mismatch\n");
         };
-        retval = a;
+        retval = (eox-startAt)/8 > MAX_ELEMENTS ? tooLong() :
+            decodeDoubles (data + startAt, (eox-startAt)/8, options);
+        startAt = eox;
     }
     else if (type == XT_ARRAY_BOOL) {
         int totalValues = *((int32_t *)&data[startAt]);
@@ -160,53 +568,28 @@ Local<Value> parseRexp (char *data, int &startAt) {
         retval = a;
     }
     else if (type == XT_ARRAY_INT) {
-        int totalValues = (eox-startAt)/4;
-        int i = 0;
-        Local<Array> a = Array::New(totalValues);
-        while (startAt<eox) {
-            a->Set(Integer::New(i), Integer::New (*((int32_t *) (&data[startAt]))));
-            startAt += 4;
-            i++;
-        };
-        if (startAt!=eox) {
+        if ((eox-startAt) % 4) {
             printf("Warning: int array SEXP size mismatch\n");
         };
-        retval = a;
+        retval = (eox-startAt)/4 > MAX_ELEMENTS ? tooLong() :
+            decodeInts (data + startAt, (eox-startAt)/4, options);
+        startAt = eox;
     }
     else if (type==XT_STR||type==XT_SYMNAME) {
         retval = String::New (data + startAt); // TODO Deal with encoding.
     }
     else if (type == XT_ARRAY_STR) {
-        int i = 0;
-        int count = 0;
-        while (startAt + i < eox) {
-            if (data[startAt + i] == 0) count++;
-            i++;
-            if (data[startAt] == 1) break;
-        }
-        Local<Array> a = Array::New(count);
-        if (count > 0) {
-            i = 0;
-            while (startAt<eox && i < count) {
-                char *s = data + startAt;
-                a->Set(Integer::New(i), String::New (s));
-
-                while (data[++startAt] != 0 && startAt < eox) ;
-                ++startAt;
-
-                if (data[startAt] == 1) break;
-                ++i;
-            };
-        }
-        retval = a;
+        Rsize_t consumed;
+        retval = decodeStrings (data + startAt, eox - startAt, consumed, options.strings);
+        startAt = eox;
     }
     else if (type==XT_LIST_NOTAG || type==XT_LIST_TAG) {
         Local<Object> a = Object::New();
         while (startAt < eox) {
-            Local<Value> values = parseRexp(data, startAt);
+            Local<Value> values = parseRexp(data, startAt, options);
             Local<Value> tag = Local<Value>::New(Null());
             if (type==XT_LIST_TAG) {
-                tag = parseRexp(data, startAt);
+                tag = parseRexp(data, startAt, options);
             }
             if (!tag->IsNull()) { // TODO Deal with null
                 a->Set (tag, values);
@@ -218,11 +601,95 @@ Local<Value> parseRexp (char *data, int &startAt) {
         }
         retval = a;
     }
+    else if (type == XT_ARRAY_CPLX) {
+        if ((eox-startAt) % 16) {
+            printf("Warning: complex array SEXP size mismatch\n");
+        };
+        retval = (eox-startAt)/16 > MAX_ELEMENTS / 2 ? tooLong() :
+            decodeComplex (data + startAt, (eox-startAt)/16, options);
+        startAt = eox;
+    }
+    else if (type == XT_RAW) {
+        int count = *((int32_t *)&data[startAt]);
+        if (count < 0 || startAt + 4 + (Rsize_t)count > eox) {
+            printf("Warning: raw SEXP size mismatch\n");
+            count = 0;
+        }
+        retval = decodeRaw (data + startAt + 4, count);
+        startAt = eox;
+    }
+    else if (type == XT_ARRAY_BOOL_UA && eox - startAt > MAX_ELEMENTS) {
+        retval = tooLong();
+        startAt = eox;
+    }
+    else if (type == XT_ARRAY_BOOL_UA) {
+        Local<Array> a = Array::New(eox - startAt);
+        for (int i = 0; startAt + i < eox; ++i) {
+            a->Set(Integer::New(i), Boolean::New (data[startAt + i] != 0));
+        }
+        retval = a;
+        startAt = eox;
+    }
+    else if (type == XT_INT) {
+        retval = Integer::New (*((int32_t *)&data[startAt]));
+        startAt = eox;
+    }
+    else if (type == XT_DOUBLE) {
+        double d;
+        memcpy(&d, data + startAt, 8);
+        retval = Number::New (d);
+        startAt = eox;
+    }
+    else if (type == XT_SYM) { // the name as an XT_STR
+        retval = parseRexp(data, startAt, options);
+    }
+    else if (type == XT_LANG || type == XT_LANG_NOTAG || type == XT_LANG_TAG) {
+        // A call: { language: [function, arg, ...], names: [tag or null, ...] }
+        std::vector<Local<Value> > parts, tags;
+        while (startAt < eox) {
+            parts.push_back (parseRexp(data, startAt, options));
+            tags.push_back (type == XT_LANG_TAG ? parseRexp(data, startAt, options) : Local<Value>::New(Null()));
+        }
+        Local<Array> a = Array::New(parts.size());
+        Local<Array> n = Array::New(tags.size());
+        for (unsigned int i = 0; i < parts.size(); ++i) {
+            a->Set (Integer::New(i), parts[i]);
+            n->Set (Integer::New(i), tags[i]);
+        }
+        Local<Object> o = Object::New();
+        o->Set (String::NewSymbol("language"), a);
+        if (type == XT_LANG_TAG)
+            o->Set (String::NewSymbol("names"), n);
+        retval = o;
+    }
+    else if (type == XT_CLOS) {
+        // A function: { formals: { name: default, ... }, body: <call> }
+        Local<Value> formals = parseRexp(data, startAt, options);
+        Local<Value> body = startAt < eox ? parseRexp(data, startAt, options) : Local<Value>::New(Null());
+        Local<Object> o = Object::New();
+        o->Set (String::NewSymbol("formals"), formals);
+        o->Set (String::NewSymbol("body"), body);
+        retval = o;
+    }
+    else if (type == XT_S4) {
+        retval = Object::New(); // no content; the slots are the attributes
+    }
+    else if (type == XT_UNKNOWN) {
+        Local<Object> o = Object::New();
+        o->Set (String::NewSymbol("unknownType"), Integer::New (*((int32_t *)&data[startAt])));
+        retval = o;
+    }
 
-    if (type==XT_VECTOR) {
+    if (type==XT_VECTOR && options.tables && isDataFrame(attributes)) {
+        retval = decodeTable (data, startAt, eox, attributes, options);
+        startAt = eox;
+        return scope.Close(retval);
+    }
+
+    if (type==XT_VECTOR || type==XT_VECTOR_EXP) {
         std::vector <Local<Value> > v;
         while (startAt < eox) {
-            Local<Value> r = parseRexp(data, startAt);
+            Local<Value> r = parseRexp(data, startAt, options);
             v.push_back (r);
         };
         if (startAt!=eox) {
@@ -254,213 +721,3332 @@ Local<Value> parseRexp (char *data, int &startAt) {
     return scope.Close(retval);
 }
 
-class Connection : public EventEmitter {
-    private:
+/**
+ * A large response decoded in two halves (see Connection::StartDecode).
+ * Scan() has no V8 in it and runs on a thread pool thread: it walks the
+ * whole SEXP once, checking every length against its parent, and finds
+ * where each string of an XT_ARRAY_STR starts and how long it is. The
+ * nodes are kept in pre-order, so Materialize() on the main thread only
+ * has to create the javascript values, with no searching of the
+ * payload.
+ *
+ * Only vectors, lists and string arrays are scanned into; any other
+ * node is materialized by parseRexp, which for numeric arrays is a
+ * memcpy anyway (decodeDoubles/decodeInts).
+ */
+class RexpScan {
+    public:
+        RexpScan () : ok(false) {}
 
-        ev_io read_watcher_;
-        ev_io write_watcher_;
+        bool Scan (const char *data, Rsize_t length) {
+            nodes.clear();
+            stringAt.clear();
+            stringLen.clear();
+            Rsize_t end;
+            ok = ScanNode(data, 0, length, 0, end);
+            return ok;
+        }
 
-        Rconnection *connection_;
+        Local<Value> Materialize (char *data, const DecodeOptions &options) {
+            HandleScope scope;
+            if (!ok)
+                return scope.Close(Exception::Error(String::New("Parse exception")));
+            unsigned int i = 0;
+            return scope.Close(MaterializeNode(data, i, options));
+        }
 
-        Rmessage *resultMessage;
-        Rmessage *currentMessageCommand;
+    private:
+        struct Node {
+            int type;
+            Rsize_t at;     // the header
+            Rsize_t body;   // after the attributes
+            Rsize_t end;
+            bool hasAttr;
+            unsigned int next;  // the node after this subtree
+            int strings;    // XT_ARRAY_STR: first of its entries in stringAt/stringLen
+            int count;
+        };
 
-        static const int STATE_UNCONNECTED = 0;
-        static const int STATE_CONNECTING = 1;
-        static const int STATE_IDLE = 2;
-        static const int STATE_SENDING_COMMAND = 3;
-        static const int STATE_AWAITING_COMMAND_RESPONSE = 4;
-        static const int STATE_RECEIVING_COMMAND = 5;
-        static const int STATE_CLOSING = 6;
-        static const int STATE_LOGGING_IN = 7;
+        std::vector<Node> nodes;
+        std::vector<Rsize_t> stringAt;
+        std::vector<int> stringLen; // -1 for NA
+        bool ok;
 
-        int state;
+        static bool Structural (int type) {
+            return type == XT_VECTOR || type == XT_VECTOR_EXP ||
+                type == XT_LIST_NOTAG || type == XT_LIST_TAG || type == XT_ARRAY_STR;
+        }
 
-    public:
         /**
-         * Initialise the node interface side of things.
+         * Puts the end of the node at 'at' in 'end'; false if it does not
+         * fit within 'limit'.
          */
-        static void Initialize (v8::Handle<v8::Object> target) {
-            HandleScope scope;
+        bool ScanNode (const char *data, Rsize_t at, Rsize_t limit, int depth, Rsize_t &end) {
+            if (depth > 512 || at + 4 > limit)
+                return false;
+            int header = (data[at] & XT_LARGE) ? 8 : 4;
+            if (at + header > limit)
+                return false;
+            Rsize_t len = getRexpLen(data, at);
+            if (len > limit - at - header)
+                return false;
 
-            Local<FunctionTemplate> t = FunctionTemplate::New(New);
+            unsigned int index = nodes.size();
+            nodes.push_back(Node());
 
-            t->Inherit(EventEmitter::constructor_template);
-            t->InstanceTemplate()->SetInternalFieldCount(1);
+            Node n;
+            n.type = data[at] & 63;
+            n.at = at;
+            n.end = at + header + len;
+            n.hasAttr = (data[at] & XT_HAS_ATTR) != 0;
+            n.strings = n.count = 0;
 
-            close_symbol = NODE_PSYMBOL("close");
-            connect_symbol = NODE_PSYMBOL("connect");
-            login_symbol = NODE_PSYMBOL("login");
-            result_symbol = NODE_PSYMBOL("result");
-            command_sent_symbol = NODE_PSYMBOL("commandsent");
+            Rsize_t p = at + header;
+            if (n.hasAttr && Structural(n.type) && !ScanNode(data, p, n.end, depth + 1, p))
+                return false;
+            n.body = p;
 
-            NODE_SET_PROTOTYPE_METHOD(t, "connect", Connect);
-            NODE_SET_PROTOTYPE_METHOD(t, "close", Close);
-            NODE_SET_PROTOTYPE_METHOD(t, "query", Query);
-            NODE_SET_PROTOTYPE_METHOD(t, "login", Login);
+            if (n.type == XT_ARRAY_STR) {
+                n.strings = stringAt.size();
+                while (p < n.end && data[p] != 1) {
+                    const char *e = (const char *) memchr(data + p, 0, n.end - p);
+                    if (!e)
+                        return false;
+                    int l = e - (data + p);
+                    stringAt.push_back(p);
+                    stringLen.push_back((l == 1 && data[p] == (char) 0xff) ? -1 : l);
+                    p += l + 1;
+                }
+                n.count = stringAt.size() - n.strings;
+            } else if (Structural(n.type)) {
+                while (p < n.end) {
+                    if (!ScanNode(data, p, n.end, depth + 1, p))
+                        return false;
+                }
+            }
 
-            t->PrototypeTemplate()->SetAccessor(STATE_SYMBOL, StateGetter);
+            n.next = nodes.size();
+            nodes[index] = n;
+            end = n.end;
+            return true;
+        }
 
-            target->Set(String::NewSymbol("Connection"), t->GetFunction());
+        Local<Value> MaterializeNode (char *data, unsigned int &i, const DecodeOptions &options) {
+            HandleScope scope;
+            unsigned int self = i;
+            const Node &n = nodes[self];
+            i = n.next;
 
-            initsocks(); // sisock for windows.
-        }
+            if (!Structural(n.type)) {
+                Rsize_t at = n.at;
+                return scope.Close(parseRexp(data, at, options));
+            }
 
-        /**
-         * Connect to Rserve.
-         */
-        bool Connect (const char *host, uint32_t port) {
-            if (connection_) return false;
+            unsigned int child = self + 1;
+            Local<Value> attributes = Local<Value>::New(Null());
+            if (n.hasAttr)
+                attributes = MaterializeNode(data, child, options);
 
-            connection_ = new Rconnection();
-            int i = connection_->connect();
+            Local<Value> retval;
+            if (n.type == XT_ARRAY_STR) {
+                Local<Array> a = Array::New(n.count);
+                for (int k = 0; k < n.count; ++k) {
+                    int s = n.strings + k;
+                    Local<Value> v;
+                    if (stringLen[s] < 0)
+                        v = Local<Value>::New(Null()); // NA_STRING
+                    else if (options.strings)
+                        v = options.strings->Get(data + stringAt[s], stringLen[s]);
+                    else
+                        v = String::New(data + stringAt[s], stringLen[s]);
+                    a->Set(Integer::New(k), v);
+                }
+                retval = a;
+            } else if (n.type == XT_LIST_NOTAG || n.type == XT_LIST_TAG) {
+                Local<Object> a = Object::New();
+                while (child < n.next) {
+                    Local<Value> values = MaterializeNode(data, child, options);
+                    Local<Value> tag = Local<Value>::New(Null());
+                    if (n.type == XT_LIST_TAG && child < n.next)
+                        tag = MaterializeNode(data, child, options);
+                    if (!tag->IsNull())
+                        a->Set(tag, values);
+                }
+                retval = a;
+            } else if (n.type == XT_VECTOR && options.tables && isDataFrame(attributes)) {
+                return scope.Close(decodeTable(data, n.body, n.end, attributes, options));
+            } else {
+                Local<Array> a = Array::New();
+                int c = 0;
+                while (child < n.next)
+                    a->Set(Integer::New(c++), MaterializeNode(data, child, options));
+                retval = a;
+            }
 
-            if (i) {
-                connection_ = NULL;
-                return false;
+            if (!attributes->IsNull()) {
+                Local<Object> a = Object::New();
+                a->Set (String::New("values"), retval);
+                a->Set (String::New("attributes"), attributes);
+                retval = a;
             }
+            return scope.Close(retval);
+        }
+};
 
-            state = STATE_CONNECTING;
+/**
+ * Encoding of javascript values as SEXPs for CMD_setSEXP. RexpEncoder
+ * sizes the value first so it can be written straight into the outgoing
+ * message buffer.
+ *
+ *   Float64Array / Int32Array       XT_ARRAY_DOUBLE / XT_ARRAY_INT (a memcpy)
+ *   number, array of numbers        XT_ARRAY_DOUBLE
+ *   string, array of strings        XT_ARRAY_STR
+ *   boolean, array of booleans      XT_ARRAY_BOOL
+ *   null, undefined                 XT_NULL
+ *   any other array                 XT_VECTOR (a list)
+ *   any other object                XT_VECTOR with a names attribute
+ *
+ * null and undefined within a vector become NA.
+ */
+enum RexpEncoding {
+    ENCODE_NULL, ENCODE_DOUBLES, ENCODE_STRINGS, ENCODE_BOOLS,
+    ENCODE_TYPED_DOUBLES, ENCODE_TYPED_INTS, ENCODE_LIST, ENCODE_NAMED_LIST,
+    ENCODE_UNSUPPORTED
+};
 
-            int fd = connection_->getSocket();
+#define ENCODE_MAX_DEPTH 64 // nesting limit, so cycles fail rather than recurse forever
 
-            ev_io_set(&read_watcher_, fd, EV_READ);
-            ev_io_set(&write_watcher_, fd, EV_WRITE);
+static const char *ENCODE_NAMES_TAG = "names";
 
-            ev_io_start(EV_DEFAULT_ &read_watcher_);
-            ev_io_start(EV_DEFAULT_ &write_watcher_);
+/**
+ * The most a SEXP sent to R may take: its header holds 56 bits of
+ * length, and the whole message must fit in memory here.
+ */
+static const Rsize_t MAX_ENCODED_BYTES =
+    sizeof(size_t) > 4 ? (Rsize_t) 0xffffffffffffffULL : (Rsize_t) 0x7fffffff;
 
-            Ref(); // ??
+static RexpEncoding elementEncoding (Handle<Value> v) {
+    if (v->IsNumber()) return ENCODE_DOUBLES;
+    if (v->IsString()) return ENCODE_STRINGS;
+    if (v->IsBoolean()) return ENCODE_BOOLS;
+    return ENCODE_UNSUPPORTED;
+}
 
+static RexpEncoding rexpEncoding (Handle<Value> v) {
+    if (v->IsUndefined() || v->IsNull())
+        return ENCODE_NULL;
+    if (v->IsFunction())
+        return ENCODE_UNSUPPORTED;
+    if (v->IsArray()) {
+        Handle<Array> a = Handle<Array>::Cast(v);
+        RexpEncoding e = ENCODE_NULL;
+        for (unsigned int i = 0; i < a->Length(); ++i) {
+            Local<Value> x = a->Get(Integer::New(i));
+            if (x->IsUndefined() || x->IsNull())
+                continue;
+            RexpEncoding xe = elementEncoding(x);
+            if (xe == ENCODE_UNSUPPORTED || (e != ENCODE_NULL && xe != e))
+                return ENCODE_LIST;
+            e = xe;
+        }
+        return e == ENCODE_NULL ? ENCODE_LIST : e;
+    }
+    if (v->IsObject()) {
+        Local<Object> o = v->ToObject();
+        if (o->HasIndexedPropertiesInExternalArrayData()) {
+            switch (o->GetIndexedPropertiesExternalArrayDataType()) {
+                case kExternalDoubleArray: return ENCODE_TYPED_DOUBLES;
+                case kExternalIntArray: return ENCODE_TYPED_INTS;
+                default: return ENCODE_UNSUPPORTED;
+            }
+        }
+        return ENCODE_NAMED_LIST;
+    }
+    return elementEncoding(v);
+}
+
+/** number of elements of a vector; scalars are length 1 vectors */
+static unsigned int vectorLength (Handle<Value> v) {
+    return v->IsArray() ? Handle<Array>::Cast(v)->Length() : 1;
+}
+
+static Local<Value> vectorElement (Handle<Value> v, unsigned int i) {
+    if (v->IsArray())
+        return Handle<Array>::Cast(v)->Get(Integer::New(i));
+    return Local<Value>::New(v);
+}
+
+static int rexpHeaderSize (Rsize_t len) {
+    return len > 0x7fffff ? 8 : 4;
+}
+
+static char *writeRexpHeader (char *p, int type, Rsize_t len) {
+    if (len > 0x7fffff) {
+        ((unsigned int*)p)[0] = itop(SET_PAR(type|XT_LARGE, len));
+        ((unsigned int*)p)[1] = itop((unsigned int) (len >> 24));
+        return p + 8;
+    }
+    ((unsigned int*)p)[0] = itop(SET_PAR(type, len));
+    return p + 4;
+}
+
+/** XT_ARRAY_STR body size: NUL terminated strings ('\xff' for NA), padded with '\01' */
+static Rsize_t stringsBodySize (Handle<Value> v) {
+    Rsize_t len = 0;
+    for (unsigned int i = 0, n = vectorLength(v); i < n; ++i) {
+        Local<Value> x = vectorElement(v, i);
+        len += (x->IsString() ? x->ToString()->Utf8Length() : 1) + 1;
+    }
+    return (len + 3) & ~(Rsize_t) 3;
+}
+
+/** XT_SYMNAME 'names' tag of an attribute pairlist */
+static int namesTagSize () {
+    int len = (strlen(ENCODE_NAMES_TAG) + 1 + 3) & ~3;
+    return rexpHeaderSize(len) + len;
+}
+
+static char *encodeStrings (char *p, Handle<Value> v) {
+    char *start = p;
+    for (unsigned int i = 0, n = vectorLength(v); i < n; ++i) {
+        Local<Value> x = vectorElement(v, i);
+        if (x->IsString()) {
+            Local<String> s = x->ToString();
+            p += s->WriteUtf8(p, s->Utf8Length());
+        } else {
+            *p++ = (char) 0xff; // NA_STRING
+        }
+        *p++ = 0;
+    }
+    while ((p - start) & 3)
+        *p++ = 1;
+    return p;
+}
+
+/**
+ * Measure() sizes a value, Write() then writes it. Measure() reads each
+ * array element and object property once, into a copy of the value
+ * that javascript can't reach, and Write() works from that copy - so a
+ * getter can't make the value bigger than the room measured for it. The
+ * body lengths worked out by Measure() are kept too (in the order
+ * Write() visits the values), so nested lists are only measured once.
+ */
+class RexpEncoder {
+    public:
+        static const Rsize_t UNENCODABLE = (Rsize_t) -1;
+
+        ~RexpEncoder () {
+            frozen_.Dispose();
+        }
+
+        /**
+         * Bytes needed for 'v' as a SEXP, header included; UNENCODABLE
+         * if it cannot be encoded or would be too big.
+         */
+        Rsize_t Measure (Handle<Value> v) {
+            HandleScope scope;
+            nodes_.clear();
+            next_ = 0;
+            frozen_.Dispose();
+            frozen_.Clear();
+
+            Local<Value> frozen;
+            Rsize_t len = MeasureBody(v, 0, frozen);
+            if (len == UNENCODABLE || len > MAX_ENCODED_BYTES - 8)
+                return UNENCODABLE;
+            frozen_ = Persistent<Value>::New(frozen);
+            return rexpHeaderSize(len) + len;
+        }
+
+        /**
+         * Write the value last given to Measure() at 'p', which has the
+         * room Measure() asked for. Returns the end of what was written.
+         */
+        char *Write (char *p) {
+            HandleScope scope;
+            next_ = 0;
+            p = Write(p, frozen_);
+            frozen_.Dispose();
+            frozen_.Clear();
+            return p;
+        }
+
+    private:
+        struct Node {
+            RexpEncoding encoding;
+            Rsize_t body;
+        };
+
+        std::vector<Node> nodes_; // each value's encoding and body length, in write order
+        unsigned int next_;
+        Persistent<Value> frozen_; // what Measure() read, see above
+
+        char *Write (char *p, Handle<Value> v) {
+            HandleScope scope;
+
+            const Node &node = nodes_[next_++];
+            Rsize_t len = node.body;
+
+            switch (node.encoding) {
+                case ENCODE_NULL:
+                    return writeRexpHeader(p, XT_NULL, 0);
+                case ENCODE_DOUBLES: {
+                    p = writeRexpHeader(p, XT_ARRAY_DOUBLE, len);
+                    for (unsigned int i = 0, n = vectorLength(v); i < n; ++i) {
+                        Local<Value> x = vectorElement(v, i);
+                        double d;
+                        if (x->IsNumber()) {
+                            d = x->NumberValue();
+                        } else {
+                            uint64_t na = 0x7FF00000000007A2ULL; // NA_real
+                            memcpy(&d, &na, 8);
+                        }
+                        memcpy(p, &d, 8);
+                        p += 8;
+                    }
+                    return p;
+                }
+                case ENCODE_STRINGS:
+                    p = writeRexpHeader(p, XT_ARRAY_STR, len);
+                    return encodeStrings(p, v);
+                case ENCODE_BOOLS: {
+                    p = writeRexpHeader(p, XT_ARRAY_BOOL, len);
+                    unsigned int n = vectorLength(v);
+                    *((int32_t *) p) = itop(n);
+                    char *b = p + 4;
+                    for (unsigned int i = 0; i < n; ++i) {
+                        Local<Value> x = vectorElement(v, i);
+                        *b++ = x->IsBoolean() ? (x->BooleanValue() ? 1 : 0) : BOOL_NA;
+                    }
+                    while ((b - p) & 3)
+                        *b++ = (char) 0xff;
+                    return b;
+                }
+                case ENCODE_TYPED_DOUBLES:
+                case ENCODE_TYPED_INTS:
+                    p = writeRexpHeader(p, node.encoding == ENCODE_TYPED_DOUBLES ? XT_ARRAY_DOUBLE : XT_ARRAY_INT, len);
+                    memcpy(p, v->ToObject()->GetIndexedPropertiesExternalArrayData(), len);
+                    return p + len;
+                case ENCODE_LIST: {
+                    Handle<Array> a = Handle<Array>::Cast(v);
+                    p = writeRexpHeader(p, XT_VECTOR, len);
+                    for (unsigned int i = 0; i < a->Length(); ++i)
+                        p = Write(p, a->Get(Integer::New(i)));
+                    return p;
+                }
+                case ENCODE_NAMED_LIST: {
+                    // frozen as [names, values]
+                    Handle<Array> pair = Handle<Array>::Cast(v);
+                    Local<Array> names = Local<Array>::Cast(pair->Get(Integer::New(0)));
+                    Local<Array> values = Local<Array>::Cast(pair->Get(Integer::New(1)));
+                    Rsize_t nl = stringsBodySize(names);
+                    int tl = namesTagSize() - 4;
+
+                    p = writeRexpHeader(p, XT_VECTOR|XT_HAS_ATTR, len);
+                    // attributes: a pairlist of value then tag
+                    p = writeRexpHeader(p, XT_LIST_TAG, rexpHeaderSize(nl) + nl + namesTagSize());
+                    p = writeRexpHeader(p, XT_ARRAY_STR, nl);
+                    p = encodeStrings(p, names);
+                    p = writeRexpHeader(p, XT_SYMNAME, tl);
+                    memset(p, 0, tl);
+                    strcpy(p, ENCODE_NAMES_TAG);
+                    p += tl;
+
+                    for (unsigned int i = 0; i < values->Length(); ++i)
+                        p = Write(p, values->Get(Integer::New(i)));
+                    return p;
+                }
+                default:
+                    return p;
+            }
+        }
+
+        /**
+         * Body length of 'v', or UNENCODABLE; 'frozen' gets the copy of
+         * it that Write() is to work from.
+         */
+        Rsize_t MeasureBody (Handle<Value> v, int depth, Local<Value> &frozen) {
+            HandleScope scope;
+
+            if (depth > ENCODE_MAX_DEPTH)
+                return UNENCODABLE;
+
+            // Arrays are copied before anything else looks at them, so
+            // their encoding is that of the elements actually written.
+            Local<Value> copy = Local<Value>::New(v);
+            if (v->IsArray()) {
+                Handle<Array> a = Handle<Array>::Cast(v);
+                unsigned int n = a->Length();
+                if (n > MAX_ELEMENTS)
+                    return UNENCODABLE;
+                Local<Array> c = Array::New(n);
+                for (unsigned int i = 0; i < n; ++i)
+                    c->Set(Integer::New(i), a->Get(Integer::New(i)));
+                copy = c;
+            }
+
+            unsigned int slot = nodes_.size();
+            Node node;
+            node.encoding = rexpEncoding(copy);
+            node.body = 0;
+            nodes_.push_back(node);
+
+            Rsize_t len = 0;
+            switch (node.encoding) {
+                case ENCODE_NULL:
+                    break;
+                case ENCODE_DOUBLES:
+                    len = (Rsize_t) vectorLength(copy) * 8;
+                    break;
+                case ENCODE_STRINGS:
+                    len = stringsBodySize(copy);
+                    break;
+                case ENCODE_BOOLS:
+                    len = ((Rsize_t) 4 + vectorLength(copy) + 3) & ~(Rsize_t) 3;
+                    break;
+                case ENCODE_TYPED_DOUBLES:
+                    len = (Rsize_t) copy->ToObject()->GetIndexedPropertiesExternalArrayDataLength() * 8;
+                    break;
+                case ENCODE_TYPED_INTS:
+                    len = (Rsize_t) copy->ToObject()->GetIndexedPropertiesExternalArrayDataLength() * 4;
+                    break;
+                case ENCODE_LIST: {
+                    Local<Array> a = Local<Array>::Cast(copy);
+                    for (unsigned int i = 0; i < a->Length(); ++i) {
+                        Local<Value> element;
+                        Rsize_t l = MeasureBody(a->Get(Integer::New(i)), depth + 1, element);
+                        if (l == UNENCODABLE) return UNENCODABLE;
+                        a->Set(Integer::New(i), element);
+                        len += rexpHeaderSize(l) + l;
+                        if (len > MAX_ENCODED_BYTES) return UNENCODABLE;
+                    }
+                    break;
+                }
+                case ENCODE_NAMED_LIST: {
+                    Local<Object> o = copy->ToObject();
+                    Local<Array> names = o->GetPropertyNames();
+                    Local<Array> values = Array::New(names->Length());
+                    Rsize_t nl = stringsBodySize(names);
+                    Rsize_t al = rexpHeaderSize(nl) + nl + namesTagSize();
+                    len = rexpHeaderSize(al) + al;
+                    for (unsigned int i = 0; i < names->Length(); ++i) {
+                        Local<Value> element;
+                        Rsize_t l = MeasureBody(o->Get(names->Get(Integer::New(i))), depth + 1, element);
+                        if (l == UNENCODABLE) return UNENCODABLE;
+                        values->Set(Integer::New(i), element);
+                        len += rexpHeaderSize(l) + l;
+                        if (len > MAX_ENCODED_BYTES) return UNENCODABLE;
+                    }
+                    Local<Array> pair = Array::New(2);
+                    pair->Set(Integer::New(0), names);
+                    pair->Set(Integer::New(1), values);
+                    copy = pair;
+                    break;
+                }
+                default:
+                    return UNENCODABLE;
+            }
+            if (len > MAX_ENCODED_BYTES)
+                return UNENCODABLE;
+            nodes_[slot].body = len;
+            frozen = scope.Close(copy);
+            return len;
+        }
+};
+
+/**
+ * A data.frame as a columnar table:
+ *   { names: [...], columns: [...], types: [...], rows: n, rowNames: [...] }
+ * Numeric and integer columns become Float64Array/Int32Array style
+ * external arrays (one memcpy each), character columns arrays of
+ * interned strings, and factors arrays of their level strings - each
+ * level one shared string. Logical and any other columns are decoded as
+ * usual. 'types' gives each column's kind ("double", "integer",
+ * "factor", "character", "logical", "other") or, for a classed numeric
+ * column such as a Date, its class. 'rowNames' is only there if the row names are not the default
+ * 1..n. 'data' + 'startAt' is the first column, 'eox' the end of the last.
+ */
+Local<Value> decodeTable (char *data, Rsize_t startAt, Rsize_t eox, Handle<Value> attributes, const DecodeOptions &options) {
+    HandleScope scope;
+
+    StringTable local;
+    StringTable *table = options.strings ? options.strings : &local;
+    DecodeOptions columnOptions = options;
+    columnOptions.strings = table;
+
+    Local<Array> columns = Array::New();
+    Local<Array> types = Array::New();
+    int rows = -1;
+    int n = 0;
+
+    while (startAt < eox) {
+        Rsize_t len = getRexpLen (data, startAt);
+        bool hasAttribute = ((data[startAt]&128)!=0);
+        bool isLong = ((data[startAt]&64)!=0);
+        int type = (int)(data[startAt]&63);
+        Rsize_t body = startAt + (isLong ? 8 : 4);
+        Rsize_t end = body + len;
+
+        Local<Value> columnAttributes = Local<Value>::New(Null());
+        if (hasAttribute)
+            columnAttributes = parseRexp (data, body, columnOptions);
+
+        Local<Value> levels, cls;
+        if (columnAttributes->IsObject()) {
+            levels = columnAttributes->ToObject()->Get(String::NewSymbol("levels"));
+            cls = columnAttributes->ToObject()->Get(String::NewSymbol("class"));
+        }
+
+        Local<Value> column;
+        const char *kind;
+        int count;
+        if ((type == XT_ARRAY_DOUBLE || type == XT_ARRAY_INT) && (end - body) / 4 > MAX_ELEMENTS) {
+            column = tooLong();
+            count = 0;
+            kind = "other";
+        } else if (type == XT_ARRAY_DOUBLE) {
+            count = (end - body) / 8;
+            column = newExternalArray (data + body, count, 8, kExternalDoubleArray);
+            kind = "double";
+        } else if (type == XT_ARRAY_INT && !levels.IsEmpty() && levels->IsArray()) {
+            Handle<Array> l = Handle<Array>::Cast(levels);
+            int nl = l->Length();
+            count = (end - body) / 4;
+            Local<Array> a = Array::New(count);
+            for (int i = 0; i < count; ++i) {
+                int code = *((int32_t *) (data + body + i * 4));
+                a->Set(Integer::New(i), (code >= 1 && code <= nl) ?
+                    l->Get(Integer::New(code - 1)) : Local<Value>::New(Null())); // NA
+            }
+            column = a;
+            kind = "factor";
+        } else if (type == XT_ARRAY_INT) {
+            count = (end - body) / 4;
+            column = newExternalArray (data + body, count, 4, kExternalIntArray);
+            kind = "integer";
+        } else if (type == XT_ARRAY_STR) {
+            Rsize_t consumed;
+            Local<Array> a = decodeStrings (data + body, end - body, consumed, table);
+            count = a->Length();
+            column = a;
+            kind = "character";
+        } else {
+            Rsize_t at = startAt;
+            column = parseRexp (data, at, columnOptions);
+            count = column->IsArray() ? Handle<Array>::Cast(column)->Length() : 1;
+            kind = type == XT_ARRAY_BOOL ? "logical" : "other";
+        }
+
+        if (rows < 0)
+            rows = count;
+        columns->Set(Integer::New(n), column);
+        if (type == XT_ARRAY_DOUBLE && !cls.IsEmpty() && cls->IsArray()) // Date, POSIXct, ...
+            types->Set(Integer::New(n), Handle<Array>::Cast(cls)->Get(Integer::New(0)));
+        else
+            types->Set(Integer::New(n), String::NewSymbol(kind));
+        n++;
+        startAt = end;
+    }
+
+    Local<Object> o = attributes->ToObject();
+    Local<Value> names = o->Get(String::NewSymbol("names"));
+    Local<Value> rowNames = o->Get(String::NewSymbol("row.names"));
+
+    // Default row names are sent compactly as c(NA, -n); n is all we need
+    bool namedRows = rowNames->IsArray() && Handle<Array>::Cast(rowNames)->Length() > 0 &&
+        Handle<Array>::Cast(rowNames)->Get(Integer::New(0))->IsString();
+    if (rows < 0) { // no columns
+        rows = 0;
+        if (namedRows) {
+            rows = Handle<Array>::Cast(rowNames)->Length();
+        } else if (rowNames->IsObject()) { // an Array or, with typedArrays, an Int32Array
+            Local<Object> r = rowNames->ToObject();
+            if (r->Get(length_symbol)->Int32Value() == 2)
+                rows = abs(r->Get(Integer::New(1))->Int32Value());
+        }
+    }
+
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("names"), names->IsArray() ? names : Local<Value>::New(Array::New()));
+    result->Set(String::NewSymbol("columns"), columns);
+    result->Set(String::NewSymbol("types"), types);
+    result->Set(String::NewSymbol("rows"), Integer::New(rows));
+    if (namedRows)
+        result->Set(String::NewSymbol("rowNames"), rowNames);
+
+    return scope.Close(result);
+}
+
+/**
+ * Decodes a DT_SEXP response while it is being received. Rmessage::read
+ * hands over the content chunk by chunk (see RmessageSink); Decode() then
+ * emits a 'chunk' event for each complete element of a list, and for the
+ * values of a numeric or string vector received so far. Only the part
+ * not yet decoded is buffered, so a large result never sits in memory in
+ * full and each read only costs the decoding of what it brought in.
+ *
+ * A list element that is itself a numeric or string vector of more than
+ * PART_BYTES, without attributes of its own (a data.frame's numeric and
+ * character columns), is emitted in slices the same way, as its values
+ * arrive. Other elements - factors, say, which carry levels - are
+ * buffered until complete, and so is anything else (scalars, pairlists,
+ * ...) at the top level.
+ *
+ * 'chunk' event arguments: value, index of its first value or element,
+ * name (if the element is named), whether value is a slice of a vector's
+ * values (an Array, or typed array, to splice into the whole) rather
+ * than one element of a list, and, for the slices of a list element,
+ * that element's index. An element's slices come one after the other;
+ * the next chunk without that index, or the end, closes it.
+ */
+class RexpStreamDecoder : public RmessageSink {
+    private:
+        static const int PARAM = 0;      // waiting for the DT_SEXP header
+        static const int HEADER = 1;     // waiting for the SEXP header
+        static const int ATTRIBUTES = 2;
+        static const int BODY = 3;
+        static const int WHOLE = 4;      // not streamable, waiting for all of it
+        static const int DONE = 5;
+        static const int FAILED = 6;
+
+        static const Rsize_t PART_BYTES = 65536; // list elements larger go in slices
+
+        EventEmitter *emitter_;
+        DecodeOptions options_;
+
+        std::vector<char> pending_;
+        Rsize_t pos_;        // decoded up to here in pending_
+        int state_;
+        int type_;
+        Rsize_t remaining_;  // body bytes not yet decoded
+        Rsize_t wholeSize_;
+        int index_;          // elements emitted so far
+        int chunks_;
+
+        int partType_;       // the list element going in slices, or 0
+        Rsize_t partRemaining_; // of its body
+        int partOffset_;     // its values emitted so far
+
+        Persistent<Value> attributes_;
+
+    public:
+        RexpStreamDecoder () {
+            emitter_ = NULL;
+            Reset();
+        }
+
+        ~RexpStreamDecoder () {
+            Reset();
+        }
+
+        void Start (EventEmitter *emitter, const DecodeOptions &options) {
+            Reset();
+            emitter_ = emitter;
+            options_ = options;
+            state_ = PARAM;
+        }
+
+        /**
+         * Stop decoding and drop anything buffered.
+         */
+        void Reset () {
+            std::vector<char>().swap(pending_);
+            pos_ = 0;
+            state_ = DONE;
+            type_ = XT_NULL;
+            remaining_ = 0;
+            wholeSize_ = 0;
+            index_ = 0;
+            chunks_ = 0;
+            partType_ = 0;
+            partRemaining_ = 0;
+            partOffset_ = 0;
+            if (!attributes_.IsEmpty()) {
+                attributes_.Dispose();
+                attributes_.Clear();
+            }
+        }
+
+        int consume (const char *buf, int len) {
+            if (state_ == DONE || state_ == FAILED)
+                return 0; // ignore the rest
+            if (pos_ > 0) {
+                pending_.erase(pending_.begin(), pending_.begin() + pos_);
+                pos_ = 0;
+            }
+            pending_.insert(pending_.end(), buf, buf + len);
+            return 0;
+        }
+
+        /**
+         * Decode and emit whatever is complete. Listeners may close the
+         * connection, which resets us - so state is rechecked after each
+         * emit.
+         */
+        void Decode () {
+            HandleScope scope;
+
+            for (;;) {
+                Rsize_t avail = pending_.size() - pos_;
+                char *p = avail > 0 ? &pending_[pos_] : NULL;
+                Rsize_t size;
+
+                switch (state_) {
+                    case PARAM: {
+                        if (avail < 4)
+                            return;
+                        unsigned int hl = (p[0] & DT_LARGE) ? 8 : 4;
+                        if (avail < hl)
+                            return;
+                        if ((p[0] & 63) != DT_SEXP) {
+                            state_ = FAILED;
+                            return;
+                        }
+                        pos_ += hl;
+                        state_ = HEADER;
+                        break;
+                    }
+                    case HEADER: {
+                        if (avail < 4)
+                            return;
+                        unsigned int hl = (p[0] & XT_LARGE) ? 8 : 4;
+                        if (avail < hl)
+                            return;
+                        type_ = p[0] & 63;
+                        if (!Streamable(type_)) {
+                            wholeSize_ = hl + getRexpLen(p, 0);
+                            state_ = WHOLE;
+                            break;
+                        }
+                        remaining_ = getRexpLen(p, 0);
+                        state_ = (p[0] & XT_HAS_ATTR) ? ATTRIBUTES : BODY;
+                        pos_ += hl;
+                        break;
+                    }
+                    case WHOLE: {
+                        if (avail < wholeSize_)
+                            return;
+                        Rsize_t at = pos_;
+                        Local<Value> v = parseRexp(&pending_[0], at, options_);
+                        pos_ = at;
+                        state_ = DONE;
+                        EmitChunk(v, Local<Value>::New(Undefined()), false);
+                        index_ = 1;
+                        break;
+                    }
+                    case ATTRIBUTES: {
+                        if (!ElementAvailable(p, avail, size))
+                            return;
+                        if (size > remaining_) {
+                            state_ = FAILED;
+                            return;
+                        }
+                        Rsize_t at = pos_;
+                        attributes_ = Persistent<Value>::New(parseRexp(&pending_[0], at, options_));
+                        pos_ += size;
+                        remaining_ -= size;
+                        state_ = BODY;
+                        break;
+                    }
+                    case BODY: {
+                        if (remaining_ == 0) {
+                            state_ = DONE;
+                            break;
+                        }
+                        if (avail > remaining_)
+                            avail = remaining_;
+                        if (!DecodeBody(p, avail))
+                            return;
+                        break;
+                    }
+                    default:
+                        return;
+                }
+            }
+        }
+
+        /**
+         * The final result once the whole message has been received: a
+         * summary of what was emitted, or an error.
+         */
+        Local<Value> Finish () {
+            HandleScope scope;
+
+            Local<Value> result;
+            if (state_ != DONE) {
+                result = Exception::Error(String::New("Parse exception"));
+            } else {
+                Local<Object> o = Object::New();
+                o->Set(String::NewSymbol("chunks"), Integer::New(chunks_));
+                o->Set(String::NewSymbol("length"), Integer::New(index_));
+                o->Set(String::NewSymbol("attributes"), attributes_.IsEmpty() ?
+                    Local<Value>::New(Null()) : Local<Value>::New(attributes_));
+                result = o;
+            }
+
+            Reset();
+            return scope.Close(result);
+        }
+
+    private:
+        static bool Streamable (int type) {
+            return type == XT_VECTOR || type == XT_LIST_NOTAG || type == XT_LIST_TAG ||
+                type == XT_ARRAY_DOUBLE || type == XT_ARRAY_INT || type == XT_ARRAY_STR;
+        }
+
+        /**
+         * True if the SEXP at 'p' is wholly within 'avail'; its size
+         * (header included) is put in 'size'.
+         */
+        static bool ElementAvailable (char *p, Rsize_t avail, Rsize_t &size) {
+            if (avail < 4)
+                return false;
+            unsigned int hl = (p[0] & XT_LARGE) ? 8 : 4;
+            if (avail < hl)
+                return false;
+            size = hl + getRexpLen(p, 0);
+            return avail >= size;
+        }
+
+        /**
+         * The values of an XT_ARRAY_DOUBLE/INT/STR body that are complete
+         * in the 'avail' bytes at 'p', 'remaining' being what is left of
+         * the body: their count in 'count', the bytes they took in
+         * 'used'. An empty handle if none are complete yet.
+         */
+        Local<Value> DecodeValues (int type, char *p, Rsize_t avail, Rsize_t remaining, Rsize_t &used, int &count) {
+            HandleScope scope;
+            used = 0;
+            count = 0;
+            if (type == XT_ARRAY_STR) {
+                Local<Array> a = decodeStrings(p, avail, used, options_.strings);
+                if (used == 0)
+                    return Local<Value>();
+                count = a->Length();
+                return scope.Close(a);
+            }
+            unsigned int width = type == XT_ARRAY_DOUBLE ? 8 : 4;
+            int n = avail / width; // avail is at most a chunk or two
+            if (n == 0) {
+                if (remaining < width)
+                    state_ = FAILED; // trailing partial value
+                return Local<Value>();
+            }
+            used = n * width;
+            count = n;
+            return scope.Close(type == XT_ARRAY_DOUBLE ?
+                decodeDoubles(p, n, options_) : decodeInts(p, n, options_));
+        }
+
+        /**
+         * Decode what is complete of the body at 'p'. Returns false if
+         * nothing more can be done until more data arrives.
+         */
+        bool DecodeBody (char *p, Rsize_t avail) {
+            HandleScope scope;
+            Rsize_t size, used;
+            int count;
+
+            switch (type_) {
+                case XT_ARRAY_DOUBLE:
+                case XT_ARRAY_INT:
+                case XT_ARRAY_STR: {
+                    Local<Value> v = DecodeValues(type_, p, avail, remaining_, used, count);
+                    if (v.IsEmpty())
+                        return false;
+                    Advance(used);
+                    if (count > 0) {
+                        EmitChunk(v, Local<Value>::New(Undefined()), true);
+                        index_ += count;
+                    }
+                    return true;
+                }
+                case XT_LIST_TAG: {
+                    // value, then tag
+                    Rsize_t tagSize;
+                    if (!ElementAvailable(p, avail, size) || !ElementAvailable(p + size, avail - size, tagSize))
+                        return false;
+                    Rsize_t at = pos_;
+                    Local<Value> v = parseRexp(&pending_[0], at, options_);
+                    Local<Value> tag = parseRexp(&pending_[0], at, options_);
+                    Advance(size + tagSize);
+                    EmitChunk(v, tag, false);
+                    index_++;
+                    return true;
+                }
+                default: { // XT_VECTOR, XT_LIST_NOTAG
+                    if (partType_)
+                        return DecodePart(p, avail);
+                    if (avail >= 8) {
+                        unsigned int hl = (p[0] & XT_LARGE) ? 8 : 4;
+                        int type = p[0] & 63;
+                        Rsize_t len = getRexpLen(p, 0);
+                        if (!(p[0] & XT_HAS_ATTR) && len > PART_BYTES && len <= remaining_ - hl &&
+                            (type == XT_ARRAY_DOUBLE || type == XT_ARRAY_INT || type == XT_ARRAY_STR)) {
+                            partType_ = type;
+                            partRemaining_ = len;
+                            partOffset_ = 0;
+                            Advance(hl);
+                            return true;
+                        }
+                    }
+                    if (!ElementAvailable(p, avail, size))
+                        return false;
+                    Rsize_t at = pos_;
+                    Local<Value> v = parseRexp(&pending_[0], at, options_);
+                    Advance(size);
+                    EmitChunk(v, ElementName(index_), false);
+                    index_++;
+                    return true;
+                }
+            }
+        }
+
+        /**
+         * The next slice of the list element going in slices.
+         */
+        bool DecodePart (char *p, Rsize_t avail) {
+            HandleScope scope;
+            Rsize_t used;
+            int count;
+
+            if (avail > partRemaining_)
+                avail = partRemaining_;
+            Local<Value> v = DecodeValues(partType_, p, avail, partRemaining_, used, count);
+            if (v.IsEmpty())
+                return false;
+            Advance(used);
+            partRemaining_ -= used;
+            if (count > 0) {
+                EmitChunk(v, ElementName(index_), true, partOffset_, Integer::New(index_));
+                partOffset_ += count;
+            }
+            if (partRemaining_ == 0) {
+                partType_ = 0;
+                index_++;
+            }
+            return true;
+        }
+
+        void Advance (Rsize_t bytes) {
+            pos_ += bytes;
+            remaining_ -= bytes;
+        }
+
+        /**
+         * names(x)[i], if the attributes give names.
+         */
+        Local<Value> ElementName (int i) {
+            HandleScope scope;
+            if (!attributes_.IsEmpty() && attributes_->IsObject()) {
+                Local<Value> names = attributes_->ToObject()->Get(String::NewSymbol("names"));
+                if (names->IsArray())
+                    return scope.Close(names->ToObject()->Get(i));
+            }
+            return scope.Close(Local<Value>::New(Undefined()));
+        }
+
+        void EmitChunk (Handle<Value> value, Handle<Value> name, bool slice) {
+            EmitChunk(value, name, slice, index_, Undefined());
+        }
+
+        void EmitChunk (Handle<Value> value, Handle<Value> name, bool slice, int index, Handle<Value> element) {
+            HandleScope scope;
+            Handle<Value> argv[5] = { value, Integer::New(index), name, Boolean::New(slice), element };
+            chunks_++;
+            if (emitter_)
+                emitter_->Emit(chunk_symbol, 5, argv);
+        }
+};
+
+/**
+ * 'command' as R code that evaluates it and catches any error:
+ *
+ *   try(eval(parse(text="<command>"), envir=globalenv()), silent=TRUE)
+ *
+ * A failing command then answers with its error message (a "try-error"
+ * string) in the one response, where a bare CMD_eval only gets back
+ * ERR_Rerror and the command would have to be run again to see why.
+ *
+ * It costs a parse() of the command text in R, and the escaped command
+ * may be up to twice as long on the wire. Setup commands (and their
+ * replay on a replacement connection) and queries given { trap: false }
+ * go as they are: rserve.js batches trap errors per command already.
+ */
+std::string wrapInTry (const char *command) {
+    std::string r = "try(eval(parse(text=\"";
+    for (const char *c = command; *c; ++c) {
+        switch (*c) {
+            case '\\': r += "\\\\"; break;
+            case '"': r += "\\\""; break;
+            case '\n': r += "\\n"; break;
+            case '\r': r += "\\r"; break;
+            case '\t': r += "\\t"; break;
+            default: r += *c;
+        }
+    }
+    r += "\"), envir=globalenv()), silent=TRUE)";
+    return r;
+}
+
+/**
+ * Results of side-effect free commands, kept per connection (and so per
+ * R session) for queries that ask for it with { cache: true }. Entries
+ * are keyed by a hash of the command and the decode options, and cost
+ * the size of their response on the wire; the least recently used go
+ * once the byte budget is exceeded. A budget of 0 turns caching off.
+ *
+ * Any other command - there is no telling what R code changes in the
+ * session - and any assign() empty the cache. A hit hands out the value
+ * stored, not a copy: callers must treat cached results as read only.
+ */
+class ResultCache {
+    private:
+        struct Entry {
+            unsigned int hash;
+            std::string command;
+            Persistent<Value> result;
+            int bytes;
+        };
+
+        typedef std::list<Entry> EntryList;
+        typedef std::map<unsigned int, EntryList::iterator> EntryIndex;
+
+        EntryList entries_; // most recently used first
+        EntryIndex index_;
+
+        int maxBytes_;
+        int bytes_;
+
+    public:
+        unsigned int hits;
+        unsigned int misses;
+        unsigned int invalidations;
+
+        ResultCache () : maxBytes_(0), bytes_(0), hits(0), misses(0), invalidations(0) {}
+
+        ~ResultCache () {
+            Clear();
+        }
+
+        bool Enabled () {
+            return maxBytes_ > 0;
+        }
+
+        void SetBudget (int maxBytes) {
+            maxBytes_ = maxBytes > 0 ? maxBytes : 0;
+            Trim();
+        }
+
+        /**
+         * FNV-1a over the command, with the decode options mixed in as
+         * they change the shape of the result.
+         */
+        static unsigned int Hash (const char *command, const DecodeOptions &options) {
+            unsigned int h = 2166136261u;
+            for (const unsigned char *c = (const unsigned char *) command; *c; ++c) {
+                h ^= *c;
+                h *= 16777619u;
+            }
+            h ^= (options.typedArrays ? 1 : 0) | (options.tables ? 2 : 0) | (options.binary ? 4 : 0);
+            h *= 16777619u;
+            return h;
+        }
+
+        /**
+         * The cached result of 'command', or an empty handle on a miss.
+         * Every hit gets the same object, which must not be modified.
+         */
+        Local<Value> Find (unsigned int hash, const char *command) {
+            EntryIndex::iterator i = index_.find(hash);
+            if (i == index_.end() || i->second->command != command) {
+                misses++;
+                return Local<Value>();
+            }
+            hits++;
+            entries_.splice(entries_.begin(), entries_, i->second);
+            return Local<Value>::New(i->second->result);
+        }
+
+        void Store (unsigned int hash, const char *command, Handle<Value> result, Rsize_t bytes) {
+            if (!Enabled() || bytes > (Rsize_t) maxBytes_)
+                return;
+
+            EntryIndex::iterator i = index_.find(hash);
+            if (i != index_.end())
+                Remove(i->second);
+
+            Entry e;
+            e.hash = hash;
+            e.command = command;
+            e.bytes = bytes;
+            entries_.push_front(e);
+            entries_.front().result = Persistent<Value>::New(result);
+            index_[hash] = entries_.begin();
+            bytes_ += bytes;
+            Trim();
+        }
+
+        void Invalidate () {
+            if (entries_.empty())
+                return;
+            invalidations++;
+            Clear();
+        }
+
+        void Clear () {
+            while (!entries_.empty())
+                Remove(entries_.begin());
+        }
+
+        Local<Object> GetStats () {
+            HandleScope scope;
+            Local<Object> o = Object::New();
+            AddStats(o);
+            return scope.Close(o);
+        }
+
+        /**
+         * Add this cache's figures to 'o' (as totals, for a pool).
+         */
+        void AddStats (Handle<Object> o) {
+            Add(o, "cacheHits", hits);
+            Add(o, "cacheMisses", misses);
+            Add(o, "cacheInvalidations", invalidations);
+            Add(o, "cacheEntries", entries_.size());
+            Add(o, "cacheBytes", bytes_);
+        }
+
+    private:
+        void Remove (EntryList::iterator e) {
+            bytes_ -= e->bytes;
+            index_.erase(e->hash);
+            e->result.Dispose();
+            entries_.erase(e);
+        }
+
+        void Trim () {
+            while (bytes_ > maxBytes_ && !entries_.empty())
+                Remove(--entries_.end());
+        }
+
+        static void Add (Handle<Object> o, const char *name, unsigned int n) {
+            Local<String> key = String::NewSymbol(name);
+            unsigned int total = n + (o->Has(key) ? o->Get(key)->Uint32Value() : 0);
+            o->Set(key, Integer::NewFromUnsigned(total));
+        }
+};
+
+/**
+ * Latency histogram with power of two buckets: bucket i counts the
+ * samples under 2^i microseconds, the last one everything longer.
+ */
+class LatencyHistogram {
+    public:
+        static const int BUCKETS = 32; // up to ~36 minutes
+
+        LatencyHistogram () {
+            Reset();
+        }
+
+        void Reset () {
+            memset(counts_, 0, sizeof(counts_));
+            count_ = 0;
+            sum_ = 0;
+            max_ = 0;
+        }
+
+        void Add (double seconds) {
+            if (seconds < 0)
+                seconds = 0;
+            double us = seconds * 1e6;
+            int b = 0;
+            while (b < BUCKETS - 1 && us >= (double) (1u << b))
+                b++;
+            counts_[b]++;
+            count_++;
+            sum_ += seconds;
+            if (seconds > max_)
+                max_ = seconds;
+        }
+
+        void Merge (const LatencyHistogram &o) {
+            for (int i = 0; i < BUCKETS; ++i)
+                counts_[i] += o.counts_[i];
+            count_ += o.count_;
+            sum_ += o.sum_;
+            if (o.max_ > max_)
+                max_ = o.max_;
+        }
+
+        /**
+         * { count, meanMs, maxMs, p50Ms, p90Ms, p99Ms, buckets }. The
+         * percentiles are bucket upper bounds; 'buckets' holds the
+         * counts up to the last non-empty bucket.
+         */
+        Local<Object> ToObject () {
+            HandleScope scope;
+
+            int last = BUCKETS - 1;
+            while (last >= 0 && counts_[last] == 0)
+                last--;
+
+            Local<Array> buckets = Array::New(last + 1);
+            for (int i = 0; i <= last; ++i)
+                buckets->Set(Integer::New(i), Integer::NewFromUnsigned(counts_[i]));
+
+            Local<Object> o = Object::New();
+            o->Set(String::NewSymbol("count"), Integer::NewFromUnsigned(count_));
+            o->Set(String::NewSymbol("meanMs"), Number::New(count_ ? sum_ * 1000 / count_ : 0));
+            o->Set(String::NewSymbol("maxMs"), Number::New(max_ * 1000));
+            o->Set(String::NewSymbol("p50Ms"), Number::New(Percentile(0.5)));
+            o->Set(String::NewSymbol("p90Ms"), Number::New(Percentile(0.9)));
+            o->Set(String::NewSymbol("p99Ms"), Number::New(Percentile(0.99)));
+            o->Set(String::NewSymbol("buckets"), buckets);
+            return scope.Close(o);
+        }
+
+    private:
+        unsigned int counts_[BUCKETS];
+        unsigned int count_;
+        double sum_;
+        double max_;
+
+        double Percentile (double p) {
+            if (count_ == 0)
+                return 0;
+            unsigned int wanted = (unsigned int) (p * count_ + 0.5);
+            unsigned int seen = 0;
+            for (int i = 0; i < BUCKETS - 1; ++i) {
+                seen += counts_[i];
+                if (seen >= wanted)
+                    return (double) (1u << i) / 1000;
+            }
+            return max_ * 1000;
+        }
+};
+
+/**
+ * Timestamps (ev_time(), wall clock at microsecond resolution) of one
+ * query as it goes through the Connection states:
+ *   start      - STATE_SENDING_COMMAND
+ *   sent       - STATE_AWAITING_COMMAND_RESPONSE
+ *   firstByte  - STATE_RECEIVING_COMMAND
+ *   received   - all of the response read
+ *   done       - decoded, STATE_IDLE
+ * 'streamDecode' is decoding done while receiving (stream queries).
+ * A query answered from the cache is 'cached', its time all 'send'.
+ */
+struct QueryTiming {
+    ev_tstamp start;
+    ev_tstamp sent;
+    ev_tstamp firstByte;
+    ev_tstamp received;
+    ev_tstamp done;
+    double streamDecode;
+    double bytesOut; // doubles: a result can pass 4GB
+    double bytesIn;
+    bool cached;
+
+    void Start () {
+        start = ev_time();
+        sent = firstByte = received = done = start;
+        streamDecode = 0;
+        cached = false;
+        bytesOut = bytesIn = 0;
+    }
+
+    double Send () const { return sent - start; }
+    double Compute () const { return firstByte - sent; }
+    double Receive () const { return received - firstByte - streamDecode; }
+    double Decode () const { return done - received + streamDecode; }
+    double Total () const { return done - start; }
+
+    Local<Object> ToObject () const {
+        HandleScope scope;
+        Local<Object> o = Object::New();
+        o->Set(String::NewSymbol("sendMs"), Number::New(Send() * 1000));
+        o->Set(String::NewSymbol("computeMs"), Number::New(Compute() * 1000));
+        o->Set(String::NewSymbol("receiveMs"), Number::New(Receive() * 1000));
+        o->Set(String::NewSymbol("decodeMs"), Number::New(Decode() * 1000));
+        o->Set(String::NewSymbol("totalMs"), Number::New(Total() * 1000));
+        o->Set(String::NewSymbol("bytesOut"), Number::New(bytesOut));
+        o->Set(String::NewSymbol("bytesIn"), Number::New(bytesIn));
+        o->Set(String::NewSymbol("cached"), Boolean::New(cached));
+        return scope.Close(o);
+    }
+};
+
+/**
+ * Query timings of a connection, by phase, and traffic totals.
+ */
+class ConnectionStats {
+    public:
+        unsigned int queries;
+        unsigned int timeouts;     // queries given up on, see Connection::TimedOut
+        unsigned int replacements; // connections reopened after a timeout
+        double bytesOut; // doubles: these pass 4GB on a long lived connection
+        double bytesIn;
+        LatencyHistogram send, compute, receive, decode, total;
+
+        ConnectionStats () : queries(0), timeouts(0), replacements(0), bytesOut(0), bytesIn(0) {}
+
+        void Record (const QueryTiming &t) {
+            queries++;
+            bytesOut += t.bytesOut;
+            bytesIn += t.bytesIn;
+            send.Add(t.Send());
+            compute.Add(t.Compute());
+            receive.Add(t.Receive());
+            decode.Add(t.Decode());
+            total.Add(t.Total());
+        }
+
+        void Merge (const ConnectionStats &o) {
+            queries += o.queries;
+            timeouts += o.timeouts;
+            replacements += o.replacements;
+            bytesOut += o.bytesOut;
+            bytesIn += o.bytesIn;
+            send.Merge(o.send);
+            compute.Merge(o.compute);
+            receive.Merge(o.receive);
+            decode.Merge(o.decode);
+            total.Merge(o.total);
+        }
+
+        void AddTo (Handle<Object> o) {
+            o->Set(String::NewSymbol("queries"), Integer::NewFromUnsigned(queries));
+            o->Set(String::NewSymbol("timeouts"), Integer::NewFromUnsigned(timeouts));
+            o->Set(String::NewSymbol("replacements"), Integer::NewFromUnsigned(replacements));
+            o->Set(String::NewSymbol("bytesOut"), Number::New(bytesOut));
+            o->Set(String::NewSymbol("bytesIn"), Number::New(bytesIn));
+            o->Set(String::NewSymbol("send"), send.ToObject());
+            o->Set(String::NewSymbol("compute"), compute.ToObject());
+            o->Set(String::NewSymbol("receive"), receive.ToObject());
+            o->Set(String::NewSymbol("decode"), decode.ToObject());
+            o->Set(String::NewSymbol("total"), total.ToObject());
+        }
+};
+
+class Connection;
+
+/**
+ * Receives the events of a Connection that is owned natively (e.g. by a
+ * ConnectionPool) rather than driven from javascript.
+ */
+class ConnectionListener {
+    public:
+        virtual ~ConnectionListener () {}
+        virtual void MemberConnected (Connection *connection, bool needLogin) = 0;
+        virtual void MemberLoggedIn (Connection *connection, bool success) = 0;
+        virtual void MemberResult (Connection *connection, Handle<Value> result, Handle<Value> timing) = 0;
+        virtual void MemberClosed (Connection *connection, Handle<Value> exception) = 0;
+        virtual void MemberReplaced (Connection *connection) = 0;
+};
+
+class Connection : public EventEmitter {
+    private:
+
+        ev_io read_watcher_;
+        ev_io write_watcher_;
+
+        Rconnection *connection_;
+
+        Rmessage *resultMessage;
+        Rmessage *currentMessageCommand;
+
+        RbufferPool bufferPool_; // recycles message buffers between queries
+
+        DecodeOptions decodeOptions_;
+        RexpStreamDecoder streamDecoder_;
+        StringTable strings_;      // intern table of the response being decoded
+        RexpEncoder encoder_;
+
+        int pendingCommand_; // CMD_eval or CMD_setSEXP, to tell how to take the response
+
+        ResultCache cache_;
+        ev_timer cache_watcher_;        // delivers cache hits from the event loop
+        Persistent<Value> cachedResult_;
+        bool cacheResult_;              // store the result of the running query
+        unsigned int cacheHash_;
+        std::string cacheCommand_;
+
+        QueryTiming timing_;            // of the running query
+        ConnectionStats stats_;
+
+        // What it takes to replace the connection after a query times
+        // out (see TimedOut): where it went, the login, and the setup
+        // commands to run again.
+        ev_timer deadline_watcher_;     // the running query's timeoutMs
+        std::string host_;
+        int port_;
+        std::string user_;
+        std::string password_;
+        std::vector<std::string> setupCommands_;
+        bool replacing_;
+        unsigned int replayed_;         // setup commands run again so far
+
+        // A file transfer (readFile, writeFile, removeFile) runs as a
+        // series of commands, each sent once the last one is answered.
+        struct FileTransfer {
+            int chunkSize;
+            double bytes;               // read or written so far
+            Persistent<Object> source;  // the Buffer being written
+            int offset;                 // of the next chunk of source
+            Persistent<Value> error;    // to report once the file is closed
+            Rmessage *next;             // held back by pause()
+            int nextCommand;
+        } transfer_;
+
+        static const int STATE_UNCONNECTED = 0;
+        static const int STATE_CONNECTING = 1;
+        static const int STATE_IDLE = 2;
+        static const int STATE_SENDING_COMMAND = 3;
+        static const int STATE_AWAITING_COMMAND_RESPONSE = 4;
+        static const int STATE_RECEIVING_COMMAND = 5;
+        static const int STATE_CLOSING = 6;
+        static const int STATE_LOGGING_IN = 7;
+        static const int STATE_SENDING_LOGIN = 8;
+        static const int STATE_DECODING = 9;
+
+        /**
+         * Responses at least this long are scanned on the thread pool
+         * (see StartDecode); below it a thread hop costs more than it saves.
+         */
+        static const int OFFLOAD_DECODE_BYTES = 256 * 1024;
+
+        int state;
+        bool paused_;  // not reading the response, see Pause()
+
+        struct DecodeJob;
+        DecodeJob *decodeJob_; // the response being decoded on the thread pool
+
+        ConnectionListener *listener_; // set when owned natively, replaces Emit
+
+    public:
+        static Persistent<FunctionTemplate> constructor_template;
+
+        /**
+         * Initialise the node interface side of things.
+         */
+        static void Initialize (v8::Handle<v8::Object> target) {
+            HandleScope scope;
+
+            Local<FunctionTemplate> t = FunctionTemplate::New(New);
+            constructor_template = Persistent<FunctionTemplate>::New(t);
+
+            t->Inherit(EventEmitter::constructor_template);
+            t->InstanceTemplate()->SetInternalFieldCount(1);
+
+            close_symbol = NODE_PSYMBOL("close");
+            connect_symbol = NODE_PSYMBOL("connect");
+            login_symbol = NODE_PSYMBOL("login");
+            result_symbol = NODE_PSYMBOL("result");
+            command_sent_symbol = NODE_PSYMBOL("commandsent");
+            length_symbol = NODE_PSYMBOL("length");
+            typed_arrays_symbol = NODE_PSYMBOL("typedArrays");
+            stream_symbol = NODE_PSYMBOL("stream");
+            cache_symbol = NODE_PSYMBOL("cache");
+            timing_symbol = NODE_PSYMBOL("timing");
+            intern_symbol = NODE_PSYMBOL("intern");
+            tables_symbol = NODE_PSYMBOL("tables");
+            binary_symbol = NODE_PSYMBOL("binary");
+            chunk_symbol = NODE_PSYMBOL("chunk");
+            data_symbol = NODE_PSYMBOL("data");
+            timeout_ms_symbol = NODE_PSYMBOL("timeoutMs");
+            setup_symbol = NODE_PSYMBOL("setup");
+            trap_symbol = NODE_PSYMBOL("trap");
+            replaced_symbol = NODE_PSYMBOL("replaced");
+            session_symbol = NODE_PSYMBOL("session");
+
+            NODE_SET_PROTOTYPE_METHOD(t, "connect", Connect);
+            NODE_SET_PROTOTYPE_METHOD(t, "close", Close);
+            NODE_SET_PROTOTYPE_METHOD(t, "query", Query);
+            NODE_SET_PROTOTYPE_METHOD(t, "login", Login);
+            NODE_SET_PROTOTYPE_METHOD(t, "assign", Assign);
+            NODE_SET_PROTOTYPE_METHOD(t, "cache", Cache);
+            NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
+            NODE_SET_PROTOTYPE_METHOD(t, "pause", Pause);
+            NODE_SET_PROTOTYPE_METHOD(t, "resume", Resume);
+            NODE_SET_PROTOTYPE_METHOD(t, "detach", Detach);
+            NODE_SET_PROTOTYPE_METHOD(t, "attach", Attach);
+            NODE_SET_PROTOTYPE_METHOD(t, "readFile", ReadFile);
+            NODE_SET_PROTOTYPE_METHOD(t, "writeFile", WriteFile);
+            NODE_SET_PROTOTYPE_METHOD(t, "removeFile", RemoveFile);
+
+            t->PrototypeTemplate()->SetAccessor(STATE_SYMBOL, StateGetter);
+
+            target->Set(String::NewSymbol("Connection"), t->GetFunction());
+
+            initsocks(); // sisock for windows.
+        }
+
+        /**
+         * Connect to Rserve (a port of -1 makes host the path of a unix
+         * domain socket) or, given a 'sessionKey', to the detached
+         * session listening on host:port (see Detach).
+         */
+        bool Connect (const char *host, int port, const char *sessionKey = NULL) {
+            if (!Open(host, port, sessionKey))
+                return false;
+
+            // An attached session can't be replaced: its port only takes
+            // the one key.
+            host_ = sessionKey ? "" : host;
+            port_ = port;
+            user_.clear();
+            password_.clear();
+            setupCommands_.clear();
+
+            Ref(); // ??
+
+            return true;
+        }
+
+        bool Open (const char *host, int port, const char *sessionKey = NULL) {
+            if (connection_) return false;
+
+            connection_ = new Rconnection(host, port);
+            int i = sessionKey ? connection_->attach(sessionKey) : connection_->connect();
+
+            if (i) {
+                delete connection_;
+                connection_ = NULL;
+                return false;
+            }
+
+            state = STATE_CONNECTING;
+
+            int fd = connection_->getSocket();
+
+            ev_io_set(&read_watcher_, fd, EV_READ);
+            ev_io_set(&write_watcher_, fd, EV_WRITE);
+
+            ev_io_start(EV_DEFAULT_ &read_watcher_);
+            ev_io_start(EV_DEFAULT_ &write_watcher_);
+
+            return true;
+        }
+
+        void Close (Local<Value> exception = Local<Value>()) {
+            HandleScope scope;
+            Teardown();
+            replacing_ = false;
+            if (listener_) {
+                listener_->MemberClosed(this, exception);
+            } else if (exception.IsEmpty()) {
+                Emit(close_symbol, 0, NULL);
+            } else {
+                Emit(close_symbol, 1, &exception);
+            }
+            Unref(); // ??
+        }
+
+        /**
+         * Drop the socket and whatever was under way on it.
+         */
+        void Teardown () {
+            ev_io_stop(EV_DEFAULT_ &write_watcher_);
+            ev_io_stop(EV_DEFAULT_ &read_watcher_);
+            ev_timer_stop(EV_DEFAULT_ &cache_watcher_);
+            ev_timer_stop(EV_DEFAULT_ &deadline_watcher_);
+            delete(connection_);
+            connection_ = NULL;
+            if (decodeJob_) {
+                decodeJob_->cancelled = true; // AfterDecode frees it
+                decodeJob_ = NULL;
+            }
+            ReleaseMessages();
+            EndTransfer();
+            streamDecoder_.Reset();
+            strings_.Clear();
+            cachedResult_.Dispose();
+            cachedResult_.Clear();
+            cache_.Clear(); // the session has gone with the connection
+            state = STATE_UNCONNECTED;
+        }
+
+        bool IsIdle () {
+            return state == STATE_IDLE;
+        }
+
+        bool IsOpen () {
+            return connection_ != NULL;
+        }
+
+        bool IsConnected () {
+            return connection_ != NULL && state != STATE_CONNECTING;
+        }
+
+        void SetListener (ConnectionListener *listener) {
+            listener_ = listener;
+        }
+
+        ResultCache &Cache () {
+            return cache_;
+        }
+
+        const ConnectionStats &Timings () {
+            return stats_;
+        }
+
+        bool Login (const char *user, const char *pwd) {
+
+            if (state != STATE_IDLE) {
+                return false;
+            }
+
+            user_ = user;
+            password_ = pwd;
+
+            ReleaseMessages();
+            resultMessage = new Rmessage (&bufferPool_);
+
+            char *authbuf=(char*) malloc(strlen(user)+strlen(pwd)+22);
+            char *c;
+            strcpy(authbuf, user); c=authbuf+strlen(user);
+            *c='\n'; c++;
+            strcpy(c,pwd);
+            strcpy(c,crypt(pwd,connection_->getSalt())); // TODO deal with plaintext
+
+            currentMessageCommand = new Rmessage (CMD_login, authbuf, &bufferPool_);
+            free (authbuf);
+
+            state = STATE_SENDING_LOGIN;
+            if (!SendCommand()) {
+                state = STATE_IDLE;
+                ReleaseMessages();
+                return false;
+            }
+
+            return true;
+        }
+
+        bool Query (const char *command, Handle<Value> options) {
+
+            if (state != STATE_IDLE) {
+                return false;
+            }
+
+            timing_.Start();
+            paused_ = false;
+            decodeOptions_ = DecodeOptions();
+            decodeOptions_.read(options);
+            if (decodeOptions_.intern)
+                decodeOptions_.strings = &strings_;
+            if (decodeOptions_.binary) // the frame is made of the whole response
+                decodeOptions_.stream = false;
+            if (decodeOptions_.setup)
+                setupCommands_.push_back(command);
+
+            cacheResult_ = false;
+            if (cache_.Enabled()) {
+                if (decodeOptions_.cache && !decodeOptions_.stream) {
+                    cacheHash_ = ResultCache::Hash(command, decodeOptions_);
+                    Local<Value> hit = cache_.Find(cacheHash_, command);
+                    if (!hit.IsEmpty()) {
+                        DeliverCached(hit);
+                        return true;
+                    }
+                    cacheResult_ = true;
+                    cacheCommand_ = command;
+                } else {
+                    cache_.Invalidate();
+                }
+            }
+
+            ReleaseMessages();
+            resultMessage = new Rmessage (&bufferPool_);
+            bool trap = decodeOptions_.trap && !decodeOptions_.setup && !replacing_;
+            currentMessageCommand = new Rmessage (CMD_eval, trap ? wrapInTry(command).c_str() : command, &bufferPool_);
+            pendingCommand_ = CMD_eval;
+
+            if (decodeOptions_.stream && !listener_) {
+                streamDecoder_.Start(this, decodeOptions_);
+                resultMessage->sink = &streamDecoder_;
+            }
+            
+            state = STATE_SENDING_COMMAND;
+            if (!SendCommand()) {
+                state = STATE_IDLE;
+                ReleaseMessages();
+                streamDecoder_.Reset();
+                return false;
+            }
+
+            if (decodeOptions_.timeoutMs > 0) {
+                ev_timer_set(&deadline_watcher_, decodeOptions_.timeoutMs / 1000., 0.);
+                ev_timer_start(EV_DEFAULT_ &deadline_watcher_);
+            }
+
+            return true;
+        }
+
+        /**
+         * Stream the R side file 'path' to javascript: CMD_openFile, then
+         * CMD_readFile for 'chunkSize' bytes at a time - a 'data' event
+         * (a Buffer) each - until the file is exhausted, then
+         * CMD_closeFile. The result is the number of bytes read, or an
+         * Error. pause() holds back the next read.
+         */
+        bool ReadFile (const char *path, int chunkSize) {
+            if (!StartTransfer(chunkSize))
+                return false;
+            return SendTransferCommand(CMD_openFile, new Rmessage (CMD_openFile, path, &bufferPool_));
+        }
+
+        /**
+         * Write the Buffer 'data' to the R side file 'path' (created or
+         * truncated) in commands of 'chunkSize' bytes. The result is the
+         * number of bytes written, or an Error.
+         */
+        bool WriteFile (const char *path, Handle<Object> data, int chunkSize) {
+            if (!StartTransfer(chunkSize))
+                return false;
+            transfer_.source = Persistent<Object>::New(data);
+            return SendTransferCommand(CMD_createFile, new Rmessage (CMD_createFile, path, &bufferPool_));
+        }
+
+        /**
+         * Remove the R side file 'path'. The result is true, or an Error.
+         */
+        bool RemoveFile (const char *path) {
+            if (!StartTransfer(0))
+                return false;
+            return SendTransferCommand(CMD_removeFile, new Rmessage (CMD_removeFile, path, &bufferPool_));
+        }
+
+        /**
+         * Detach the R session (CMD_detachSession). Rserve keeps it running,
+         * listening on a port of its own for the session key, and closes
+         * this connection; the result is { port, key } for attach().
+         */
+        bool Detach () {
+
+            if (state != STATE_IDLE || listener_) {
+                return false;
+            }
+
+            timing_.Start();
+            paused_ = false;
+            decodeOptions_ = DecodeOptions();
+
+            ReleaseMessages();
+            resultMessage = new Rmessage (&bufferPool_);
+            currentMessageCommand = new Rmessage (CMD_detachSession);
+            pendingCommand_ = CMD_detachSession;
+
+            state = STATE_SENDING_COMMAND;
+            if (!SendCommand()) {
+                state = STATE_IDLE;
+                ReleaseMessages();
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Assign 'value' to 'symbol' in the R session; false, with the
+         * reason in 'error', if it can't be sent.
+         */
+        bool AssignValue (const char *symbol, Handle<Value> value, const char **error) {
+            if (state != STATE_IDLE) {
+                *error = "Cannot assign ... connection busy";
+                return false;
+            }
+
+            Rsize_t length = encoder_.Measure(value);
+            if (length == RexpEncoder::UNENCODABLE) {
+                *error = "Value cannot be assigned to an R object, or is too big";
+                return false;
+            }
+
+            if (!Assign(symbol, length)) {
+                *error = "Cannot send the assignment";
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Assign the value last sized with encoder_.Measure(), which
+         * gave 'length', to 'symbol' in the R session (CMD_setSEXP). It
+         * is written straight into the command message.
+         */
+        bool Assign (const char *symbol, Rsize_t length) {
+
+            if (state != STATE_IDLE) {
+                return false;
+            }
+
+            timing_.Start();
+            paused_ = false;
+            decodeOptions_ = DecodeOptions();
+
+            ReleaseMessages();
+            resultMessage = new Rmessage (&bufferPool_);
+
+            char *sexp;
+            currentMessageCommand = Rmessage::assignment(symbol, length, &sexp, &bufferPool_);
+            if (!currentMessageCommand) { // no memory for it
+                ReleaseMessages();
+                return false;
+            }
+            encoder_.Write(sexp);
+            pendingCommand_ = CMD_setSEXP;
+            cacheResult_ = false;
+            cache_.Invalidate();
+
+            state = STATE_SENDING_COMMAND;
+            if (!SendCommand()) {
+                state = STATE_IDLE;
+                ReleaseMessages();
+                return false;
+            }
+
+            return true;
+        }
+
+    protected:
+
+        /**
+         * Creates a new Rserve connection for javascript.
+         */
+        static Handle<Value> New (const Arguments& args) {
+            HandleScope scope;
+
+            Connection *connection = new Connection();
+            connection->Wrap(args.This());
+
+            return args.This();
+        }
+
+        /**
+         * This is the 'connect' method of the Rserve connection
+         * object
+         */
+        static Handle<Value> Connect (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+
+            HandleScope scope;
+
+            if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsInt32()) {
+                return ThrowException(Exception::Error(String::New("Must give host and port (or socket path and -1) as arguments 1 and 2.")));
+            }
+
+            String::Utf8Value host(args[0]->ToString());
+            int port = args[1]->Int32Value();
+            bool r = connection->Connect(*host, port);
+
+            if (!r) { // If we didn't connect - use errno for now.
+                return ThrowException(Exception::Error(String::New(strerror(errno))));
+            }
+
+            return Undefined();
+        }
+
+        /**
+         * readFile(path, [chunkSize]): stream an R side file, see
+         * ReadFile(). 'data' events carry the content; 'result' the byte
+         * count, or an Error.
+         */
+        static Handle<Value> ReadFile (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+
+            if (args.Length() < 1 || !args[0]->IsString()) {
+                return ThrowException(Exception::TypeError(String::New("Argument must be: file path, [chunk size]")));
+            }
+
+            String::Utf8Value path(args[0]->ToString());
+            int chunkSize = args.Length() > 1 && args[1]->IsInt32() ? args[1]->Int32Value() : 0;
+            if (!connection->ReadFile(*path, chunkSize)) {
+                return ThrowException(Exception::Error(String::New("Cannot read file ... connection busy")));
+            }
+
+            return Undefined();
+        }
+
+        /**
+         * writeFile(path, buffer, [chunkSize]): write a Buffer to an R side
+         * file, see WriteFile(). 'result' gives the byte count, or an Error.
+         */
+        static Handle<Value> WriteFile (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+
+            if (args.Length() < 2 || !args[0]->IsString() || !Buffer::HasInstance(args[1])) {
+                return ThrowException(Exception::TypeError(String::New("Arguments must be: file path, Buffer, [chunk size]")));
+            }
+
+            String::Utf8Value path(args[0]->ToString());
+            int chunkSize = args.Length() > 2 && args[2]->IsInt32() ? args[2]->Int32Value() : 0;
+            if (!connection->WriteFile(*path, args[1]->ToObject(), chunkSize)) {
+                return ThrowException(Exception::Error(String::New("Cannot write file ... connection busy")));
+            }
+
+            return Undefined();
+        }
+
+        /**
+         * removeFile(path): remove an R side file; 'result' gives true, or
+         * an Error.
+         */
+        static Handle<Value> RemoveFile (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+
+            if (args.Length() != 1 || !args[0]->IsString()) {
+                return ThrowException(Exception::TypeError(String::New("Argument must be: file path")));
+            }
+
+            String::Utf8Value path(args[0]->ToString());
+            if (!connection->RemoveFile(*path)) {
+                return ThrowException(Exception::Error(String::New("Cannot remove file ... connection busy")));
+            }
+
+            return Undefined();
+        }
+
+        /**
+         * detach(): detach the R session, see Detach(). The 'result' event
+         * gives { port, key } (or an Error), after 'close'.
+         */
+        static Handle<Value> Detach (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+
+            if (!connection->Detach()) {
+                return ThrowException(Exception::Error(String::New("Cannot detach ... connection busy")));
+            }
+
+            return Undefined();
+        }
+
+        /**
+         * attach(host, port, key): connect to a detached session, 'key'
+         * being the one detach() gave. 'connect' follows as for connect(),
+         * never needing a login.
+         */
+        static Handle<Value> Attach (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+
+            HandleScope scope;
+
+            char key[32];
+            if (args.Length() != 3 || !args[0]->IsString() || !args[1]->IsInt32() ||
+                !args[2]->IsString() || !hexToBytes(*String::Utf8Value(args[2]->ToString()), key, 32)) {
+                return ThrowException(Exception::Error(String::New("Must give host, port and session key as arguments 1, 2 and 3.")));
+            }
+
+            String::Utf8Value host(args[0]->ToString());
+            int port = args[1]->Int32Value();
+            bool r = connection->Connect(*host, port, key);
+
+            if (!r) { // If we didn't connect - use errno for now.
+                return ThrowException(Exception::Error(String::New(strerror(errno))));
+            }
+
+            return Undefined();
+        }
+
+        /**
+         * This is the 'close' method of the Rserve connection
+         * object.
+         */
+        static Handle<Value> Close (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+            connection->Close();
+            return Undefined();
+        }
+
+        static Handle<Value> Login (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+
+            if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsString()) {
+                return ThrowException(Exception::TypeError(String::New("Arguments must be: username, password")));
+            }
+
+            String::Utf8Value user(args[0]->ToString());
+            String::Utf8Value pass(args[1]->ToString());
+            bool r = connection->Login(*user, *pass);
+
+            if (!r) {
+                return ThrowException(Exception::Error(String::New("Cannot login.")));
+            }
+
+            return Undefined();
+        }
+
+        static Handle<Value> Query (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+
+            if (args.Length() == 0 || !args[0]->IsString()) {
+                return ThrowException(Exception::TypeError(String::New("First argument must be a string")));
+            }
+
+            String::Utf8Value query(args[0]->ToString());
+            bool r = connection->Query(*query, args.Length() > 1 ? args[1] : Handle<Value>());
+
+            if (!r) {
+                return ThrowException(Exception::Error(String::New("Cannot send query ... TODO")));
+            }
+
+            return Undefined();
+        }
+
+        /**
+         * This is the 'assign' method: assign(name, value). Emits 'result'
+         * with true once R has the value, or an Error.
+         */
+        static Handle<Value> Assign (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+
+            if (args.Length() != 2 || !args[0]->IsString()) {
+                return ThrowException(Exception::TypeError(String::New("Arguments must be: name, value")));
+            }
+
+            String::Utf8Value name(args[0]->ToString());
+            const char *error;
+            if (!connection->AssignValue(*name, args[1], &error)) {
+                return ThrowException(Exception::Error(String::New(error)));
+            }
+
+            return Undefined();
+        }
+
+        /**
+         * cache(bytes): the budget of the result cache; 0 (the default)
+         * turns it off.
+         */
+        static Handle<Value> Cache (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+
+            if (args.Length() != 1 || !args[0]->IsNumber()) {
+                return ThrowException(Exception::TypeError(String::New("Argument must be: cache size in bytes")));
+            }
+
+            connection->cache_.SetBudget(args[0]->Int32Value());
+            return Undefined();
+        }
+
+        /**
+         * stats(): query timing histograms by phase (send, compute,
+         * receive, decode, total), traffic and result cache figures.
+         */
+        static Handle<Value> Stats (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            HandleScope scope;
+            Local<Object> o = Object::New();
+            connection->stats_.AddTo(o);
+            connection->cache_.AddStats(o);
+            return scope.Close(o);
+        }
+
+        /**
+         * pause(), resume(): stop and restart reading the response of the
+         * running query. Meant for streamed results ({ stream: true }):
+         * while paused no more 'chunk' events come, and once the socket
+         * buffers fill Rserve blocks, so whoever consumes the chunks sets
+         * the pace without the response piling up in memory.
+         */
+        static Handle<Value> Pause (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            connection->Pause();
+            return Undefined();
+        }
+
+        static Handle<Value> Resume (const Arguments& args) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            connection->Resume();
+            return Undefined();
+        }
+
+        static Handle<Value> StateGetter (Local<String> property, const AccessorInfo& info) {
+            Connection *connection = ObjectWrap::Unwrap<Connection>(info.This());
+            assert(connection);
+            assert(property == STATE_SYMBOL);
+
+            HandleScope scope;
+
+            const char *s;
+
+            switch (connection->state) {
+                case STATE_UNCONNECTED: 
+                    s = "unconnected";
+                    break;
+                case STATE_SENDING_COMMAND: 
+                case STATE_RECEIVING_COMMAND: 
+                case STATE_AWAITING_COMMAND_RESPONSE:
+                case STATE_DECODING:
+                    s = "busy";
+                    break;
+                case STATE_IDLE:
+                    s = "idle";
+                    break;
+                case STATE_CONNECTING:
+                    s = "connecting";
+                    break;
+                case STATE_CLOSING:
+                    s = "unconnected";
+                    break;
+                case STATE_LOGGING_IN:
+                case STATE_SENDING_LOGIN:
+                    s = "logging in";
+                    break;
+            }
+
+            return scope.Close(String::NewSymbol(s));
+        }
+
+        Connection () : EventEmitter () {
+            connection_ = NULL;
+            resultMessage = NULL;
+            currentMessageCommand = NULL;
+            listener_ = NULL;
+            pendingCommand_ = CMD_eval;
+            cacheResult_ = false;
+            cacheHash_ = 0;
+            state = STATE_UNCONNECTED;
+            paused_ = false;
+            transfer_.next = NULL;
+            decodeJob_ = NULL;
+            port_ = 0;
+            replacing_ = false;
+            replayed_ = 0;
+
+            ev_init(&read_watcher_, io_event);
+            read_watcher_.data = this;
+
+            ev_init(&write_watcher_, io_event);
+            write_watcher_.data = this;
+
+            ev_timer_init(&cache_watcher_, cache_event, 0., 0.);
+            cache_watcher_.data = this;
+
+            ev_timer_init(&deadline_watcher_, deadline_event, 0., 0.);
+            deadline_watcher_.data = this;
+        }
+
+        ~Connection () {
+            assert(connection_ == NULL);
+        }
+
+    private:
+        /**
+         * Free the messages of the last command, handing their buffers
+         * back to the pool.
+         */
+        void ReleaseMessages () {
+            delete resultMessage;
+            resultMessage = NULL;
+            delete currentMessageCommand;
+            currentMessageCommand = NULL;
+        }
+
+        void MakeConnection () {
+            HandleScope scope;
+
+            int i = connection_->pollConnection();
+            if (i) {
+                CloseConnectionWithError(strerror(errno));
+                return;
+            }
+
+            if (connection_->connected()) {
+                state = STATE_IDLE;
+                ev_io_stop(EV_DEFAULT_ &write_watcher_);
+                ev_io_start(EV_DEFAULT_ &read_watcher_);
+                if (replacing_) {
+                    std::string user = user_, password = password_;
+                    if (!connection_->needsLogin())
+                        ContinueReplacement();
+                    else if (user.empty() || !Login(user.c_str(), password.c_str()))
+                        CloseConnectionWithError("Cannot log in to replace the connection");
+                    return;
+                }
+                if (listener_) {
+                    listener_->MemberConnected(this, connection_->needsLogin());
+                } else {
+                    Local<Value> needLogin = scope.Close(Boolean::New (connection_->needsLogin()));
+                    Emit(connect_symbol, 1, &needLogin);
+                }
+            }
+        }
+
+        static bool IsTransferCommand (int cmd) {
+            return cmd == CMD_openFile || cmd == CMD_readFile || cmd == CMD_createFile ||
+                cmd == CMD_writeFile || cmd == CMD_closeFile || cmd == CMD_removeFile;
+        }
+
+        bool StartTransfer (int chunkSize) {
+            if (state != STATE_IDLE || listener_)
+                return false;
+            timing_.Start();
+            paused_ = false;
+            decodeOptions_ = DecodeOptions();
+            EndTransfer();
+            transfer_.chunkSize = chunkSize > 0 ? chunkSize : 65536;
+            transfer_.bytes = 0;
+            transfer_.offset = 0;
+            return true;
+        }
+
+        void EndTransfer () {
+            delete transfer_.next;
+            transfer_.next = NULL;
+            if (!transfer_.source.IsEmpty()) {
+                transfer_.source.Dispose();
+                transfer_.source.Clear();
+            }
+            if (!transfer_.error.IsEmpty()) {
+                transfer_.error.Dispose();
+                transfer_.error.Clear();
+            }
+        }
+
+        /**
+         * Send the next command of a transfer; while paused it waits for
+         * resume(), the connection staying busy meanwhile.
+         */
+        bool SendTransferCommand (int cmd, Rmessage *message) {
+            ReleaseMessages();
+            if (paused_) {
+                transfer_.next = message;
+                transfer_.nextCommand = cmd;
+                state = STATE_AWAITING_COMMAND_RESPONSE;
+                return true;
+            }
+
+            resultMessage = new Rmessage (&bufferPool_);
+            currentMessageCommand = message;
+            pendingCommand_ = cmd;
+
+            state = STATE_SENDING_COMMAND;
+            if (!SendCommand()) {
+                state = STATE_IDLE;
+                ReleaseMessages();
+                EndTransfer();
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Move a file transfer on by a step, given the response to the
+         * last one.
+         */
+        void TransferResponse () {
+            HandleScope scope;
+
+            int cmd = pendingCommand_;
+            bool ok = (resultMessage->head.cmd & RESP_ERR) != RESP_ERR;
+            if (!ok && transfer_.error.IsEmpty())
+                transfer_.error = Persistent<Value>::New(Exception::Error(
+                    String::New(getErrorMsg(CMD_STAT(resultMessage->head.cmd)))));
+
+            Rmessage *next = NULL;
+            int nextCommand = CMD_closeFile;
+
+            switch (cmd) {
+                case CMD_openFile:
+                    if (ok) {
+                        next = new Rmessage (CMD_readFile, transfer_.chunkSize);
+                        nextCommand = CMD_readFile;
+                    }
+                    break;
+                case CMD_readFile:
+                    if (ok && resultMessage->len > 0) {
+                        // Rserve sends the bytes bare, without a DT_BYTESTREAM header
+                        int n = resultMessage->len; // at most chunkSize
+                        Buffer *buffer = Buffer::New(n);
+                        memcpy(buffer->data(), resultMessage->data, n);
+                        transfer_.bytes += n;
+                        ReleaseMessages();
+
+                        Local<Value> data = Local<Object>::New(buffer->handle_);
+                        state = STATE_AWAITING_COMMAND_RESPONSE; // busy until the transfer is done
+                        Emit(data_symbol, 1, &data);
+                        if (!connection_) // closed by a 'data' listener
+                            return;
+
+                        next = new Rmessage (CMD_readFile, transfer_.chunkSize);
+                        nextCommand = CMD_readFile;
+                    } else {
+                        next = new Rmessage (CMD_closeFile);
+                    }
+                    break;
+                case CMD_createFile:
+                case CMD_writeFile: {
+                    if (!ok) {
+                        if (cmd == CMD_writeFile)
+                            next = new Rmessage (CMD_closeFile);
+                        break;
+                    }
+                    Buffer *source = ObjectWrap::Unwrap<Buffer>(transfer_.source);
+                    transfer_.bytes = transfer_.offset; // all sent so far is written
+                    int left = (int)source->length() - transfer_.offset;
+                    if (left > 0) {
+                        int n = std::min(left, transfer_.chunkSize);
+                        next = new Rmessage (CMD_writeFile, source->data() + transfer_.offset, n, 0, &bufferPool_);
+                        nextCommand = CMD_writeFile;
+                        transfer_.offset += n;
+                    } else {
+                        next = new Rmessage (CMD_closeFile);
+                    }
+                    break;
+                }
+            }
+
+            if (next) {
+                if (!SendTransferCommand(nextCommand, next))
+                    CloseConnectionWithError(strerror(errno));
+                return;
+            }
+
+            // done: the file is closed (or never opened), or removed
+            Local<Value> result;
+            if (!transfer_.error.IsEmpty())
+                result = Local<Value>::New(transfer_.error);
+            else if (cmd == CMD_removeFile)
+                result = Local<Value>::New(True());
+            else
+                result = Number::New(transfer_.bytes);
+
+            state = STATE_IDLE;
+            timing_.done = ev_time();
+            ReleaseMessages();
+            EndTransfer();
+            DeliverResult(result);
+        }
+
+        /**
+         * The response to CMD_detachSession: DT_INT port, DT_BYTESTREAM key.
+         */
+        static Local<Value> DetachedSession (Rmessage *msg) {
+            HandleScope scope;
+
+            if ((msg->head.cmd & RESP_ERR) == RESP_ERR)
+                return scope.Close(Exception::Error(String::New(getErrorMsg(CMD_STAT(msg->head.cmd)))));
+            if (msg->pars < 2 || PAR_TYPE(*msg->par[0]) != DT_INT ||
+                PAR_TYPE(*msg->par[1]) != DT_BYTESTREAM || PAR_LEN(*msg->par[1]) < 32)
+                return scope.Close(Exception::Error(String::New("Unexpected response to detach")));
+
+            char key[65];
+            bytesToHex((const char *)(msg->par[1] + 1), 32, key);
+
+            Local<Object> o = Object::New();
+            o->Set(String::NewSymbol("port"), Integer::New(ptoi(msg->par[0][1])));
+            o->Set(String::NewSymbol("key"), String::New(key));
+            return scope.Close(o);
+        }
+
+        void CloseConnectionWithError (const char *message_s = NULL) {
+            HandleScope scope;
+
+            Local<String> message = String::New(message_s);
+            Local<Value> exception = Exception::Error(message);
+
+            Close(exception);
+        }
+
+        /**
+         * Deal with our IO socket management telling us we got some data.
+         */
+        void Event (int revents) {
+            HandleScope scope;
+
+            if (revents & EV_ERROR) {
+                CloseConnectionWithError("connection closed");
+                return;
+            }
+
+            if (revents & EV_READ) {
+                if (state == STATE_CONNECTING) {
+                    MakeConnection();
+                    return;
+                }
+                if (state == STATE_AWAITING_COMMAND_RESPONSE || state == STATE_RECEIVING_COMMAND) {
+                    if (state == STATE_AWAITING_COMMAND_RESPONSE) {
+                        timing_.firstByte = ev_time();
+                        // R is done; the deadline is for its compute time,
+                        // not for a reader pausing a streamed result
+                        ev_timer_stop(EV_DEFAULT_ &deadline_watcher_);
+                    }
+                    state = STATE_RECEIVING_COMMAND;
+                    int i= resultMessage->read(connection_->getSocket());
+                    if (i) {
+                        CloseConnectionWithError(strerror(errno));
+                        return;
+                    }
+                    if (resultMessage->sink) {
+                        ev_tstamp t = ev_time();
+                        streamDecoder_.Decode();
+                        if (!connection_) // closed by a 'chunk' listener
+                            return;
+                        timing_.streamDecode += ev_time() - t;
+                    }
+                    if (resultMessage->receiveComplete()) {
+                        state = STATE_IDLE;
+                        ev_io_stop(EV_DEFAULT_ &read_watcher_); 
+                        timing_.received = ev_time();
+                        timing_.bytesIn = resultMessage->len + sizeof(struct phdr);
+
+                        if (IsTransferCommand(pendingCommand_)) {
+                            TransferResponse();
+                            return;
+                        }
+                        
+                        Rsize_t startPoint = 0;
+                        // TODO deal with multiple pars! and different par types.
+                        Local<Value> result;
+                        bool detached = false;
+                        if (pendingCommand_ == CMD_detachSession) {
+                            result = DetachedSession (resultMessage);
+                            detached = result->IsObject() && result->ToObject()->Has(String::NewSymbol("key"));
+                        } else if (pendingCommand_ == CMD_setSEXP) {
+                            if ((resultMessage->head.cmd & RESP_ERR) == RESP_ERR)
+                                result = Exception::Error(String::New(getErrorMsg(CMD_STAT(resultMessage->head.cmd))));
+                            else
+                                result = Local<Value>::New(True());
+                        } else if (resultMessage->sink) {
+                            if ((resultMessage->head.cmd & RESP_ERR) == RESP_ERR) {
+                                streamDecoder_.Reset();
+                                result = Exception::Error(String::New(getErrorMsg(CMD_STAT(resultMessage->head.cmd))));
+                            } else {
+                                result = streamDecoder_.Finish();
+                            }
+                        } else if (resultMessage->pars > 0) { // TEST proper response code
+                            if (PAR_TYPE(*resultMessage->par[0]) == DT_SEXP) {
+                                if (decodeOptions_.binary) {
+                                    result = binaryFrame (resultMessage->parData(0));
+                                } else if (resultMessage->len >= OFFLOAD_DECODE_BYTES) {
+                                    StartDecode();
+                                    return;
+                                } else {
+                                    result = parseRexp (resultMessage->parData(0), startPoint, decodeOptions_);
+                                }
+                                if (cacheResult_)
+                                    cache_.Store(cacheHash_, cacheCommand_.c_str(), result, resultMessage->len);
+                            }
+                        } else {
+                            Local<String> message = String::New(getErrorMsg(CMD_STAT(resultMessage->head.cmd)));
+                            result = Exception::Error(message);
+                        }
+
+                        FinishQuery(result, detached);
+                    }
+                }
+                if (state == STATE_LOGGING_IN) {
+                    int i= resultMessage->read(connection_->getSocket());
+                    if (i) {
+                        CloseConnectionWithError(strerror(errno));
+                        return;
+                    }
+                    if (resultMessage->receiveComplete()) {
+                        state = STATE_IDLE;
+                        ev_io_stop(EV_DEFAULT_ &read_watcher_); 
+
+                        bool ok = resultMessage->command() == RESP_OK;
+                        ReleaseMessages();
+
+                        if (replacing_) {
+                            if (ok)
+                                ContinueReplacement();
+                            else
+                                CloseConnectionWithError("Cannot log in to replace the connection");
+                            return;
+                        }
+                        if (listener_) {
+                            listener_->MemberLoggedIn(this, ok);
+                        } else {
+                            Local<Value> success = scope.Close(Boolean::New (ok));
+                            Emit(login_symbol, 1, &success);
+                        }
+                    }
+                }
+            }
+
+            if (revents & EV_WRITE) {
+                if (state == STATE_CONNECTING) { // attach() sends the session key
+                    MakeConnection();
+                    return;
+                }
+                // Should be sending ...
+                if (state == STATE_SENDING_COMMAND || state == STATE_SENDING_LOGIN) {
+                    if (!SendCommand()) {
+                        CloseConnectionWithError(strerror(errno));
+                        return;
+                    }
+                }
+            }
+        }
+
+        void Pause () {
+            paused_ = true;
+            ev_io_stop(EV_DEFAULT_ &read_watcher_);
+        }
+
+        void Resume () {
+            if (!paused_)
+                return;
+            paused_ = false;
+            if (transfer_.next) {
+                Rmessage *next = transfer_.next;
+                transfer_.next = NULL;
+                SendTransferCommand(transfer_.nextCommand, next);
+                return;
+            }
+            if ((state == STATE_AWAITING_COMMAND_RESPONSE || state == STATE_RECEIVING_COMMAND) &&
+                !ev_is_active(&cache_watcher_)) // a cache hit reads nothing
+                ev_io_start(EV_DEFAULT_ &read_watcher_);
+        }
+
+        /**
+         * Push out as much of the current command as the socket will
+         * take. The write watcher brings us back for the rest; once it
+         * has all gone, wait for the response.
+         */
+        bool SendCommand () {
+            if (currentMessageCommand->send (connection_->getSocket()))
+                return false;
+
+            if (!currentMessageCommand->sendComplete()) {
+                ev_io_start(EV_DEFAULT_ &write_watcher_);
+                return true;
+            }
+
+            ev_io_stop(EV_DEFAULT_ &write_watcher_);
+            if (!paused_)
+                ev_io_start(EV_DEFAULT_ &read_watcher_); // now wait for the response
+
+            if (state == STATE_SENDING_LOGIN) {
+                state = STATE_LOGGING_IN;
+            } else {
+                state = STATE_AWAITING_COMMAND_RESPONSE;
+                timing_.sent = ev_time();
+                timing_.bytesOut = currentMessageCommand->len + sizeof(struct phdr);
+                if (!listener_)
+                    Emit(command_sent_symbol, 0, NULL);
+            }
             return true;
         }
 
-        void Close (Local<Value> exception = Local<Value>()) {
+        /**
+         * The end of a query, once its result has been decoded (here or
+         * by DecodeDone).
+         */
+        void FinishQuery (Handle<Value> result, bool detached = false) {
             HandleScope scope;
-            ev_io_stop(EV_DEFAULT_ &write_watcher_);
+            ev_timer_stop(EV_DEFAULT_ &deadline_watcher_);
+#ifdef DEBUG_CXX
+            printf ("COMMAND: %d\n", resultMessage->head.cmd);
+#endif
+            dumpChars ((char *)&resultMessage->head,  16);
+
+            timing_.done = ev_time();
+            stats_.Record(timing_);
+            strings_.Clear();
+
+            // Done with the buffers; release them before javascript
+            // gets the chance to send the next query.
+            ReleaseMessages();
+            if (detached)
+                Close(); // Rserve has dropped us for the session's own port
+            DeliverResult(result);
+        }
+
+        /**
+         * A large response goes to the thread pool to be scanned
+         * (RexpScan::Scan), leaving the event loop free for the other
+         * connections meanwhile; DecodeDone then creates the javascript
+         * values from the scan. The job holds the message while it is
+         * away, and a reference on us so that a Close in the meantime
+         * only cancels it.
+         */
+        struct DecodeJob {
+            Connection *connection;
+            Rmessage *message;
+            char *sexp;
+            Rsize_t length;
+            RexpScan scan;
+            bool cancelled;
+        };
+
+        void StartDecode () {
+            DecodeJob *job = new DecodeJob;
+            job->connection = this;
+            job->message = resultMessage;
+            job->sexp = resultMessage->parData(0, &job->length);
+            job->cancelled = false;
+            resultMessage = NULL;
+
+            decodeJob_ = job;
+            state = STATE_DECODING;
+            Ref();
+            eio_custom(DecodeWork, EIO_PRI_DEFAULT, AfterDecode, job);
+            ev_ref(EV_DEFAULT_UC);
+        }
+
+        static int DecodeWork (eio_req *req) {
+            DecodeJob *job = (DecodeJob *) req->data;
+            job->scan.Scan(job->sexp, job->length);
+            return 0;
+        }
+
+        static int AfterDecode (eio_req *req) {
+            ev_unref(EV_DEFAULT_UC);
+            DecodeJob *job = (DecodeJob *) req->data;
+            Connection *connection = job->connection;
+            if (!job->cancelled)
+                connection->DecodeDone(job);
+            delete job->message;
+            delete job;
+            connection->Unref();
+            return 0;
+        }
+
+        void DecodeDone (DecodeJob *job) {
+            HandleScope scope;
+            decodeJob_ = NULL;
+            resultMessage = job->message;
+            job->message = NULL;
+            state = STATE_IDLE;
+
+            Local<Value> result = job->scan.Materialize(job->sexp, decodeOptions_);
+            if (cacheResult_)
+                cache_.Store(cacheHash_, cacheCommand_.c_str(), result, resultMessage->len);
+            FinishQuery(result);
+        }
+
+        /**
+         * Give up on a query that R has worked on for longer than its
+         * timeoutMs (the deadline stops with the first byte of the
+         * response, so receiving it, paused or not, is not timed). R may
+         * be in a loop that will never end, so the socket is dropped: the
+         * query fails with an Error (its 'timeout' property true) and a
+         * new connection takes the old one's place - logged in again, and
+         * with the setup commands (queries given { setup: true }) run again.
+         * The connection is busy until then, and emits 'replaced' when
+         * ready for the next query; if it can't be replaced, it closes.
+         */
+        void TimedOut () {
+            HandleScope scope;
+            char message[64];
+            snprintf(message, sizeof(message), "Query timed out after %.0f ms", decodeOptions_.timeoutMs);
+            Local<Value> e = Exception::Error(String::New(message));
+            e->ToObject()->Set(String::NewSymbol("timeout"), True());
+
+            stats_.timeouts++;
+            timing_.done = ev_time();
+            Teardown();
+            state = STATE_CLOSING; // nothing is sent meanwhile
+            DeliverResult(e);
+            if (state != STATE_CLOSING) // closed from javascript
+                return;
+
+            if (host_.empty()) {
+                CloseConnectionWithError("Cannot replace an attached session");
+                return;
+            }
+            if (!Open(host_.c_str(), port_)) {
+                CloseConnectionWithError(strerror(errno));
+                return;
+            }
+            replacing_ = true;
+            replayed_ = 0;
+        }
+
+        /**
+         * The replacement connection is up (and logged in): run the next
+         * setup command, or hand it back to javascript.
+         */
+        void ContinueReplacement () {
+            HandleScope scope;
+            while (replayed_ < setupCommands_.size()) {
+                if (Query(setupCommands_[replayed_++].c_str(), Local<Value>::New(Undefined())))
+                    return;
+            }
+            replacing_ = false;
+            stats_.replacements++;
+            if (listener_)
+                listener_->MemberReplaced(this);
+            else
+                Emit(replaced_symbol, 0, NULL);
+        }
+
+        /**
+         * Hand the result over, with the query's timings if they were
+         * asked for.
+         */
+        void DeliverResult (Handle<Value> result) {
+            HandleScope scope;
+            if (replacing_) { // the result of a setup command being run again
+                ContinueReplacement();
+                return;
+            }
+            Local<Value> argv[2] = { Local<Value>::New(result), Local<Value>() };
+            if (decodeOptions_.timing)
+                argv[1] = timing_.ToObject();
+
+            if (listener_)
+                listener_->MemberResult(this, argv[0], argv[1]);
+            else
+                Emit(result_symbol, decodeOptions_.timing ? 2 : 1, argv);
+        }
+
+        /**
+         * Answer the query from the cache. The result still goes out from
+         * the event loop, as a response from R would.
+         */
+        void DeliverCached (Handle<Value> result) {
+            ReleaseMessages();
             ev_io_stop(EV_DEFAULT_ &read_watcher_);
-            delete(connection_);
-            connection_ = NULL;
-            if (exception.IsEmpty()) {
-                Emit(close_symbol, 0, NULL);
+            cachedResult_ = Persistent<Value>::New(result);
+            state = STATE_AWAITING_COMMAND_RESPONSE;
+            ev_timer_set(&cache_watcher_, 0., 0.);
+            ev_timer_start(EV_DEFAULT_ &cache_watcher_);
+        }
+
+        void CachedResult () {
+            HandleScope scope;
+            state = STATE_IDLE;
+            timing_.cached = true;
+            timing_.sent = timing_.firstByte = timing_.received = timing_.done = ev_time();
+            Local<Value> result = Local<Value>::New(cachedResult_);
+            cachedResult_.Dispose();
+            cachedResult_.Clear();
+            DeliverResult(result);
+        }
+
+        static void io_event (EV_P_ ev_io *w, int revents) {
+            Connection *connection = static_cast<Connection*>(w->data);
+            connection->Event(revents);
+        }
+
+        static void cache_event (EV_P_ ev_timer *w, int revents) {
+            Connection *connection = static_cast<Connection*>(w->data);
+            connection->CachedResult();
+        }
+
+        static void deadline_event (EV_P_ ev_timer *w, int revents) {
+            Connection *connection = static_cast<Connection*>(w->data);
+            connection->TimedOut();
+        }
+};
+
+Persistent<FunctionTemplate> Connection::constructor_template;
+
+/**
+ * A set of Rserve connections sharing one queue of commands. Each queued
+ * command goes to whichever member connection is idle, so a slow command
+ * only holds up its own socket.
+ *
+ * Every member is an R workspace of its own, so a command given an
+ * options.session goes to the member that session was first routed to
+ * (the open member with the fewest sessions); its objects are there. A
+ * session whose member closes starts afresh on another one.
+ *
+ * Javascript interface:
+ *   connect(host, port, size)    - emits 'connect' (needLogin) once all are up;
+ *                                  port -1 for a unix socket path
+ *   login(user, password)        - emits 'login' (success) once all are done
+ *   query(command, [options], callback)
+ *                                - a member whose query passes its
+ *                                  timeoutMs is replaced (see
+ *                                  Connection::TimedOut) while the rest
+ *                                  carry on
+ *   assign(name, value, [options], callback)
+ *                                - Connection's assign() on a member,
+ *                                  the session's if options.session
+ *   route(session)               - the member index the session's
+ *                                  commands go to, -1 if none is open
+ *   release(session)             - forget the session's member
+ *   broadcast(command, [options], callback)
+ *                                - run on every member (session setup);
+ *                                  callback gets the first member's result
+ *   stats()                      - queue depth and wait time, with the
+ *                                  members' timings and cache figures
+ *   cache(bytes)                 - result cache budget of each member
+ *   close()                      - emits 'close' once all members are closed
+ */
+class ConnectionPool : public EventEmitter, public ConnectionListener {
+    private:
+
+        struct BroadcastGroup {
+            int remaining;
+            Persistent<Value> result;
+            Persistent<Function> callback;
+        };
+
+        struct PendingQuery {
+            std::string command;       // or the name assigned to
+            bool assignment;           // assign options (the value) to command
+            Persistent<Value> options;
+            Persistent<Function> callback;
+            BroadcastGroup *broadcast; // set when part of a broadcast
+            int member;                // -1 for any member
+            unsigned long sequence;    // order of arrival
+            ev_tstamp queuedAt;
+        };
+
+        std::vector<Connection *> members_;
+        std::vector<Persistent<Object> > memberHandles_;
+        std::vector<PendingQuery *> active_; // query running on each member
+        std::vector<bool> memberUp_;         // member finished connecting
+        std::vector<bool> memberLoggingIn_;  // member's login not answered yet
+        std::deque<PendingQuery *> anyQueue_; // for whichever member is idle
+        std::vector<std::deque<PendingQuery *> > memberQueues_; // pinned to each member
+        unsigned int queued_;
+        unsigned long sequence_;
+        std::map<std::string, int> sessionMembers_; // see Route
+        std::vector<int> memberSessions_;           // sessions routed to each member
+
+        int connected_;       // members that finished connecting
+        int failed_;          // members that closed while connecting
+        bool needLogin_;
+        bool ready_;          // connected, and logged in if needed
+        bool dispatching_;
+        int loginsPending_;
+        bool loginsOk_;
+
+        // Statistics
+        unsigned int maxQueueDepth_;
+        unsigned int dispatched_;
+        unsigned int completed_;
+        double totalWait_;
+        double maxWait_;
+
+        int cacheBudget_;     // result cache size of each member
+
+    public:
+        static void Initialize (v8::Handle<v8::Object> target) {
+            HandleScope scope;
+
+            Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+            t->Inherit(EventEmitter::constructor_template);
+            t->InstanceTemplate()->SetInternalFieldCount(1);
+
+            NODE_SET_PROTOTYPE_METHOD(t, "connect", Connect);
+            NODE_SET_PROTOTYPE_METHOD(t, "close", Close);
+            NODE_SET_PROTOTYPE_METHOD(t, "query", Query);
+            NODE_SET_PROTOTYPE_METHOD(t, "broadcast", Broadcast);
+            NODE_SET_PROTOTYPE_METHOD(t, "assign", Assign);
+            NODE_SET_PROTOTYPE_METHOD(t, "route", Route);
+            NODE_SET_PROTOTYPE_METHOD(t, "release", Release);
+            NODE_SET_PROTOTYPE_METHOD(t, "login", Login);
+            NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
+            NODE_SET_PROTOTYPE_METHOD(t, "cache", Cache);
+
+            target->Set(String::NewSymbol("ConnectionPool"), t->GetFunction());
+        }
+
+        bool Connect (const char *host, int port, int size) {
+            if (!members_.empty()) return false;
+
+            Ref();
+            for (int i = 0; i < size; ++i) {
+                Local<Object> handle = Connection::constructor_template->GetFunction()->NewInstance();
+                Connection *member = ObjectWrap::Unwrap<Connection>(handle);
+                member->SetListener(this);
+                member->Cache().SetBudget(cacheBudget_);
+
+                members_.push_back(member);
+                memberHandles_.push_back(Persistent<Object>::New(handle));
+                active_.push_back(NULL);
+                memberUp_.push_back(false);
+                memberLoggingIn_.push_back(false);
+                memberQueues_.push_back(std::deque<PendingQuery *>());
+                memberSessions_.push_back(0);
+
+                if (!member->Connect(host, port)) {
+                    // Drop the members so that connect() can be tried
+                    // again; the ones already connecting close first.
+                    if (i == 0)
+                        Unref();
+                    else
+                        Close();
+                    RemoveMembers();
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        void Close () {
+            for (unsigned int i = 0; i < members_.size(); ++i) {
+                if (members_[i]->IsOpen())
+                    members_[i]->Close();
+            }
+        }
+
+        /**
+         * Log every idle member in. 'login' reports once all of them have
+         * answered (or closed), true only if every one succeeded; false
+         * here if none could even be sent the login.
+         */
+        bool Login (const char *user, const char *pwd) {
+            loginsPending_ = 1; // this loop, lest a quick answer end the round early
+            loginsOk_ = true;
+            int sent = 0;
+            for (unsigned int i = 0; i < members_.size(); ++i) {
+                if (!members_[i]->IsIdle())
+                    continue;
+                loginsPending_++;
+                memberLoggingIn_[i] = true;
+                if (members_[i]->Login(user, pwd)) {
+                    sent++;
+                } else {
+                    memberLoggingIn_[i] = false;
+                    loginsPending_--;
+                    loginsOk_ = false;
+                }
+            }
+            if (sent == 0) {
+                loginsPending_ = 0;
+                return false;
+            }
+            LoginAnswered();
+            return true;
+        }
+
+        void Enqueue (const char *command, Handle<Value> options, Handle<Function> callback, int member, BroadcastGroup *broadcast, bool assignment = false) {
+            PendingQuery *q = new PendingQuery;
+            q->command = command;
+            q->assignment = assignment;
+            q->options = Persistent<Value>::New(options);
+            q->callback = Persistent<Function>::New(callback);
+            q->broadcast = broadcast;
+            q->member = member;
+            q->sequence = sequence_++;
+            q->queuedAt = ev_now(EV_DEFAULT);
+
+            if (member >= 0)
+                memberQueues_[member].push_back(q);
+            else
+                anyQueue_.push_back(q);
+            if (++queued_ > maxQueueDepth_)
+                maxQueueDepth_ = queued_;
+
+            Dispatch();
+        }
+
+        void Query (const char *command, Handle<Value> options, Handle<Function> callback) {
+            Enqueue(command, options, callback, SessionMember(options), NULL);
+        }
+
+        void Assign (const char *name, Handle<Value> value, Handle<Value> options, Handle<Function> callback) {
+            Enqueue(name, value, callback, SessionMember(options), NULL, true);
+        }
+
+        /** the member for options.session, or -1 for any */
+        int SessionMember (Handle<Value> options) {
+            if (options.IsEmpty() || !options->IsObject())
+                return -1;
+            Local<Value> session = options->ToObject()->Get(session_symbol);
+            if (!session->IsString() || session->ToString()->Length() == 0)
+                return -1;
+            return Route(*String::Utf8Value(session));
+        }
+
+        /**
+         * The member a session's commands go to, chosen on first use.
+         */
+        int Route (const std::string &session) {
+            std::map<std::string, int>::iterator s = sessionMembers_.find(session);
+            if (s != sessionMembers_.end())
+                return s->second;
+
+            int best = -1;
+            for (unsigned int i = 0; i < members_.size(); ++i) {
+                if (members_[i]->IsOpen() && (best < 0 || memberSessions_[i] < memberSessions_[best]))
+                    best = i;
+            }
+            if (best >= 0) {
+                sessionMembers_[session] = best;
+                memberSessions_[best]++;
+            }
+            return best;
+        }
+
+        void Release (const std::string &session) {
+            std::map<std::string, int>::iterator s = sessionMembers_.find(session);
+            if (s == sessionMembers_.end())
+                return;
+            memberSessions_[s->second]--;
+            sessionMembers_.erase(s);
+        }
+
+        void Broadcast (const char *command, Handle<Value> options, Handle<Function> callback) {
+            BroadcastGroup *b = new BroadcastGroup;
+            b->remaining = 0;
+            b->callback = Persistent<Function>::New(callback);
+            for (unsigned int i = 0; i < members_.size(); ++i) {
+                if (members_[i]->IsConnected())
+                    b->remaining++;
+            }
+            if (b->remaining > 0) {
+                // Counted up front: a member can fail its share synchronously.
+                for (unsigned int i = 0; i < members_.size(); ++i) {
+                    if (members_[i]->IsConnected())
+                        Enqueue(command, options, Handle<Function>(), i, b);
+                }
             } else {
-                Emit(close_symbol, 1, &exception);
+                HandleScope scope;
+                Local<Value> e = Exception::Error(String::New("No R connection"));
+                Complete(b->callback, e);
+                b->callback.Dispose();
+                delete b;
+            }
+        }
+
+        /**
+         * Hand queued commands to idle members, oldest first. Only the
+         * front of each member's queue and of the shared one can go
+         * next, so each dispatch looks at no more than one command per
+         * member, however many are waiting behind a busy one.
+         */
+        void Dispatch () {
+            if (!ready_ || dispatching_)
+                return;
+
+            // Results and failures call back into javascript, which may
+            // queue more work, or close members; look again after each.
+            dispatching_ = true;
+            for (;;) {
+                int m = -1;
+                bool pinned = false;
+                PendingQuery *query = NULL;
+                for (unsigned int i = 0; i < members_.size(); ++i) {
+                    if (active_[i] != NULL || !members_[i]->IsIdle())
+                        continue;
+                    if (!memberQueues_[i].empty() &&
+                        (!query || memberQueues_[i].front()->sequence < query->sequence)) {
+                        query = memberQueues_[i].front();
+                        m = i;
+                        pinned = true;
+                    }
+                    if (!anyQueue_.empty() && (!query || anyQueue_.front()->sequence < query->sequence)) {
+                        query = anyQueue_.front();
+                        m = i;
+                        pinned = false;
+                    }
+                }
+                if (!query)
+                    break;
+                if (pinned)
+                    memberQueues_[m].pop_front();
+                else
+                    anyQueue_.pop_front();
+                queued_--;
+
+                double wait = ev_now(EV_DEFAULT) - query->queuedAt;
+                totalWait_ += wait;
+                if (wait > maxWait_)
+                    maxWait_ = wait;
+                dispatched_++;
+
+                active_[m] = query;
+                const char *error = "Cannot send query";
+                bool sent = query->assignment ?
+                    members_[m]->AssignValue(query->command.c_str(), query->options, &error) :
+                    members_[m]->Query(query->command.c_str(), query->options);
+                if (!sent) {
+                    HandleScope scope;
+                    active_[m] = NULL;
+                    Finish(query, Exception::Error(String::New(error)));
+                }
+            }
+            dispatching_ = false;
+        }
+
+        Local<Object> GetStats () {
+            HandleScope scope;
+
+            int idle = 0, connected = 0;
+            for (unsigned int i = 0; i < members_.size(); ++i) {
+                if (members_[i]->IsIdle())
+                    idle++;
+                if (members_[i]->IsConnected())
+                    connected++;
+            }
+
+            Local<Object> o = Object::New();
+            o->Set(String::NewSymbol("size"), Integer::New(members_.size()));
+            o->Set(String::NewSymbol("connected"), Integer::New(connected));
+            o->Set(String::NewSymbol("idle"), Integer::New(idle));
+            o->Set(String::NewSymbol("queueDepth"), Integer::New(queued_));
+            o->Set(String::NewSymbol("maxQueueDepth"), Integer::New(maxQueueDepth_));
+            o->Set(String::NewSymbol("dispatched"), Integer::New(dispatched_));
+            o->Set(String::NewSymbol("completed"), Integer::New(completed_));
+            o->Set(String::NewSymbol("totalWaitMs"), Number::New(totalWait_ * 1000));
+            o->Set(String::NewSymbol("meanWaitMs"), Number::New(dispatched_ ? totalWait_ * 1000 / dispatched_ : 0));
+            o->Set(String::NewSymbol("maxWaitMs"), Number::New(maxWait_ * 1000));
+            ConnectionStats timings;
+            for (unsigned int i = 0; i < members_.size(); ++i) {
+                timings.Merge(members_[i]->Timings());
+                members_[i]->Cache().AddStats(o);
             }
-            Unref(); // ??
+            timings.AddTo(o);
+
+            return scope.Close(o);
         }
 
-        bool Login (const char *user, const char *pwd) {
+        // ConnectionListener
 
-            if (state != STATE_IDLE) {
-                return false;
+        void MemberConnected (Connection *member, bool needLogin) {
+            connected_++;
+            memberUp_[IndexOf(member)] = true;
+            needLogin_ = needLogin;
+            if (!needLogin) {
+                ready_ = true;
+                Dispatch();
             }
+            CheckConnected();
+        }
 
-            resultMessage = new Rmessage ();
+        void MemberLoggedIn (Connection *member, bool success) {
+            memberLoggingIn_[IndexOf(member)] = false;
+            loginsOk_ = loginsOk_ && success;
+            ready_ = ready_ || success;
+            LoginAnswered();
+            Dispatch();
+        }
 
-            char *authbuf=(char*) malloc(strlen(user)+strlen(pwd)+22);
-            char *c;
-            strcpy(authbuf, user); c=authbuf+strlen(user);
-            *c='\n'; c++;
-            strcpy(c,pwd);
-            strcpy(c,crypt(pwd,connection_->getSalt())); // TODO deal with plaintext
+        void MemberResult (Connection *member, Handle<Value> result, Handle<Value> timing) {
+            int m = IndexOf(member);
+            PendingQuery *query = active_[m];
+            active_[m] = NULL;
+            completed_++;
+            if (query)
+                Finish(query, result, timing);
+            Dispatch();
+        }
 
-            currentMessageCommand = new Rmessage (CMD_login, authbuf);
-            int r = currentMessageCommand->send (connection_->getSocket());
+        void MemberClosed (Connection *member, Handle<Value> exception) {
+            HandleScope scope;
+            int m = IndexOf(member);
 
-            free (authbuf);
-            if (r) {
-                return false;
+            if (!memberUp_[m]) {
+                failed_++;
+                CheckConnected();
             }
-
-            if (!currentMessageCommand->sendComplete()) {
-                ev_io_start(&write_watcher_);
-            } else {
-                state = STATE_LOGGING_IN;
-                ev_io_stop(EV_DEFAULT_ &write_watcher_);
-                ev_io_start(EV_DEFAULT_ &read_watcher_); // now wait for the response
+            if (memberLoggingIn_[m]) { // its login will not be answered
+                memberLoggingIn_[m] = false;
+                loginsOk_ = false;
+                LoginAnswered();
             }
 
-            return true;
-        }
+            // Its sessions' workspaces are gone; route them afresh.
+            std::map<std::string, int>::iterator s = sessionMembers_.begin();
+            while (s != sessionMembers_.end()) {
+                if (s->second == m)
+                    sessionMembers_.erase(s++);
+                else
+                    ++s;
+            }
+            memberSessions_[m] = 0;
 
-        bool Query (const char *command) {
+            Local<Value> e = exception.IsEmpty() ?
+                Exception::Error(String::New("connection closed")) : Local<Value>::New(exception);
 
-            if (state != STATE_IDLE) {
-                return false;
+            bool lastOne = true;
+            for (unsigned int i = 0; i < members_.size(); ++i) {
+                if (members_[i]->IsOpen())
+                    lastOne = false;
             }
 
-            resultMessage = new Rmessage ();
-            currentMessageCommand = new Rmessage (CMD_eval, command);
-            
-            int r = currentMessageCommand->send (connection_->getSocket());
-
-            if (r) {
-                return false;
+            // Fail the running query, anything pinned to this member and,
+            // if no member is left, everything still waiting. Collected
+            // first as the callbacks may touch the queue.
+            std::vector<PendingQuery *> failed;
+            for (unsigned int i = 0; i < memberQueues_.size(); ++i) {
+                if (lastOne || i == (unsigned int) m) {
+                    failed.insert(failed.end(), memberQueues_[i].begin(), memberQueues_[i].end());
+                    memberQueues_[i].clear();
+                }
+            }
+            if (lastOne) {
+                failed.insert(failed.end(), anyQueue_.begin(), anyQueue_.end());
+                anyQueue_.clear();
             }
+            queued_ -= failed.size();
+            if (active_[m]) {
+                failed.insert(failed.begin(), active_[m]);
+                active_[m] = NULL;
+            }
+            for (unsigned int i = 0; i < failed.size(); ++i)
+                Finish(failed[i], e);
 
-            if (!currentMessageCommand->sendComplete()) {
-                ev_io_start(&write_watcher_);
+            if (!lastOne)
+                return;
+
+            if (exception.IsEmpty()) {
+                Emit(close_symbol, 0, NULL);
             } else {
-                state = STATE_AWAITING_COMMAND_RESPONSE;
-                Emit(command_sent_symbol, 0, NULL);
-                ev_io_stop(EV_DEFAULT_ &write_watcher_);
-                ev_io_start(EV_DEFAULT_ &read_watcher_); // now wait for the response
+                Emit(close_symbol, 1, &e);
             }
+            Unref();
+        }
 
-            return true;
+        void MemberReplaced (Connection *member) {
+            Dispatch();
         }
 
     protected:
 
-        /**
-         * Creates a new Rserve connection for javascript.
-         */
         static Handle<Value> New (const Arguments& args) {
             HandleScope scope;
 
-            Connection *connection = new Connection();
-            connection->Wrap(args.This());
+            ConnectionPool *pool = new ConnectionPool();
+            pool->Wrap(args.This());
 
             return args.This();
         }
 
-        /**
-         * This is the 'connect' method of the Rserve connection
-         * object
-         */
         static Handle<Value> Connect (const Arguments& args) {
-            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
 
             HandleScope scope;
 
-            if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsInt32()) {
-                return ThrowException(Exception::Error(String::New("Must give host and port as arguments 1 and 2.")));
+            if (args.Length() != 3 || !args[0]->IsString() || !args[1]->IsInt32() || !args[2]->IsInt32()) {
+                return ThrowException(Exception::Error(String::New("Must give host, port and pool size as arguments 1, 2 and 3.")));
+            }
+
+            int size = args[2]->Int32Value();
+            if (size < 1) {
+                return ThrowException(Exception::RangeError(String::New("Pool size must be at least 1.")));
             }
 
             String::Utf8Value host(args[0]->ToString());
-            uint32_t port = args[1]->Uint32Value();
-            bool r = connection->Connect(*host, port);
+            int port = args[1]->Int32Value();
+            bool r = pool->Connect(*host, port, size);
 
-            if (!r) { // If we didn't connect - use errno for now.
+            if (!r) {
                 return ThrowException(Exception::Error(String::New(strerror(errno))));
             }
 
             return Undefined();
         }
 
-        /**
-         * This is the 'close' method of the Rserve connection
-         * object.
-         */
         static Handle<Value> Close (const Arguments& args) {
-            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
             HandleScope scope;
-            connection->Close();
+            pool->Close();
             return Undefined();
         }
 
         static Handle<Value> Login (const Arguments& args) {
-            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
             HandleScope scope;
 
             if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsString()) {
@@ -469,9 +4055,8 @@ class Connection : public EventEmitter {
 
             String::Utf8Value user(args[0]->ToString());
             String::Utf8Value pass(args[1]->ToString());
-            bool r = connection->Login(*user, *pass);
 
-            if (!r) {
+            if (!pool->Login(*user, *pass)) {
                 return ThrowException(Exception::Error(String::New("Cannot login.")));
             }
 
@@ -479,186 +4064,386 @@ class Connection : public EventEmitter {
         }
 
         static Handle<Value> Query (const Arguments& args) {
-            Connection *connection = ObjectWrap::Unwrap<Connection>(args.This());
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
             HandleScope scope;
 
-            if (args.Length() == 0 || !args[0]->IsString()) {
-                return ThrowException(Exception::TypeError(String::New("First argument must be a string")));
+            if (args.Length() < 2 || !args[0]->IsString() || !args[args.Length() - 1]->IsFunction()) {
+                return ThrowException(Exception::TypeError(String::New("Arguments must be: command, [options], callback")));
             }
 
-            String::Utf8Value query(args[0]->ToString());
-            bool r = connection->Query(*query);
-
-            if (!r) {
-                return ThrowException(Exception::Error(String::New("Cannot send query ... TODO")));
-            }
+            String::Utf8Value command(args[0]->ToString());
+            Local<Value> options = args.Length() > 2 ? args[1] : Local<Value>::New(Undefined());
+            pool->Query(*command, options, Local<Function>::Cast(args[args.Length() - 1]));
 
             return Undefined();
         }
 
-        static Handle<Value> StateGetter (Local<String> property, const AccessorInfo& info) {
-            Connection *connection = ObjectWrap::Unwrap<Connection>(info.This());
-            assert(connection);
-            assert(property == STATE_SYMBOL);
-
+        static Handle<Value> Broadcast (const Arguments& args) {
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
             HandleScope scope;
 
-            const char *s;
-
-            switch (connection->state) {
-                case STATE_UNCONNECTED: 
-                    s = "unconnected";
-                    break;
-                case STATE_SENDING_COMMAND: 
-                case STATE_RECEIVING_COMMAND: 
-                case STATE_AWAITING_COMMAND_RESPONSE:
-                    s = "busy";
-                    break;
-                case STATE_IDLE:
-                    s = "idle";
-                    break;
-                case STATE_CONNECTING:
-                    s = "connecting";
-                    break;
-                case STATE_CLOSING:
-                    s = "unconnected";
-                    break;
-                case STATE_LOGGING_IN:
-                    s = "logging in";
-                    break;
+            if (args.Length() < 2 || !args[0]->IsString() || !args[args.Length() - 1]->IsFunction()) {
+                return ThrowException(Exception::TypeError(String::New("Arguments must be: command, [options], callback")));
             }
 
-            return scope.Close(String::NewSymbol(s));
+            String::Utf8Value command(args[0]->ToString());
+            Local<Value> options = args.Length() > 2 ? args[1] : Local<Value>::New(Undefined());
+            pool->Broadcast(*command, options, Local<Function>::Cast(args[args.Length() - 1]));
+
+            return Undefined();
         }
 
-        Connection () : EventEmitter () {
-            connection_ = NULL;
-            state = STATE_UNCONNECTED;
+        static Handle<Value> Assign (const Arguments& args) {
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
+            HandleScope scope;
 
-            ev_init(&read_watcher_, io_event);
-            read_watcher_.data = this;
+            if (args.Length() < 3 || !args[0]->IsString() || !args[args.Length() - 1]->IsFunction()) {
+                return ThrowException(Exception::TypeError(String::New("Arguments must be: name, value, [options], callback")));
+            }
 
-            ev_init(&write_watcher_, io_event);
-            write_watcher_.data = this;
-        }
+            String::Utf8Value name(args[0]->ToString());
+            Local<Value> options = args.Length() > 3 ? args[2] : Local<Value>::New(Undefined());
+            pool->Assign(*name, args[1], options, Local<Function>::Cast(args[args.Length() - 1]));
 
-        ~Connection () {
-            assert(connection_ == NULL);
+            return Undefined();
         }
 
-    private:
-        void MakeConnection () {
+        static Handle<Value> Route (const Arguments& args) {
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
             HandleScope scope;
 
-            int i = connection_->pollConnection();
-            if (i) {
-                CloseConnectionWithError(strerror(errno));
-                return;
+            if (args.Length() != 1 || !args[0]->IsString()) {
+                return ThrowException(Exception::TypeError(String::New("Argument must be: session")));
             }
 
-            if (connection_->connected()) {
-                state = STATE_IDLE;
-                Local<Value> needLogin = scope.Close(Boolean::New (connection_->needsLogin()));
-                Emit(connect_symbol, 1, &needLogin);
-                ev_io_stop(EV_DEFAULT_ &write_watcher_);
-                ev_io_start(EV_DEFAULT_ &read_watcher_);
-            }
+            String::Utf8Value session(args[0]->ToString());
+            return scope.Close(Integer::New(pool->Route(*session)));
         }
 
-        void CloseConnectionWithError (const char *message_s = NULL) {
+        static Handle<Value> Release (const Arguments& args) {
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
             HandleScope scope;
 
-            Local<String> message = String::New(message_s);
-            Local<Value> exception = Exception::Error(message);
+            if (args.Length() != 1 || !args[0]->IsString()) {
+                return ThrowException(Exception::TypeError(String::New("Argument must be: session")));
+            }
 
-            Close(exception);
+            String::Utf8Value session(args[0]->ToString());
+            pool->Release(*session);
+            return Undefined();
         }
 
         /**
-         * Deal with our IO socket management telling us we got some data.
+         * cache(bytes): result cache budget of each member (each is its
+         * own R session).
          */
-        void Event (int revents) {
+        static Handle<Value> Cache (const Arguments& args) {
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
             HandleScope scope;
 
-            if (revents & EV_ERROR) {
-                CloseConnectionWithError("connection closed");
-                return;
+            if (args.Length() != 1 || !args[0]->IsNumber()) {
+                return ThrowException(Exception::TypeError(String::New("Argument must be: cache size in bytes")));
             }
 
-            if (revents & EV_READ) {
-                if (state == STATE_CONNECTING) {
-                    MakeConnection();
-                    return;
-                }
-                if (state == STATE_AWAITING_COMMAND_RESPONSE || state == STATE_RECEIVING_COMMAND) {
-                    state = STATE_RECEIVING_COMMAND;
-                    int i= resultMessage->read(connection_->getSocket());
-                    if (i) {
-                        CloseConnectionWithError(strerror(errno));
-                        return;
-                    }
-                    if (resultMessage->receiveComplete()) {
-                        state = STATE_IDLE;
-                        ev_io_stop(EV_DEFAULT_ &read_watcher_); 
-                        
-                        int startPoint = 0;
-                        // TODO deal with multiple pars! and different par types.
-                        Local<Value> result;
-                        if (resultMessage->pars > 0) { // TEST proper response code
-                            if (PAR_TYPE(*resultMessage->par[0]) == DT_SEXP)
-                                result = parseRexp (((char *)resultMessage->par[0]) + 4, startPoint);
-                        } else {
-                            Local<String> message = String::New(getErrorMsg(CMD_STAT(resultMessage->head.cmd)));
-                            result = Exception::Error(message);
-                        }
+            pool->cacheBudget_ = args[0]->Int32Value();
+            for (unsigned int i = 0; i < pool->members_.size(); ++i)
+                pool->members_[i]->Cache().SetBudget(pool->cacheBudget_);
+            return Undefined();
+        }
 
-#ifdef DEBUG_CXX
-                        printf ("COMMAND: %d\n", resultMessage->head.cmd);
-#endif
-                        dumpChars ((char *)&resultMessage->head,  16);
+        static Handle<Value> Stats (const Arguments& args) {
+            ConnectionPool *pool = ObjectWrap::Unwrap<ConnectionPool>(args.This());
+            HandleScope scope;
+            return scope.Close(pool->GetStats());
+        }
 
-                        Emit(result_symbol, 1, &result);
-                    }
-                }
-                if (state == STATE_LOGGING_IN) {
-                    int i= resultMessage->read(connection_->getSocket());
-                    if (i) {
-                        CloseConnectionWithError(strerror(errno));
-                        return;
-                    }
-                    if (resultMessage->receiveComplete()) {
-                        state = STATE_IDLE;
-                        ev_io_stop(EV_DEFAULT_ &read_watcher_); 
+        ConnectionPool () : EventEmitter () {
+            connected_ = 0;
+            failed_ = 0;
+            needLogin_ = false;
+            ready_ = false;
+            dispatching_ = false;
+            loginsPending_ = 0;
+            loginsOk_ = true;
+            queued_ = 0;
+            sequence_ = 0;
+            maxQueueDepth_ = 0;
+            dispatched_ = 0;
+            completed_ = 0;
+            totalWait_ = 0;
+            maxWait_ = 0;
+            cacheBudget_ = 0;
+        }
 
-                        Local<Value> success = scope.Close(Boolean::New (resultMessage->command() == RESP_OK));
-                        Emit(login_symbol, 1, &success);
-                    }
-                }
+        ~ConnectionPool () {
+            RemoveMembers();
+        }
+
+    private:
+        void RemoveMembers () {
+            for (unsigned int i = 0; i < memberHandles_.size(); ++i) {
+                members_[i]->SetListener(NULL);
+                memberHandles_[i].Dispose();
             }
+            members_.clear();
+            memberHandles_.clear();
+            active_.clear();
+            memberUp_.clear();
+            memberLoggingIn_.clear();
+            memberQueues_.clear();
+            memberSessions_.clear();
+            sessionMembers_.clear();
+            connected_ = 0;
+            failed_ = 0;
+        }
 
-            if (revents & EV_WRITE) {
-                // Should be sending ...
-                if (state == STATE_SENDING_COMMAND) {
-                    int r = currentMessageCommand->send (connection_->getSocket());
-                    if (r)
-                        CloseConnectionWithError("bla bla bla!!");
-
-                    if (!currentMessageCommand->sendComplete()) {
-                        state = STATE_AWAITING_COMMAND_RESPONSE;
-                        Emit(command_sent_symbol, 0, NULL);
-                        ev_io_stop(EV_DEFAULT_ &write_watcher_);
-                        ev_io_start(EV_DEFAULT_ &read_watcher_); // now wait for the response
-                    }
+        /**
+         * One member's login is settled; emit 'login' once all are.
+         */
+        void LoginAnswered () {
+            HandleScope scope;
+            if (loginsPending_ > 0 && --loginsPending_ == 0) {
+                Local<Value> ok = Local<Value>::New(Boolean::New(loginsOk_));
+                Emit(login_symbol, 1, &ok);
+            }
+        }
+
+        /**
+         * Emit 'connect' once every member has either connected or failed,
+         * as long as at least one made it.
+         */
+        void CheckConnected () {
+            HandleScope scope;
+            if (connected_ > 0 && connected_ + failed_ == (int) members_.size()) {
+                Local<Value> l = Local<Value>::New(Boolean::New(needLogin_));
+                Emit(connect_symbol, 1, &l);
+            }
+        }
+
+        int IndexOf (Connection *member) {
+            for (unsigned int i = 0; i < members_.size(); ++i) {
+                if (members_[i] == member)
+                    return i;
+            }
+            assert(0);
+            return -1;
+        }
+
+        /**
+         * Deliver a query's result and release it.
+         */
+        void Finish (PendingQuery *query, Handle<Value> result, Handle<Value> timing = Handle<Value>()) {
+            if (query->broadcast) {
+                BroadcastGroup *b = query->broadcast;
+                if (b->result.IsEmpty())
+                    b->result = Persistent<Value>::New(result);
+                if (--b->remaining == 0) {
+                    Complete(b->callback, b->result);
+                    b->callback.Dispose();
+                    b->result.Dispose();
+                    delete b;
                 }
+            } else {
+                Complete(query->callback, result, timing);
             }
+
+            query->options.Dispose();
+            query->callback.Dispose();
+            delete query;
         }
 
-        static void io_event (EV_P_ ev_io *w, int revents) {
-            Connection *connection = static_cast<Connection*>(w->data);
-            connection->Event(revents);
+        void Complete (Handle<Function> callback, Handle<Value> result, Handle<Value> timing = Handle<Value>()) {
+            HandleScope scope;
+            Handle<Value> argv[2] = { result, timing };
+            TryCatch try_catch;
+            callback->Call(Context::GetCurrent()->Global(), timing.IsEmpty() ? 1 : 2, argv);
+            if (try_catch.HasCaught())
+                FatalException(try_catch);
         }
 };
 
+#ifdef RNODE_BENCH
+#include <sys/mman.h>
+#include "bench/qap1_payloads.h"
+
+/**
+ * What the javascript heap took over a benchmark run: the growth of
+ * heapUsed (as in process.memoryUsage()) between collections, summed,
+ * and the collections themselves.
+ */
+static double benchHeapAllocated = 0;
+static size_t benchHeapAfterGC = 0;
+static unsigned int benchGCs = 0;
+
+static size_t heapUsed () {
+    HeapStatistics s;
+    V8::GetHeapStatistics(&s);
+    return s.used_heap_size();
+}
+
+static void benchGCPrologue () {
+    size_t used = heapUsed();
+    if (used > benchHeapAfterGC)
+        benchHeapAllocated += used - benchHeapAfterGC;
+    benchGCs++;
+}
+
+static void benchGCEpilogue () {
+    benchHeapAfterGC = heapUsed();
+}
+
+/**
+ * benchmarkDecode([seconds], [options]): times parseRexp over the
+ * payloads of bench/qap1_payloads.h, the same ones src/bench/bench.cc
+ * gives the Rconnection.cc decoders. Only in builds for 'make bench-node'.
+ * With {offload: true} only the main thread's share of a decode handed
+ * to the thread pool is timed (RexpScan::Materialize).
+ * Returns [{ payload, decoder, runs, nsPerMessage, nsPerElement,
+ * heapBytesPerMessage, gcsPerMessage }]: the bytes are of the javascript
+ * heap, the decoded values; typed arrays' and strings' external data
+ * is not counted.
+ */
+static Handle<Value> BenchmarkDecode (const Arguments& args) {
+    HandleScope scope;
+
+    double budget = args.Length() > 0 && args[0]->IsNumber() ? args[0]->NumberValue() : 0.5;
+    DecodeOptions options;
+    options.read(args.Length() > 1 ? args[1] : Handle<Value>());
+    StringTable table;
+    if (options.intern)
+        options.strings = &table;
+    std::string decoder = "parseRexp";
+    if (options.typedArrays)
+        decoder += " (typedArrays)";
+    if (options.intern)
+        decoder += " (intern)";
+    if (options.tables)
+        decoder += " (tables)";
+    if (options.binary)
+        decoder = "binaryFrame";
+    bool offload = args.Length() > 1 && args[1]->IsObject() &&
+        args[1]->ToObject()->Get(String::NewSymbol("offload"))->BooleanValue();
+    if (offload)
+        decoder.replace(0, 9, "materialize");
+
+    std::vector<qap1bench::Payload> payloads = qap1bench::standardPayloads();
+    Local<Array> results = Array::New(payloads.size());
+    V8::SetGlobalGCPrologueCallback(benchGCPrologue);
+    V8::SetGlobalGCEpilogueCallback(benchGCEpilogue);
+    for (unsigned int i = 0; i < payloads.size(); ++i) {
+        qap1bench::Payload &p = payloads[i];
+        // skip the message header and the DT_SEXP parameter header
+        char *sexp = &p.message[sizeof(struct phdr) + 4];
+        RexpScan scan;
+        if (offload)
+            scan.Scan(sexp, p.message.size() - sizeof(struct phdr) - 4);
+
+        benchHeapAllocated = 0;
+        benchHeapAfterGC = heapUsed();
+        benchGCs = 0;
+        unsigned int runs = 0;
+        double seconds;
+        ev_tstamp start = ev_time();
+        do {
+            HandleScope iteration;
+            Rsize_t at = 0;
+            if (options.binary)
+                binaryFrame(sexp);
+            else if (offload)
+                scan.Materialize(sexp, options);
+            else
+                parseRexp(sexp, at, options);
+            table.Clear(); // a table per response
+            runs++;
+        } while ((seconds = ev_time() - start) < budget);
+        size_t used = heapUsed();
+        if (used > benchHeapAfterGC)
+            benchHeapAllocated += used - benchHeapAfterGC;
+        unsigned int gcs = benchGCs;
+
+        double ns = seconds * 1e9 / runs;
+        Local<Object> r = Object::New();
+        r->Set(String::NewSymbol("payload"), String::New(p.name.c_str()));
+        r->Set(String::NewSymbol("decoder"), String::New(decoder.c_str()));
+        r->Set(String::NewSymbol("runs"), Integer::NewFromUnsigned(runs));
+        r->Set(String::NewSymbol("nsPerMessage"), Number::New(ns));
+        r->Set(String::NewSymbol("nsPerElement"), Number::New(ns / p.elements));
+        r->Set(String::NewSymbol("heapBytesPerMessage"), Number::New(benchHeapAllocated / runs));
+        r->Set(String::NewSymbol("gcsPerMessage"), Number::New((double) gcs / runs));
+        results->Set(Integer::New(i), r);
+    }
+    V8::SetGlobalGCPrologueCallback(NULL);
+    V8::SetGlobalGCEpilogueCallback(NULL);
+    return scope.Close(results);
+}
+
+/**
+ * decodePayloads([options]): the payloads of bench/qap1_payloads.h as the
+ * /R handler would get them, for timing what javascript does with a
+ * result (tools/bench-transport.js).
+ * Returns [{ payload, elements, bytes, value }].
+ */
+static Handle<Value> DecodePayloads (const Arguments& args) {
+    HandleScope scope;
+
+    DecodeOptions options;
+    options.read(args.Length() > 0 ? args[0] : Handle<Value>());
+
+    std::vector<qap1bench::Payload> payloads = qap1bench::standardPayloads();
+    Local<Array> results = Array::New(payloads.size());
+    for (unsigned int i = 0; i < payloads.size(); ++i) {
+        qap1bench::Payload &p = payloads[i];
+        char *sexp = &p.message[sizeof(struct phdr) + 4];
+        Rsize_t at = 0;
+
+        Local<Object> r = Object::New();
+        r->Set(String::NewSymbol("payload"), String::New(p.name.c_str()));
+        r->Set(String::NewSymbol("elements"), Integer::NewFromUnsigned(p.elements));
+        r->Set(String::NewSymbol("bytes"), Integer::NewFromUnsigned(p.message.size()));
+        r->Set(String::NewSymbol("value"), options.binary ? Local<Value>(binaryFrame(sexp)) : parseRexp(sexp, at, options));
+        results->Set(Integer::New(i), r);
+    }
+    return scope.Close(results);
+}
+
+/**
+ * decodeLargeVector(elements, [options]): parseRexp over an XT_LARGE
+ * double vector of 'elements' values, as a DT_LARGE parameter would hold
+ * it, for tools/check-large-decode.js. The first value is 1.5 and the
+ * last 2.5; the rest are zero pages that are never written, so only the
+ * decoded copy (with typedArrays) costs memory.
+ */
+static Handle<Value> DecodeLargeVector (const Arguments& args) {
+    HandleScope scope;
+
+    Rsize_t elements = args.Length() > 0 ? (Rsize_t) args[0]->NumberValue() : 0;
+    DecodeOptions options;
+    options.read(args.Length() > 1 ? args[1] : Handle<Value>());
+
+    Rsize_t body = elements * 8;
+    Rsize_t size = 8 + body;
+    if (elements < 1 || size != (Rsize_t) (size_t) size)
+        return ThrowException(Exception::Error(String::New("Bad number of elements")));
+    char *sexp = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (sexp == MAP_FAILED)
+        return ThrowException(Exception::Error(String::New("Cannot map the vector")));
+
+    unsigned int h[2];
+    h[0] = itop((unsigned int) SET_PAR(XT_ARRAY_DOUBLE | XT_LARGE, body));
+    h[1] = itop((unsigned int) (body >> 24));
+    memcpy(sexp, h, 8);
+    double first = 1.5, last = 2.5;
+    memcpy(sexp + 8, &first, 8);
+    memcpy(sexp + size - 8, &last, 8);
+
+    Rsize_t at = 0;
+    Local<Value> value = parseRexp(sexp, at, options);
+    munmap(sexp, size);
+    return scope.Close(value);
+}
+#endif
+
 /**
  * The Nodejs interface
  */
@@ -666,4 +4451,10 @@ extern "C" void
 init (Handle<Object> target) {
     HandleScope scope;
     Connection::Initialize(target);
+    ConnectionPool::Initialize(target);
+#ifdef RNODE_BENCH
+    NODE_SET_METHOD(target, "benchmarkDecode", BenchmarkDecode);
+    NODE_SET_METHOD(target, "decodePayloads", DecodePayloads);
+    NODE_SET_METHOD(target, "decodeLargeVector", DecodeLargeVector);
+#endif
 }
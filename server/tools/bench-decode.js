@@ -0,0 +1,38 @@
+/**
+ * Times parseRexp, the binding's decoder, over the same recorded QAP1
+ * payloads src/bench/bench.cc gives the Rconnection.cc decoders, with
+ * what each message took of the javascript heap (heapUsed, as in
+ * process.memoryUsage(), between collections) and the collections per
+ * thousand messages, so options that save allocations show it. Needs
+ * the benchmark build of the binding; run it with:
+ *
+ * make bench-node
+ *
+ * or, once built, from the server directory:
+ *
+ * node tools/bench-decode.js [seconds per case]
+ */
+
+var SYS = require ('sys');
+var BINDING = require ('../bench_binding');
+
+var seconds = process.argv.length > 2 ? parseFloat(process.argv[2]) : 0.5;
+
+function pad (s, n, left) {
+    s = String(s);
+    while (s.length < n)
+        s = left ? ' ' + s : s + ' ';
+    return s;
+}
+
+SYS.puts(pad('payload', 17) + pad('decoder', 28) + pad('runs', 9, true) +
+         pad('ns/message', 13, true) + pad('ns/element', 11, true) +
+         pad('heap B/msg', 12, true) + pad('GCs/1000', 10, true));
+
+[{}, {typedArrays: true}, {intern: true}, {tables: true}, {offload: true}].forEach (function (options) {
+    BINDING.benchmarkDecode(seconds, options).forEach (function (r) {
+        SYS.puts(pad(r.payload, 17) + pad(r.decoder, 28) + pad(r.runs, 9, true) +
+                 pad(r.nsPerMessage.toFixed(0), 13, true) + pad(r.nsPerElement.toFixed(2), 11, true) +
+                 pad(r.heapBytesPerMessage.toFixed(0), 12, true) + pad((r.gcsPerMessage * 1000).toFixed(2), 10, true));
+    });
+});
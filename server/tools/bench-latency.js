@@ -0,0 +1,111 @@
+/**
+ * Round trip latency of small evaluations over TCP against a unix domain
+ * socket: runs 'queries' small commands one after the other on each
+ * transport and reports the spread of their total times, as the binding
+ * measures them ({ timing: true }). Needs the binding built ('make') and
+ * an Rserve listening on each transport - Rserve takes either a port or
+ * a socket (Rserv.conf), so start two. From the server directory:
+ *
+ * node tools/bench-latency.js [queries] [host:port] [socket path]
+ *
+ * Defaults are 2000 queries, 127.0.0.1:6311 and /var/run/Rserve/socket.
+ * RSERVE_USER and RSERVE_PASSWORD log in where Rserve requires it.
+ */
+
+var SYS = require ('sys');
+var RSERVE = require ('../rserve');
+
+var queries = process.argv.length > 2 ? parseInt(process.argv[2], 10) : 2000;
+var tcp = (process.argv.length > 3 ? process.argv[3] : '127.0.0.1:6311').split(':');
+var socket = process.argv.length > 4 ? process.argv[4] : '/var/run/Rserve/socket';
+
+// small commands, as session setup and the object browser send
+var commands = [ "1+1", "R.version.string", "exists('x')", "c(a=1, b=2)" ];
+
+function pad (s, n, left) {
+    s = String(s);
+    while (s.length < n)
+        s = left ? ' ' + s : s + ' ';
+    return s;
+}
+
+function percentile (sorted, p) {
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+/** connect, log in if need be, and run the queries; callback gets the times or an error */
+function measure (host, port, callback) {
+    var r = new RSERVE.RservConnection();
+    var times = [];
+    var started;
+
+    function next () {
+        if (times.length == queries) {
+            var wall = new Date().getTime() - started;
+            r.close();
+            callback (null, times, wall);
+            return;
+        }
+        r.request (commands[times.length % commands.length], function (result, timing) {
+            if (!timing) {
+                r.close();
+                callback (result instanceof Error ? result.message : 'no timing');
+                return;
+            }
+            times.push (timing.totalMs);
+            next();
+        }, { timing: true });
+    }
+
+    try {
+        r.connect (host, port, function (ok, requireLogin) {
+            if (!ok) {
+                callback ('cannot connect');
+                return;
+            }
+            r.login (process.env.RSERVE_USER || '', process.env.RSERVE_PASSWORD || '', function (ok) {
+                if (!ok) {
+                    callback ('cannot log in');
+                    return;
+                }
+                // a few to warm up both ends first
+                var warm = 0;
+                (function warmup () {
+                    if (warm++ == 20) {
+                        started = new Date().getTime();
+                        next();
+                        return;
+                    }
+                    r.request ("1+1", warmup);
+                })();
+            });
+        });
+    } catch (e) {
+        callback (e.message);
+    }
+}
+
+SYS.puts(pad('transport', 11) + pad('queries', 9, true) + pad('mean ms', 10, true) +
+         pad('p50 ms', 9, true) + pad('p90 ms', 9, true) + pad('p99 ms', 9, true) +
+         pad('max ms', 9, true) + pad('queries/s', 11, true));
+
+function report (name, error, times, wall) {
+    if (error) {
+        SYS.puts(pad(name, 11) + '  ' + error);
+        return;
+    }
+    var sum = 0;
+    times.forEach (function (t) { sum += t; });
+    times.sort (function (a, b) { return a - b; });
+    SYS.puts(pad(name, 11) + pad(times.length, 9, true) + pad((sum / times.length).toFixed(3), 10, true) +
+             pad(percentile(times, 0.5).toFixed(3), 9, true) + pad(percentile(times, 0.9).toFixed(3), 9, true) +
+             pad(percentile(times, 0.99).toFixed(3), 9, true) + pad(times[times.length - 1].toFixed(3), 9, true) +
+             pad((times.length * 1000 / Math.max(wall, 1)).toFixed(0), 11, true));
+}
+
+measure (tcp[0], parseInt(tcp[1] || '6311', 10), function (error, times, wall) {
+    report ('tcp', error, times, wall);
+    measure (socket, -1, function (error, times, wall) {
+        report ('unix', error, times, wall);
+    });
+});
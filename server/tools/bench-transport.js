@@ -0,0 +1,51 @@
+/**
+ * Throughput of the /R handler's result formats over the recorded QAP1
+ * payloads of src/bench/qap1_payloads.h: the default, a parseRexp decode
+ * followed by JSON.stringify, against ?format=binary, which copies the
+ * SEXP into a frame (binaryFrame). Needs the benchmark build of the
+ * binding; once built ('make bench-node'), from the server directory:
+ *
+ * node tools/bench-transport.js [seconds per case]
+ */
+
+var SYS = require ('sys');
+var BINDING = require ('../bench_binding');
+
+var seconds = process.argv.length > 2 ? parseFloat(process.argv[2]) : 0.5;
+
+function pad (s, n, left) {
+    s = String(s);
+    while (s.length < n)
+        s = left ? ' ' + s : s + ' ';
+    return s;
+}
+
+/** ns per call of f, and the size of what it returned */
+function time (f) {
+    var runs = 0, out, start = new Date().getTime(), elapsed;
+    do {
+        out = f();
+        runs++;
+    } while ((elapsed = new Date().getTime() - start) < seconds * 1000);
+    return { ns: elapsed * 1e6 / runs, bytes: out.length };
+}
+
+var decode = BINDING.benchmarkDecode(seconds, {});
+var frame = BINDING.benchmarkDecode(seconds, { binary: true });
+var decoded = BINDING.decodePayloads({});
+var framed = BINDING.decodePayloads({ binary: true });
+
+SYS.puts(pad('payload', 17) + pad('format', 8) + pad('ns/message', 13, true) +
+         pad('bytes out', 11, true) + pad('MB/s', 9, true) + pad('speedup', 9, true));
+
+decoded.forEach (function (d, i) {
+    var json = time (function () { return JSON.stringify(d.value); });
+    var jsonNs = decode[i].nsPerMessage + json.ns;
+    var binaryNs = frame[i].nsPerMessage;
+
+    [['json', jsonNs, json.bytes], ['binary', binaryNs, framed[i].value.length]].forEach (function (f) {
+        SYS.puts(pad(d.payload, 17) + pad(f[0], 8) + pad(f[1].toFixed(0), 13, true) +
+                 pad(f[2], 11, true) + pad((d.bytes * 1e3 / f[1]).toFixed(1), 9, true) +
+                 pad(f[0] == 'binary' ? (jsonNs / binaryNs).toFixed(1) + 'x' : '', 9, true));
+    });
+});
@@ -0,0 +1,38 @@
+/**
+ * parseRexp with typedArrays over double vectors past 2GB, which the
+ * binding copies into external arrays (newExternalArray): one of just
+ * over 2^28 values must come back whole, and one longer than V8 takes
+ * for an external array as an Error rather than a crash. Needs the
+ * benchmark build of the binding and some 2GB of memory for the copy;
+ * from the server directory:
+ *
+ * make large-node
+ *
+ * Exits nonzero if a case fails.
+ */
+
+var SYS = require ('sys');
+var BINDING = require ('../bench_binding');
+
+var failed = false;
+
+function check (ok, what) {
+    SYS.puts(what + ': ' + (ok ? 'ok' : 'FAILED'));
+    if (!ok)
+        failed = true;
+}
+
+// more than 2GB of doubles: the byte count no longer fits an int
+var elements = Math.pow(2, 28) + 1024;
+var v = BINDING.decodeLargeVector(elements, {typedArrays: true});
+check(!(v instanceof Error) && v.length == elements, 'typed array of ' + elements + ' doubles');
+check(v[0] == 1.5 && v[elements - 1] == 2.5 && v[elements >> 1] == 0, 'first, middle and last values');
+v = null;
+
+// past the external array limit: an Error, nothing copied
+var tooMany = Math.pow(2, 30);
+v = BINDING.decodeLargeVector(tooMany, {typedArrays: true});
+check(v instanceof Error, tooMany + ' doubles give an Error');
+
+SYS.puts(failed ? 'FAILED' : 'OK');
+process.exit(failed ? 1 : 0);